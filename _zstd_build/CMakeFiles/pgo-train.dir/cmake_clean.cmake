@@ -0,0 +1,8 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/pgo-train"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang )
+  include(CMakeFiles/pgo-train.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
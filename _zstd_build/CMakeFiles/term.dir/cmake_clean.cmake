@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/term.dir/main.cpp.o"
+  "CMakeFiles/term.dir/main.cpp.o.d"
+  "term"
+  "term.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/term.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,22 @@
+# CMake generated Testfile for 
+# Source directory: /root/repo
+# Build directory: /root/repo/_zstd_build
+# 
+# This file includes the relevant testing commands required for 
+# testing this directory and lists subdirectories to be tested as well.
+add_test(copy "/root/repo/tests/copy.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(copy PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;70;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(sigint "/root/repo/tests/sigint.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(sigint PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;71;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(vars "/root/repo/tests/vars.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(vars PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;72;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(status "/root/repo/tests/status.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(status PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;73;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(vm "/root/repo/tests/vm.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(vm PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;74;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(errors "/root/repo/tests/errors.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(errors PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;75;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(mux "/root/repo/tests/mux.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(mux PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;76;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(cgroup "/root/repo/tests/cgroup.sh" "/root/repo/_zstd_build/term")
+set_tests_properties(cgroup PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;77;add_test;/root/repo/CMakeLists.txt;0;")
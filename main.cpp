@@ -1,16 +1,66 @@
+#include <algorithm>
+#include <bit>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#if defined(TERM_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(TERM_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 enum class CommandError
 {
@@ -22,239 +72,6798 @@ enum class CommandError
     UNABLE_TO_OPEN_NOTEPAD,
     FORK_ERROR,
     INVALID_PROCESS_INPUT,
-    INVALID_PID
+    INVALID_PID,
+    READ_ERROR,
+    COPY_ERROR,
+    REMOVE_ERROR,
+    WRITE_ERROR,
+    EXPANSION_TOO_DEEP,
+    CONDITION_FALSE,
+    SYNTAX_ERROR,
+    TRUNCATED_INPUT,
+    LAUNCH_INTERRUPTED
 };
+
+// Сообщения лежат в порядке CommandError, чтобы вывод ошибки не создавал строк
+const std::array<std::string_view, static_cast<size_t>(CommandError::LAUNCH_INTERRUPTED) + 1> errorMessages = {
+    "",
+    "Неверное число аргументов",
+    "Неверный аргумент",
+    "",
+    "Файл не найден",
+    "Не получилось открыть блокнот",
+    "Ошибка создания процесса",
+    "Неверное имя при создании процесса",
+    "Неверный PID",
+    "Ошибка чтения файла",
+    "Ошибка копирования",
+    "Ошибка удаления",
+    "Ошибка записи",
+    "Слишком глубокая подстановка",
+    "",
+    "Синтаксическая ошибка",
+    "Сжатый файл обрывается",
+    "Запуск прерван"};
+const size_t ERROR_CONTEXT_SIZE = 256;
+const size_t IO_CHUNK_SIZE = 128 * 1024;
+// Размер кадра zstd берётся из заголовка файла; больше этого кадры распаковываются потоком
+const unsigned long long ZSTD_PARALLEL_FRAME_LIMIT = 64ull << 20;
+const unsigned IO_QUEUE_DEPTH = 4;
+const size_t COPY_MAX_IN_FLIGHT = 16;
+const size_t REMOVE_MAX_OPEN_DIRECTORIES = 256;
+const size_t BLAKE3_CHUNK_LEN = 1024;
+const size_t BLAKE3_PARALLEL_SUBTREE = 1 << 20;
+const size_t ARENA_BLOCK_SIZE = 1 << 20;
+const size_t SORT_DEFAULT_BUDGET_MB = 256;
+const size_t SORT_PARALLEL_MIN_LINES = 1 << 16;
+const size_t SORT_MERGE_FAN_IN = 32;
+const size_t SORT_RADIX_MIN_LINES = 64;
+const size_t SORT_RADIX_MAX_OFFSET = 64;
+const size_t COUNT_PARALLEL_MIN_BYTES = 1 << 20;
+const int MAX_EXPANSION_DEPTH = 32;
+const std::string_view RECORD_MAGIC = "TERMREC\x01";
+const size_t MUX_BUFFER_SIZE = 256 * 1024;
+const int EVENT_LOOP_MAX_EVENTS = 64;
+const int RETRY_DEFAULT_ATTEMPTS = 3;
+const int RETRY_DEFAULT_DELAY_MS = 100;
+const int RETRY_MAX_BACKOFF_SHIFT = 16;
+const size_t RATE_MAX_CLASSES = 64;
+const size_t RATE_CLASS_NAME_SIZE = 64;
+// Код $? фонового запуска, который ограничитель отложил: задание ещё не выполнялось
+const int LAUNCH_QUEUED_STATUS = 75;
+const std::string_view HISTORY_FRECENCY_MAGIC = "TERMFRQ\x01";
+const uint64_t HISTORY_FRECENCY_INITIAL_SLOTS = 1 << 12;
+const size_t HISTORY_DEFAULT_COUNT = 20;
+const size_t SUGGESTION_LOAD_BATCH = 4096;
+const size_t HISTORY_NGRAM = 3;
+const int PROMPT_ESCAPE_TIMEOUT_MS = 50;
+const size_t CURSOR_WIDTH = 4;
+
+using ChunkHandler = std::function<bool(std::string_view)>;
+
+struct TemplateSegment
+{
+    std::string_view text;
+    int parameter = -1;
+    std::string_view variable;
+    std::string_view substitution;
+};
+
+struct CaptureBuffer : std::streambuf
+{
+    std::string &output;
+
+    explicit CaptureBuffer(std::string &output) : output(output) {}
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *data, std::streamsize length) override;
+};
+
+struct FdBuffer : std::streambuf
+{
+    int fd;
+    std::vector<char> buffer;
+
+    explicit FdBuffer(int fd);
+    ~FdBuffer() override;
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *data, std::streamsize length) override;
+    int sync() override;
+    bool writeAll(const char *data, size_t length);
+};
+
+struct ErrorDetail
+{
+    std::atomic<bool> claimed = false;
+    std::atomic<bool> set = false;
+    int error = 0;
+    size_t contextLength = 0;
+    std::array<char, ERROR_CONTEXT_SIZE> context;
+    // Ошибка уже выведена в RUN скрипта; статус уходит наружу, а повторного вывода нет
+    bool reported = false;
+};
+
+struct ProcessInfo
+{
+    pid_t pid;
+    pid_t ppid;
+    std::string name;
+};
+
+struct ProcessTable
+{
+    std::vector<ProcessInfo> processes;
+    std::vector<int> parent;
+    std::vector<int> firstChild;
+    std::vector<int> nextSibling;
+
+    int find(pid_t pid) const;
+};
+
+enum class EventKind
+{
+    STREAM,
+    TIMER,
+    PROCESS
+};
+
+struct EventSource
+{
+    EventKind kind;
+};
+
+struct JobStream : EventSource
+{
+    int fd;
+    int target;
+    std::string prefix;
+    std::vector<char> buffer;
+    size_t filled = 0;
+    size_t consumed = 0;
+    bool closed = false;
+};
+
+struct ProcessWatch : EventSource
+{
+    int pidfd;
+    std::function<void(int)> onExit;
+};
+
+struct Timer
+{
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t sequence;
+    std::function<void()> callback;
+
+    bool operator>(const Timer &other) const;
+};
+
+struct EventLoop
+{
+    int epollFd = -1;
+    int timerFd = -1;
+    EventSource timerSource{EventKind::TIMER};
+    std::mutex timerMutex;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    uint64_t nextSequence = 0;
+
+    EventLoop();
+    bool addStream(int fd, int target, pid_t pid);
+    bool watchProcess(pid_t pid, std::function<void(int)> onExit);
+    void addTimer(std::chrono::steady_clock::time_point deadline, std::function<void()> callback);
+    void takeDueTimers(std::vector<std::function<void()>> &due);
+    void armTimer();
+};
+
+// Класс запуска лежит в общей памяти, которую наследуют дочерние term -s: правила dag и их
+// конвейеры тратят те же жетоны, что и приглашение. Очередь держат сами часы (GCRA): arrival —
+// теоретическое время следующего запуска, и запуск резервирует своё место одним CAS
+struct RateClass
+{
+    char name[RATE_CLASS_NAME_SIZE];
+    std::atomic<bool> active;
+    std::atomic<int64_t> interval;
+    std::atomic<int64_t> tolerance;
+    std::atomic<int64_t> arrival;
+    std::atomic<uint64_t> launched;
+    std::atomic<uint64_t> queued;
+    std::atomic<int64_t> totalDelay;
+    std::atomic<int64_t> maxDelay;
+    double rate;
+    double burst;
+};
+
+struct LaunchSlot
+{
+    RateClass *rateClass = nullptr;
+    std::chrono::steady_clock::time_point start;
+    int64_t arrival = 0;
+};
+
+struct RetryAttempt
+{
+    double milliseconds;
+    int status;
+};
+
+struct RetryJob
+{
+    int id;
+    std::vector<std::string> command;
+    int maxAttempts;
+    bool exponential;
+    std::chrono::milliseconds delay;
+    std::vector<RetryAttempt> attempts;
+    pid_t pid = -1;
+    bool cancelled = false;
+};
+
+struct DagNode
+{
+    std::string name;
+    std::vector<std::string> commands;
+    std::vector<std::string> prerequisites;
+    std::vector<size_t> dependencies;
+    std::vector<size_t> dependents;
+    size_t waiting = 0;
+    bool needed = false;
+    bool rebuilt = false;
+    double seconds = 0;
+    std::string stateHash;
+};
+
+struct RecordEntry
+{
+    std::vector<std::string> tokens;
+    uint64_t micros = 0;
+    uint64_t status = 0;
+    std::string_view output;
+};
+
+enum class OpCode
+{
+    RUN,
+    JUMP,
+    JUMP_IF_FALSE,
+    FOR_INIT,
+    FOR_NEXT,
+    CASE_PUSH,
+    CASE_MATCH,
+    CASE_POP
+};
+
+struct Instruction
+{
+    OpCode op;
+    size_t operand = 0;
+    size_t target = 0;
+    std::string_view name;
+};
+
+// Исходные токены команды и их разбор на сегменты; подстановки выполняются перед запуском каждой
+// простой команды, чтобы она видела присваивания и статусы предыдущих
+struct WordList
+{
+    std::vector<std::string_view> tokens;
+    std::vector<std::vector<TemplateSegment>> words;
+};
+
+struct Script
+{
+    std::vector<std::string> tokens;
+    std::vector<WordList> wordLists;
+    std::vector<Instruction> code;
+};
+
+struct ScriptParser
+{
+    Script &script;
+    size_t position = 0;
+};
+
+struct CommandTemplate
+{
+    std::shared_ptr<const std::string> source;
+    std::shared_ptr<const WordList> words;
+    // Тело, начинающееся с if/for/while/case, компилируется один раз при определении
+    std::shared_ptr<const Script> script;
+    bool appendArguments = false;
+};
+
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    explicit ThreadPool(unsigned threadCount);
+    ~ThreadPool();
+
+    template <typename Task>
+    auto submit(Task task) -> std::future<decltype(task())>
+    {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto future = packaged->get_future();
+        {
+            std::lock_guard lock(mutex);
+            tasks.emplace([packaged] { (*packaged)(); });
+        }
+        condition.notify_one();
+        return future;
+    }
+};
+
+struct IoUring
+{
+    int fd = -1;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    void *sqesMemory = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    char *buffers = nullptr;
+    bool broken = false;
+
+    ~IoUring();
+};
+
+enum class Compression
+{
+    NONE,
+    GZIP,
+    ZSTD
+};
+
+enum class HashAlgorithm
+{
+    CRC32C,
+    XXH3,
+    BLAKE3
+};
+
+struct MappedFile
+{
+    void *data = MAP_FAILED;
+    size_t size = 0;
+    std::string contents;
+
+    std::string_view view() const;
+    ~MappedFile();
+};
+
+struct HistoryRecord
+{
+    uint64_t offset;
+    uint32_t length;
+    uint32_t time;
+};
+
+struct FrecencyHeader
+{
+    char magic[8];
+    uint64_t slots;
+    uint64_t used;
+};
+
+struct FrecencySlot
+{
+    uint64_t hash;
+    uint64_t entry;
+    uint32_t count;
+    uint32_t lastUsed;
+};
+
+struct HistoryView
+{
+    MappedFile index;
+    MappedFile data;
+    const HistoryRecord *records = nullptr;
+    size_t count = 0;
+
+    std::string_view entry(size_t i) const;
+};
+
+struct TrieNode
+{
+    uint32_t labelOffset;
+    uint32_t labelLength;
+    uint32_t best;
+    uint32_t bestLength;
+    uint32_t bestId;
+    int32_t firstChild = -1;
+    int32_t nextSibling = -1;
+};
+
+struct SuggestionTrie
+{
+    std::mutex mutex;
+    std::string arena;
+    std::vector<TrieNode> nodes{TrieNode{}};
+    uint32_t nextId = 0;
+
+    void insert(std::string_view entry, uint32_t id);
+    std::string suggest(std::string_view prefix) const;
+};
+
+// Триграммный индекс подстрок истории: для каждых трёх идущих подряд байтов — возрастающий список
+// номеров записей, в которых они встречаются. Достраивается по мере роста файла истории
+struct HistoryIndex
+{
+    std::mutex mutex;
+    size_t indexed = 0;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+
+    void extend(const HistoryView &view, size_t end);
+    size_t search(const HistoryView &view, std::string_view text, size_t before) const;
+};
+
+struct Blake3Output
+{
+    uint32_t cv[8];
+    uint32_t block[16];
+    uint64_t counter;
+    uint32_t blockLength;
+    uint32_t flags;
+};
+
+struct RadixLine
+{
+    uint64_t key;
+    std::string_view line;
+};
+
+struct LineArena
+{
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t blockUsed = ARENA_BLOCK_SIZE;
+    size_t bytes = 0;
+
+    std::string_view store(std::string_view line);
+    void clear();
+};
+
+struct SortRun
+{
+    int fd = -1;
+    std::vector<char> buffer = std::vector<char>(IO_CHUNK_SIZE);
+    size_t begin = 0;
+    size_t end = 0;
+    std::string line;
+    unsigned level = 0;
+
+    bool next();
+    ~SortRun();
+};
+
+struct CountMap
+{
+    struct Slot
+    {
+        uint64_t hash;
+        std::string_view key;
+        size_t count = 0;
+    };
+    std::vector<Slot> slots = std::vector<Slot>(1024);
+    size_t size = 0;
+    LineArena arena;
+
+    void add(std::string_view key, uint64_t hash, size_t count, bool copyKey = true);
+    void grow();
+};
+
+struct RemovalNode
+{
+    std::shared_ptr<RemovalNode> parent;
+    std::string name;
+    DIR *directory = nullptr;
+    std::atomic<size_t> pending = 1;
+    std::shared_ptr<std::promise<void>> done;
+    std::shared_ptr<std::atomic<bool>> failed;
+    std::shared_ptr<std::atomic<size_t>> openDirectories;
+};
+
+struct Redirection
+{
+    int fd;
+    int flags;
+    std::string target;
+    bool inlineData = false;
+};
+
 void eraseLine();
 void printKitten(std::string command);
 void printKill(std::string command);
 void tokensToArgv(const std::vector<std::string> &tokens, char **argv);
 std::string getTextColor(std::filesystem::file_status status);
-CommandError createProcesses(const std::vector<std::string> &tokens);
-CommandError createProcess(const std::vector<std::string> &tokens, int priority = 0);
+CommandError createProcesses(const std::vector<std::string> &tokens, bool background = false);
+CommandError createProcess(const std::vector<std::string> &tokens, int priority = 0, bool background = false);
+CommandError spawnProcess(const std::vector<std::string> &tokens, pid_t &pid, int priority = 0, int input = -1, int outputFd = -1, pid_t group = 0, bool background = false);
+CommandError launchProcess(const std::vector<std::string> &tokens, pid_t &pid, int priority = 0, int input = -1, int outputFd = -1, pid_t group = 0, bool background = false);
+int forkExec(char **argv, const std::vector<std::pair<int, int>> &moves, pid_t group, const std::string &cgroupProcs, pid_t &pid);
+int spawnDirect(char **argv, const std::vector<std::pair<int, int>> &moves, pid_t group, pid_t &pid);
+int waitJob(pid_t pid, bool foreground = false);
+int waitPidfd(int pidfd);
+void reapJobs();
+int exitStatus(CommandError e);
+void setPipeStatus(const std::vector<int> &statuses);
+bool isRedirection(const std::string &token);
+EventLoop &eventLoop();
+void runEventLoop(EventLoop &loop);
+void collectLines(JobStream &stream, std::vector<iovec> &lines);
+void writeLines(int fd, std::vector<iovec> &lines);
+CommandError muxCommand(const std::vector<std::string> &arguments);
+CommandError retryCommand(const std::vector<std::string> &arguments);
+void launchRetryAttempt(const std::shared_ptr<RetryJob> &job);
+void startRetryAttempt(const std::shared_ptr<RetryJob> &job);
+void finishRetryAttempt(const std::shared_ptr<RetryJob> &job, std::chrono::steady_clock::time_point started, int status);
+void writeReport(std::string_view text);
+std::vector<pid_t> cancelRetryJobs();
+CommandError limitCommand(const std::vector<std::string> &arguments);
+RateClass *rateClasses();
+RateClass *findRateClass(const std::string &program);
+LaunchSlot reserveLaunch(const std::vector<std::string> &tokens);
+void cancelReservation(const LaunchSlot &slot);
+CommandError waitForLaunch(const LaunchSlot &slot);
+void deferLaunch(const LaunchSlot &slot, std::function<void()> launch);
+void adoptLaunchedJobs();
+void cancelQueuedLaunches();
+bool extractRedirections(const std::vector<std::string> &tokens, std::vector<std::string> &arguments, std::vector<Redirection> &redirections);
+int openRedirection(const Redirection &redirection);
+CommandError openRedirections(const std::vector<Redirection> &redirections, std::vector<int> &fds);
+CommandError runRedirectedBuiltin(const std::vector<std::string> &tokens);
+void readHeredocs(std::vector<std::string> &tokens);
 CommandError listDirContent(const std::vector<std::string> &arguments);
 CommandError printFileContents(const std::vector<std::string> &arguments);
+CommandError headCommand(const std::vector<std::string> &arguments);
+CommandError tailCommand(const std::vector<std::string> &arguments);
+CommandError grepCommand(const std::vector<std::string> &arguments);
+CommandError wcCommand(const std::vector<std::string> &arguments);
+CommandError parseLineCount(const std::vector<std::string> &arguments, size_t &count, std::string &path);
+ThreadPool &workerPool();
+bool ioUringInit(IoUring &ring, unsigned entries);
+bool ioUringRegisterBuffers(IoUring &ring);
+void ioUringQueueRead(IoUring &ring, unsigned slot, size_t filled, size_t length, off_t offset);
+int ioUringEnter(IoUring &ring, unsigned toSubmit, unsigned minComplete);
+bool ioUringPopCompletion(IoUring &ring, io_uring_cqe &cqe);
+IoUring *getFileRing();
+ssize_t preadFull(int fd, char *buffer, size_t length, off_t offset);
+CommandError readFile(const std::filesystem::path &path, const ChunkHandler &handler, off_t offset = 0);
+CommandError readFileWithUring(IoUring &ring, int fd, off_t offset, off_t size, const ChunkHandler &handler);
+CommandError readFileWithPread(int fd, off_t offset, off_t size, const ChunkHandler &handler);
+CommandError readStream(int fd, const ChunkHandler &handler);
+CommandError forEachLine(const std::filesystem::path &path, const ChunkHandler &handler);
+Compression detectCompression(const std::filesystem::path &path);
+CommandError readDecodedFile(const std::filesystem::path &path, const ChunkHandler &handler);
+CommandError readGzipFile(const std::filesystem::path &path, const ChunkHandler &handler);
+CommandError readZstdFile(const std::filesystem::path &path, const ChunkHandler &handler);
+CommandError copyCommand(const std::vector<std::string> &arguments);
+CommandError copyFile(const std::filesystem::path &source, const std::filesystem::path &destination);
+CommandError copyTree(const std::filesystem::path &source, const std::filesystem::path &destination);
+bool isWithinTree(const std::filesystem::path &root, const std::filesystem::path &path);
+bool writeAll(int fd, const char *data, size_t length);
+CommandError removeCommand(const std::vector<std::string> &arguments);
+CommandError removeTree(const std::string &path);
+void scanForRemoval(std::shared_ptr<RemovalNode> node);
+bool isProtectedRemoval(const std::string &path, const struct stat &st);
+void finishRemoval(std::shared_ptr<RemovalNode> node);
+void removeSubtree(int parentFd, const std::string &name, std::atomic<bool> &failed, std::atomic<size_t> &openDirectories, size_t budget);
+bool isDirectoryEntry(int fd, const dirent *entry);
+CommandError sumCommand(const std::vector<std::string> &arguments);
+CommandError mapFile(const std::filesystem::path &path, MappedFile &file);
+std::string hashData(std::string_view data, HashAlgorithm algorithm, bool parallel);
+uint32_t crc32c(const uint8_t *data, size_t length);
+uint64_t xxh3(const uint8_t *data, size_t length);
+uint64_t readLE64(const uint8_t *data);
+uint32_t readLE32(const uint8_t *data);
+uint64_t xxh3Fold(uint64_t a, uint64_t b);
+uint64_t xxh3Avalanche(uint64_t h);
+uint64_t xxh3Mix16(const uint8_t *data, const uint8_t *secret);
+void xxh3Accumulate512(uint64_t acc[8], const uint8_t *data, const uint8_t *secret);
+void blake3Compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t out[16]);
+void blake3ChainingValue(const Blake3Output &output, uint32_t cv[8]);
+Blake3Output blake3ChunkOutput(const uint8_t *data, size_t length, uint64_t counter);
+Blake3Output blake3ParentOutput(const uint32_t left[8], const uint32_t right[8]);
+Blake3Output blake3Subtree(const uint8_t *data, size_t length, uint64_t counter);
+Blake3Output blake3MergeSubtrees(const std::vector<std::array<uint32_t, 8>> &cvs, size_t begin, size_t end);
+std::string blake3(const uint8_t *data, size_t length, bool parallel);
+CommandError sortCommand(const std::vector<std::string> &arguments);
+void sortLines(std::vector<std::string_view> &lines);
+void radixSortLines(std::string_view *lines, size_t count, size_t offset);
+CommandError spillRun(const std::vector<std::string_view> &lines, std::vector<std::unique_ptr<SortRun>> &runs);
+CommandError compactRuns(std::vector<std::unique_ptr<SortRun>> &runs);
+CommandError mergeRuns(std::vector<std::unique_ptr<SortRun>> &runs, size_t first);
+int createSpillFile(std::string &path);
+CommandError countCommand(const std::vector<std::string> &arguments);
+void countLines(std::string_view data, CountMap &map);
+CommandError hexdumpCommand(const std::vector<std::string> &arguments);
+bool parseSize(const std::string &text, size_t &value);
+void bytesToHex(const uint8_t *data, size_t length, char *hex);
+void formatHexLine(size_t offset, const uint8_t *data, size_t length, const char *hex, std::string &output);
 CommandError openNotepad(const std::vector<std::string> &arguments);
 CommandError executeCommand(const std::vector<std::string> &tokens);
+CommandError runTokens(const std::vector<std::string> &tokens, int depth = 0);
+CommandError runWords(const WordList &list, const std::vector<std::string> &arguments, int depth, bool appendArguments = false);
+CommandError runCommand(const std::vector<std::string> &tokens, int depth);
+CommandTemplate compileTemplate(const std::string &source, bool appendArguments);
+const CommandTemplate *findUserCommand(const std::string &name);
+WordList compileWords(std::vector<std::string_view> tokens);
+std::vector<TemplateSegment> compileWord(std::string_view word);
+std::vector<std::string> expandWords(std::span<const std::vector<TemplateSegment>> words, const std::vector<std::string> &arguments);
+std::vector<std::string_view> splitWords(std::string_view text);
+size_t findGroupEnd(std::string_view text, size_t start);
+CommandError captureCommand(std::string_view commandLine, std::string &output);
+std::ostream &commandOutput();
+CommandError runPipeline(const std::vector<std::string> &tokens, int depth, bool background);
+CommandError runInput(std::vector<std::string> tokens);
+CommandError runTimed(const std::vector<std::string> &tokens, std::string &copy, uint64_t &micros);
+void recordInput(const std::vector<std::string> &tokens);
+void appendVarint(std::string &out, uint64_t value);
+bool readVarint(std::string_view &data, uint64_t &value);
+bool readRecordEntry(std::string_view &data, RecordEntry &entry);
+CommandError recordCommand(const std::vector<std::string> &arguments);
+CommandError replayCommand(const std::vector<std::string> &arguments);
+void openHistory();
+void appendHistory(std::string_view line);
+bool syncHistoryIndex(uint64_t dataSize, uint64_t &entry);
+void updateFrecency(uint64_t hash, uint64_t entry, uint32_t now);
+bool initFrecency(int fd, uint64_t slotCount);
+bool validFrecency(const FrecencyHeader &header, uint64_t fileSize);
+FrecencySlot *findFrecencySlot(FrecencySlot *slots, uint64_t slotCount, uint64_t hash);
+void growFrecency(const std::string &path, const FrecencySlot *slots, uint64_t slotCount);
+bool openHistoryView(HistoryView &view);
+double frecencyScore(const FrecencySlot &slot, uint32_t now);
+size_t searchHistory(const HistoryView &view, std::string_view text, size_t before);
+HistoryIndex &historyIndex();
+uint32_t ngramKey(std::string_view text, size_t position);
+CommandError historyCommand(const std::vector<std::string> &arguments);
+SuggestionTrie &suggestionTrie();
+void startSuggestions();
+void addSuggestion(std::string_view line);
+size_t countColumns(std::string_view text);
+bool readPromptLine(std::string &line, size_t promptWidth);
+void restoreTerminalMode();
+CommandError dagCommand(const std::vector<std::string> &arguments);
+CommandError parseDag(const std::string &path, std::vector<DagNode> &nodes);
+bool dagUpToDate(std::vector<DagNode> &nodes, DagNode &node, bool contentHashes, const std::unordered_map<std::string, std::string> &state);
+pid_t launchDagNode(const DagNode &node);
+void printCriticalPath(const std::vector<DagNode> &nodes, const std::vector<size_t> &order, double wallSeconds);
+bool runsInProcess(const std::vector<std::string> &stage);
+CommandError spawnStage(const std::vector<std::string> &stage, int input, int outputFd, int depth, pid_t group, pid_t &pid, bool background);
+int saveShellState(const std::vector<std::string> &lines, int depth, int childCaptureDepth);
+bool loadShellState(int fd, std::vector<std::string> &lines, int &depth);
+pid_t execShell(const std::vector<std::string> &tokens, const std::vector<std::string> &lines, int depth, int input, int outputFd, pid_t group = 0);
+int runShellChild(int argc, char **argv);
+bool isScriptOpen(const std::vector<std::string> &tokens);
+std::vector<std::string> splitSeparators(const std::vector<std::string> &tokens);
+bool compileScript(const std::vector<std::string> &tokens, Script &script);
+bool parseScriptList(ScriptParser &parser, std::initializer_list<std::string_view> terminators);
+bool parseScriptCommand(ScriptParser &parser);
+bool expectToken(ScriptParser &parser, std::string_view token);
+size_t addWordList(Script &script, size_t begin, size_t end);
+size_t emit(Script &script, OpCode op, size_t operand = 0, std::string_view name = {});
+CommandError runScript(const Script &script, int depth, const std::vector<std::string> &arguments = {});
+CommandError trueCommand(const std::vector<std::string> &arguments);
+CommandError falseCommand(const std::vector<std::string> &arguments);
+CommandError testCommand(const std::vector<std::string> &arguments);
+void reportError(CommandError e);
+CommandError aliasCommand(const std::vector<std::string> &arguments);
+CommandError functionCommand(const std::vector<std::string> &arguments);
+CommandError unaliasCommand(const std::vector<std::string> &arguments);
 CommandError killCommand(const std::vector<std::string> &arguments);
 CommandError killAllCommand(const std::vector<std::string> &arguments);
 CommandError niceCommand(const std::vector<std::string> &arguments);
 CommandError showPids(const std::vector<std::string> &arguments);
-std::string getErrorMessage(CommandError e);
+bool scanProcesses(ProcessTable &table);
+bool readProcessStat(int procFd, const char *pid, ProcessInfo &info);
+void printProcessTree(const ProcessTable &table, int root);
+void killJobs(const std::vector<pid_t> &jobs);
+bool killJobCgroup(pid_t pid);
+std::string readCgroupPath(const std::string &procPath);
+const std::string &cgroupRoot();
+std::string createJobCgroup();
+void releaseJobCgroups();
+std::string_view getErrorMessage(CommandError e);
+CommandError fail(CommandError e, std::string_view context = {}, int error = errno);
+void clearError();
 void closeTerminal(int sig);
 
-using TerminalCommand = CommandError (*)(const std::vector<std::string> &);
-const std::string cursor = "\033[35m☿☿☿ \033[0m";
-const std::unordered_map<std::string, TerminalCommand> terminalCommands = {
-    {"ls", listDirContent}, 
-    {"cat", printFileContents}, 
-    {"notepad", openNotepad}, 
-    {"kill", killCommand}, 
-    {"killall", killAllCommand}, 
-    {"pids", showPids}, 
-    {"nice", niceCommand}};
-std::unordered_set<int> pids;
+using TerminalCommand = CommandError (*)(const std::vector<std::string> &);
+const std::string cursor = "\033[35m☿☿☿ \033[0m";
+const std::unordered_map<std::string, TerminalCommand> terminalCommands = {
+    {"ls", listDirContent}, 
+    {"cat", printFileContents}, 
+    {"head", headCommand}, 
+    {"tail", tailCommand}, 
+    {"grep", grepCommand}, 
+    {"wc", wcCommand}, 
+    {"cp", copyCommand}, 
+    {"rm", removeCommand}, 
+    {"sum", sumCommand}, 
+    {"sort", sortCommand}, 
+    {"count", countCommand}, 
+    {"hexdump", hexdumpCommand}, 
+    {"record", recordCommand}, 
+    {"replay", replayCommand}, 
+    {"history", historyCommand}, 
+    {"mux", muxCommand}, 
+    {"dag", dagCommand}, 
+    {"retry", retryCommand}, 
+    {"limit", limitCommand}, 
+    {"notepad", openNotepad}, 
+    {"kill", killCommand}, 
+    {"killall", killAllCommand}, 
+    {"pids", showPids}, 
+    {"nice", niceCommand}, 
+    {"alias", aliasCommand}, 
+    {"unalias", unaliasCommand}, 
+    {"function", functionCommand}, 
+    {"true", trueCommand}, 
+    {"false", falseCommand}, 
+    {"test", testCommand}, 
+    {"[", testCommand}};
+std::unordered_set<int> pids;
+// Повторы живут отдельно от pids: их дочерние процессы дожидается цикл событий, а не reapJobs
+std::mutex retryMutex;
+std::map<int, std::shared_ptr<RetryJob>> retryJobs;
+int nextRetryId = 1;
+// Cgroup, которые терминал сам создал для фоновых заданий: cgroup.kill пишется только в них
+std::mutex jobCgroupMutex;
+std::unordered_map<pid_t, std::string> jobCgroups;
+uint64_t nextJobCgroup = 0;
+// Только у приглашения: задания -c переживают терминал, и их cgroup некому было бы удалить
+bool jobCgroupsEnabled = false;
+// Таблица классов запуска в memfd и фоновые задания, которые цикл событий запустил из очереди
+std::mutex rateMutex;
+RateClass *rateTable = nullptr;
+int rateTableFd = -1;
+std::vector<pid_t> launchedJobs;
+// killall меняет поколение, и отложенные запуски прежних поколений не выполняются
+std::atomic<uint64_t> launchGeneration = 0;
+// Ctrl-C во время ожидания ограничителя будит это ожидание через eventfd вместо закрытия терминала
+std::atomic<bool> launchWaiting = false;
+int launchInterruptFd = -1;
+std::unordered_map<std::string, CommandTemplate> userCommands;
+std::vector<std::string> expandingAliases;
+const std::unordered_set<std::string_view> definitionCommands = {"alias", "function"};
+const std::unordered_set<std::string_view> scriptKeywords = {"if", "for", "while", "case"};
+std::unordered_map<std::string, std::string> shellVariables;
+const std::unordered_set<std::string> pureBuiltins = {"ls", "cat", "head", "tail", "grep", "wc", "sum", "sort", "count", "hexdump", "pids", "history", "true", "false", "test", "["};
+thread_local int captureDepth = 0;
+thread_local std::ostream *currentOutput = &std::cout;
+// Поток цикла событий не делает fork и не пишет в std::cout, который принадлежит главному потоку
+thread_local bool onEventLoop = false;
+std::mutex reportMutex;
+int recordFd = -1;
+int recordOutputFd = -1;
+int historyFd = -1;
+int historyIndexFd = -1;
+std::string historyPath;
+bool suggestionsEnabled = false;
+bool terminalRaw = false;
+termios savedTerminal;
+bool multiplexOutput = false;
+int lastStatus = 0;
+ErrorDetail lastError;
+
+std::vector<std::string> splitStringBySpace(const std::string &inputString);
+
+int main(int argc, char **argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    // Терминал возвращается из фоновой группы после задания переднего плана
+    signal(SIGTTOU, SIG_IGN);
+    // -c и дочерние -s получают SIGINT как обычные процессы: прощание и killall — только у приглашения
+    if (argc == 3 && std::string_view(argv[1]) == "-c")
+    {
+        std::vector<std::string> tokens = splitStringBySpace(argv[2]);
+        if (!tokens.empty())
+            reportError(runInput(tokens));
+        std::cout.flush();
+        return lastStatus;
+    }
+    if (argc >= 3 && std::string_view(argv[1]) == "-s")
+        return runShellChild(argc, argv);
+    launchInterruptFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    signal(SIGINT, closeTerminal);
+    jobCgroupsEnabled = true;
+    openHistory();
+    startSuggestions();
+    while (true)
+    {
+        reapJobs();
+        std::cout << cursor;
+        std::string inputBuffer;
+        if (!readPromptLine(inputBuffer, CURSOR_WIDTH))
+            break;
+        std::vector<std::string> tokens = splitStringBySpace(inputBuffer);
+        if (tokens.empty())
+            continue;
+        while (isScriptOpen(tokens) && std::cout << "> " && readPromptLine(inputBuffer, 2))
+        {
+            tokens.push_back(";");
+            for (auto &token : splitStringBySpace(inputBuffer))
+                tokens.push_back(std::move(token));
+        }
+        std::string line;
+        for (const auto &token : tokens)
+            line.append(line.empty() ? "" : " ").append(token);
+        appendHistory(line);
+        addSuggestion(line);
+        readHeredocs(tokens);
+        if (recordFd >= 0 && tokens[0] != "record")
+            recordInput(tokens);
+        else
+            reportError(runInput(tokens));
+    }
+    releaseJobCgroups();
+    std::cout << std::endl;
+    return lastStatus;
+}
+
+std::vector<std::string> splitStringBySpace(const std::string &inputString)
+{
+    std::vector<std::string> substrings;
+    for (auto word : splitWords(inputString))
+        substrings.emplace_back(word);
+    return substrings;
+}
+
+std::vector<std::string_view> splitWords(std::string_view text)
+{
+    std::vector<std::string_view> words;
+    size_t start = 0;
+    for (size_t i = 0; i <= text.size(); ++i)
+    {
+        if (i < text.size() && text[i] != ' ')
+        {
+            size_t end = findGroupEnd(text, i);
+            if (end != i)
+                i = end - 1;
+            continue;
+        }
+        if (i > start)
+            words.push_back(text.substr(start, i - start));
+        start = i + 1;
+    }
+    return words;
+}
+
+size_t findGroupEnd(std::string_view text, size_t start)
+{
+    if (text[start] == '`')
+    {
+        size_t close = text.find('`', start + 1);
+        return close == std::string_view::npos ? start : close + 1;
+    }
+    if (text.substr(start, 2) != "$(")
+        return start;
+    int depth = 0;
+    for (size_t i = start + 1; i < text.size(); ++i)
+    {
+        if (text[i] == '(')
+            ++depth;
+        else if (text[i] == ')' && --depth == 0)
+            return i + 1;
+    }
+    return start;
+}
+
+CommandError executeCommand(const std::vector<std::string> &tokens)
+{
+    std::string command = tokens[0];
+    std::vector<std::string> arguments(tokens.begin() + 1, tokens.end());
+    CommandError e;
+    try
+    {
+        e = terminalCommands.at(command)(arguments);
+    }
+    catch (const std::out_of_range &e)
+    {
+        return CommandError::UNKNOWN_COMMAND;
+    }
+    return e;
+}
+
+CommandError runInput(std::vector<std::string> tokens)
+{
+    CommandError e = runTokens(tokens);
+    // Ошибки разбора возникают до запуска команды и сами статус не выставляют
+    if (e == CommandError::SYNTAX_ERROR || e == CommandError::EXPANSION_TOO_DEEP)
+        setPipeStatus({exitStatus(e)});
+    return e;
+}
+
+CommandError runTokens(const std::vector<std::string> &tokens, int depth)
+{
+    if (definitionCommands.contains(tokens[0]))
+        return runCommand(tokens, depth);
+    if (scriptKeywords.contains(tokens[0]))
+    {
+        Script script;
+        if (!compileScript(tokens, script))
+            return CommandError::SYNTAX_ERROR;
+        return runScript(script, depth);
+    }
+    return runWords(compileWords({tokens.begin(), tokens.end()}), {}, depth);
+}
+
+// Части через && раскрываются по одной непосредственно перед запуском; определения alias и
+// function сохраняют текст как есть
+CommandError runWords(const WordList &list, const std::vector<std::string> &arguments, int depth, bool appendArguments)
+{
+    const auto &tokens = list.tokens;
+    size_t begin = 0;
+    while (begin < tokens.size())
+    {
+        size_t end = std::find(tokens.begin() + begin, tokens.end(), "&&") - tokens.begin();
+        std::vector<std::string> command;
+        if (begin != end && definitionCommands.contains(tokens[begin]))
+            command.assign(tokens.begin() + begin, tokens.begin() + end);
+        else if (begin != end)
+            command = expandWords(std::span(list.words).subspan(begin, end - begin), arguments);
+        if (appendArguments && end == tokens.size())
+            command.insert(command.end(), arguments.begin(), arguments.end());
+        if (!command.empty())
+        {
+            CommandError e = runCommand(command, depth);
+            if (e != CommandError::OK)
+                return e;
+        }
+        begin = end + 1;
+    }
+    return CommandError::OK;
+}
+
+CommandError runCommand(const std::vector<std::string> &tokens, int depth)
+{
+    clearError();
+    if (tokens.size() > 1 && tokens.back() == "&")
+    {
+        std::vector<std::string> command(tokens.begin(), tokens.end() - 1);
+        if (std::find(command.begin(), command.end(), "|") != command.end())
+            return runPipeline(command, depth, true);
+        if (!terminalCommands.contains(command[0]) && !findUserCommand(command[0]))
+            return createProcesses(command, true);
+        return runCommand(command, depth);
+    }
+    if (std::find(tokens.begin(), tokens.end(), "|") != tokens.end())
+        return runPipeline(tokens, depth, false);
+    if (const CommandTemplate *user = findUserCommand(tokens[0]))
+    {
+        if (depth >= MAX_EXPANSION_DEPTH)
+            return CommandError::EXPANSION_TOO_DEEP;
+        // Тело может переопределить себя, поэтому разобранный шаблон удерживается своими ссылками
+        CommandTemplate command = *user;
+        std::vector<std::string> arguments(tokens.begin() + 1, tokens.end());
+        if (!command.words->tokens.empty() && scriptKeywords.contains(command.words->tokens[0]))
+            return command.script ? runScript(*command.script, depth + 1, arguments) : CommandError::SYNTAX_ERROR;
+        if (!command.appendArguments)
+            return runWords(*command.words, arguments, depth + 1);
+        // alias ls=ls -l: первое слово тела с именем самого alias уже не раскрывается
+        expandingAliases.push_back(tokens[0]);
+        CommandError e = runWords(*command.words, arguments, depth + 1, true);
+        expandingAliases.pop_back();
+        return e;
+    }
+    size_t equals = tokens[0].find('=');
+    if (tokens.size() == 1 && equals != std::string::npos && equals > 0 && !std::isdigit(static_cast<unsigned char>(tokens[0][0]))
+        && std::all_of(tokens[0].begin(), tokens[0].begin() + equals, [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }))
+    {
+        shellVariables[tokens[0].substr(0, equals)] = tokens[0].substr(equals + 1);
+        setPipeStatus({0});
+        return CommandError::OK;
+    }
+    bool redirected = std::any_of(tokens.begin(), tokens.end(), isRedirection);
+    CommandError e = redirected ? runRedirectedBuiltin(tokens) : executeCommand(tokens);
+    if (e == CommandError::UNKNOWN_COMMAND)
+        e = createProcesses(tokens);
+    else
+        setPipeStatus({exitStatus(e)});
+    return e;
+}
+
+bool isScriptOpen(const std::vector<std::string> &tokens)
+{
+    if (!scriptKeywords.contains(tokens[0]))
+        return false;
+    const std::unordered_set<std::string_view> commandStarts = {";", ";;", "then", "do", "else", "elif", "&&"};
+    std::vector<std::string> words = splitSeparators(tokens);
+    int open = 0;
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+        if (i > 0 && !commandStarts.contains(words[i - 1]) && words[i - 1].back() != ')')
+            continue;
+        if (scriptKeywords.contains(words[i]))
+            ++open;
+        else if (words[i] == "fi" || words[i] == "done" || words[i] == "esac")
+            --open;
+    }
+    return open > 0;
+}
+
+std::vector<std::string> splitSeparators(const std::vector<std::string> &tokens)
+{
+    std::vector<std::string> words;
+    words.reserve(tokens.size());
+    for (const auto &token : tokens)
+    {
+        size_t separator = token == ";;" ? 0 : token.size() > 2 && token.ends_with(";;") ? 2 : token.size() > 1 && token.ends_with(';') ? 1 : 0;
+        words.push_back(token.substr(0, token.size() - separator));
+        if (separator)
+            words.push_back(token.substr(token.size() - separator));
+    }
+    return words;
+}
+
+bool compileScript(const std::vector<std::string> &tokens, Script &script)
+{
+    script.tokens = splitSeparators(tokens);
+    ScriptParser parser{script};
+    return parseScriptList(parser, {}) && parser.position == script.tokens.size();
+}
+
+bool parseScriptList(ScriptParser &parser, std::initializer_list<std::string_view> terminators)
+{
+    const auto &tokens = parser.script.tokens;
+    while (true)
+    {
+        while (parser.position < tokens.size() && tokens[parser.position] == ";")
+            ++parser.position;
+        if (parser.position == tokens.size())
+            return terminators.size() == 0;
+        if (std::find(terminators.begin(), terminators.end(), tokens[parser.position]) != terminators.end())
+            return true;
+        if (!parseScriptCommand(parser))
+            return false;
+    }
+}
+
+bool parseScriptCommand(ScriptParser &parser)
+{
+    Script &script = parser.script;
+    const auto &tokens = script.tokens;
+    const std::string &keyword = tokens[parser.position];
+    if (keyword == "if")
+    {
+        std::vector<size_t> toEnd;
+        std::string_view branch = "if";
+        while (branch == "if" || branch == "elif")
+        {
+            ++parser.position;
+            if (!parseScriptList(parser, {"then"}) || !expectToken(parser, "then"))
+                return false;
+            size_t skip = emit(script, OpCode::JUMP_IF_FALSE);
+            if (!parseScriptList(parser, {"elif", "else", "fi"}))
+                return false;
+            toEnd.push_back(emit(script, OpCode::JUMP));
+            script.code[skip].target = script.code.size();
+            branch = tokens[parser.position];
+        }
+        if (branch == "else")
+        {
+            ++parser.position;
+            if (!parseScriptList(parser, {"fi"}))
+                return false;
+        }
+        for (size_t jump : toEnd)
+            script.code[jump].target = script.code.size();
+        return expectToken(parser, "fi");
+    }
+    if (keyword == "while")
+    {
+        ++parser.position;
+        size_t start = script.code.size();
+        if (!parseScriptList(parser, {"do"}) || !expectToken(parser, "do"))
+            return false;
+        size_t exit = emit(script, OpCode::JUMP_IF_FALSE);
+        if (!parseScriptList(parser, {"done"}) || !expectToken(parser, "done"))
+            return false;
+        script.code[emit(script, OpCode::JUMP)].target = start;
+        script.code[exit].target = script.code.size();
+        return true;
+    }
+    if (keyword == "for")
+    {
+        if (parser.position + 2 >= tokens.size() || tokens[parser.position + 2] != "in")
+            return false;
+        std::string_view name = tokens[parser.position + 1];
+        parser.position += 3;
+        size_t begin = parser.position;
+        while (parser.position < tokens.size() && tokens[parser.position] != ";" && tokens[parser.position] != "do")
+            ++parser.position;
+        emit(script, OpCode::FOR_INIT, addWordList(script, begin, parser.position), name);
+        while (parser.position < tokens.size() && tokens[parser.position] == ";")
+            ++parser.position;
+        if (!expectToken(parser, "do"))
+            return false;
+        size_t next = emit(script, OpCode::FOR_NEXT);
+        if (!parseScriptList(parser, {"done"}) || !expectToken(parser, "done"))
+            return false;
+        script.code[emit(script, OpCode::JUMP)].target = next;
+        script.code[next].target = script.code.size();
+        return true;
+    }
+    if (keyword == "case")
+    {
+        if (parser.position + 2 >= tokens.size() || tokens[parser.position + 2] != "in")
+            return false;
+        emit(script, OpCode::CASE_PUSH, addWordList(script, parser.position + 1, parser.position + 2));
+        parser.position += 3;
+        std::vector<size_t> toEnd;
+        while (true)
+        {
+            while (parser.position < tokens.size() && (tokens[parser.position] == ";" || tokens[parser.position] == ";;"))
+                ++parser.position;
+            if (parser.position == tokens.size())
+                return false;
+            if (tokens[parser.position] == "esac")
+                break;
+            const std::string &patterns = tokens[parser.position];
+            if (patterns.size() < 2 || patterns.back() != ')')
+                return false;
+            size_t match = emit(script, OpCode::CASE_MATCH, parser.position);
+            ++parser.position;
+            if (!parseScriptList(parser, {";;", "esac"}))
+                return false;
+            toEnd.push_back(emit(script, OpCode::JUMP));
+            script.code[match].target = script.code.size();
+        }
+        for (size_t jump : toEnd)
+            script.code[jump].target = script.code.size();
+        emit(script, OpCode::CASE_POP);
+        return expectToken(parser, "esac");
+    }
+    size_t begin = parser.position;
+    while (parser.position < tokens.size() && tokens[parser.position] != ";" && tokens[parser.position] != ";;")
+        ++parser.position;
+    emit(script, OpCode::RUN, addWordList(script, begin, parser.position));
+    return true;
+}
+
+bool expectToken(ScriptParser &parser, std::string_view token)
+{
+    if (parser.position >= parser.script.tokens.size() || parser.script.tokens[parser.position] != token)
+        return false;
+    ++parser.position;
+    return true;
+}
+
+size_t addWordList(Script &script, size_t begin, size_t end)
+{
+    script.wordLists.push_back(compileWords({script.tokens.begin() + begin, script.tokens.begin() + end}));
+    return script.wordLists.size() - 1;
+}
+
+size_t emit(Script &script, OpCode op, size_t operand, std::string_view name)
+{
+    script.code.push_back({op, operand, 0, name});
+    return script.code.size() - 1;
+}
+
+CommandError runScript(const Script &script, int depth, const std::vector<std::string> &arguments)
+{
+    struct Loop
+    {
+        std::string_view name;
+        std::vector<std::string> items;
+        size_t next = 0;
+    };
+    std::vector<Loop> loops;
+    std::vector<std::string> subjects;
+    CommandError status = CommandError::OK;
+    for (size_t pc = 0; pc < script.code.size();)
+    {
+        const Instruction &instruction = script.code[pc++];
+        switch (instruction.op)
+        {
+        case OpCode::RUN:
+        {
+            status = runWords(script.wordLists[instruction.operand], arguments, depth + 1);
+            // Ошибки разбора и подстановки не доходят до запуска и статус не выставляют
+            if (status == CommandError::SYNTAX_ERROR || status == CommandError::EXPANSION_TOO_DEEP)
+                setPipeStatus({exitStatus(status)});
+            reportError(status);
+            break;
+        }
+        case OpCode::JUMP:
+            pc = instruction.target;
+            break;
+        case OpCode::JUMP_IF_FALSE:
+            if (status != CommandError::OK)
+                pc = instruction.target;
+            status = CommandError::OK;
+            break;
+        case OpCode::FOR_INIT:
+        {
+            Loop &loop = loops.emplace_back();
+            loop.name = instruction.name;
+            for (const auto &item : expandWords(script.wordLists[instruction.operand].words, arguments))
+            {
+                glob_t matches;
+                if (item.find_first_of("*?[") != std::string::npos && glob(item.c_str(), 0, nullptr, &matches) == 0)
+                    loop.items.insert(loop.items.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+                else
+                    for (auto &word : splitStringBySpace(item))
+                        loop.items.push_back(std::move(word));
+                if (item.find_first_of("*?[") != std::string::npos)
+                    globfree(&matches);
+            }
+            break;
+        }
+        case OpCode::FOR_NEXT:
+        {
+            Loop &loop = loops.back();
+            if (loop.next < loop.items.size())
+                shellVariables[std::string(loop.name)] = loop.items[loop.next++];
+            else
+            {
+                loops.pop_back();
+                pc = instruction.target;
+            }
+            break;
+        }
+        case OpCode::CASE_PUSH:
+        {
+            std::vector<std::string> subject = expandWords(script.wordLists[instruction.operand].words, arguments);
+            subjects.push_back(subject.empty() ? "" : subject[0]);
+            break;
+        }
+        case OpCode::CASE_MATCH:
+        {
+            std::string_view patterns = script.tokens[instruction.operand];
+            patterns.remove_suffix(1);
+            if (patterns.starts_with('('))
+                patterns.remove_prefix(1);
+            bool matched = false;
+            while (!matched)
+            {
+                size_t bar = std::min(patterns.find('|'), patterns.size());
+                matched = fnmatch(std::string(patterns.substr(0, bar)).c_str(), subjects.back().c_str(), 0) == 0;
+                if (bar == patterns.size())
+                    break;
+                patterns.remove_prefix(bar + 1);
+            }
+            if (!matched)
+                pc = instruction.target;
+            break;
+        }
+        case OpCode::CASE_POP:
+            subjects.pop_back();
+            break;
+        }
+    }
+    lastError.reported = status != CommandError::OK && status != CommandError::CONDITION_FALSE;
+    return status;
+}
+
+CommandError trueCommand([[maybe_unused]] const std::vector<std::string> &arguments)
+{
+    return CommandError::OK;
+}
+
+CommandError falseCommand([[maybe_unused]] const std::vector<std::string> &arguments)
+{
+    return CommandError::CONDITION_FALSE;
+}
+
+CommandError testCommand(const std::vector<std::string> &arguments)
+{
+    std::vector<std::string> expression = arguments;
+    if (!expression.empty() && expression.back() == "]")
+        expression.pop_back();
+    bool negate = !expression.empty() && expression[0] == "!";
+    if (negate)
+        expression.erase(expression.begin());
+    bool result;
+    if (expression.size() == 1)
+        result = !expression[0].empty();
+    else if (expression.size() == 2)
+    {
+        const std::string &op = expression[0];
+        const std::string &operand = expression[1];
+        if (op == "-f")
+            result = std::filesystem::is_regular_file(operand);
+        else if (op == "-d")
+            result = std::filesystem::is_directory(operand);
+        else if (op == "-e")
+            result = std::filesystem::exists(operand);
+        else if (op == "-z")
+            result = operand.empty();
+        else if (op == "-n")
+            result = !operand.empty();
+        else
+            return CommandError::INVALID_ARGUMENT;
+    }
+    else if (expression.size() == 3)
+    {
+        const std::string &left = expression[0];
+        const std::string &op = expression[1];
+        const std::string &right = expression[2];
+        if (op == "=" || op == "==")
+            result = left == right;
+        else if (op == "!=")
+            result = left != right;
+        else
+        {
+            long long a, b;
+            char *end;
+            a = std::strtoll(left.c_str(), &end, 10);
+            if (left.empty() || *end)
+                return CommandError::INVALID_ARGUMENT;
+            b = std::strtoll(right.c_str(), &end, 10);
+            if (right.empty() || *end)
+                return CommandError::INVALID_ARGUMENT;
+            if (op == "-eq")
+                result = a == b;
+            else if (op == "-ne")
+                result = a != b;
+            else if (op == "-lt")
+                result = a < b;
+            else if (op == "-le")
+                result = a <= b;
+            else if (op == "-gt")
+                result = a > b;
+            else if (op == "-ge")
+                result = a >= b;
+            else
+                return CommandError::INVALID_ARGUMENT;
+        }
+    }
+    else
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    return result != negate ? CommandError::OK : CommandError::CONDITION_FALSE;
+}
+
+void reportError(CommandError e)
+{
+    if (e == CommandError::OK || e == CommandError::CONDITION_FALSE || std::exchange(lastError.reported, false))
+        return;
+    std::ostream &out = commandOutput();
+    out << "\033[31m" << getErrorMessage(e);
+    if (lastError.set.exchange(false, std::memory_order_acquire))
+    {
+        if (lastError.contextLength > 0)
+            out << ": " << std::string_view(lastError.context.data(), lastError.contextLength);
+        if (lastError.error != 0)
+            out << " (" << strerrordesc_np(lastError.error) << ")";
+        lastError.claimed.store(false, std::memory_order_release);
+    }
+    out << "\033[0m" << std::endl;
+}
+
+// Запоминает errno и контекст первой ошибки до следующего reportError; пишет без выделения памяти,
+// поэтому вызывается и из рабочих потоков
+// Слот занимает тот, кто первым выиграл compare_exchange, а читатель видит его только
+// после того, как запись закончена и выставлен set
+CommandError fail(CommandError e, std::string_view context, int error)
+{
+    // Слот принадлежит командам приглашения; поток цикла событий сообщает о своих сбоях в отчётах
+    if (onEventLoop)
+        return e;
+    bool expected = false;
+    if (!lastError.claimed.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        return e;
+    lastError.error = error;
+    lastError.contextLength = std::min(context.size(), lastError.context.size());
+    std::memcpy(lastError.context.data(), context.data(), lastError.contextLength);
+    lastError.set.store(true, std::memory_order_release);
+    return e;
+}
+
+// Сбрасывает только записанную ошибку: слот, который сейчас заполняется, останется до reportError
+void clearError()
+{
+    lastError.reported = false;
+    if (lastError.set.exchange(false, std::memory_order_acquire))
+        lastError.claimed.store(false, std::memory_order_release);
+}
+
+CommandTemplate compileTemplate(const std::string &source, bool appendArguments)
+{
+    CommandTemplate command;
+    command.source = std::make_shared<const std::string>(source);
+    command.appendArguments = appendArguments;
+    auto words = std::make_shared<WordList>(compileWords(splitWords(*command.source)));
+    command.words = words;
+    if (!words->tokens.empty() && scriptKeywords.contains(words->tokens[0]))
+    {
+        auto script = std::make_shared<Script>();
+        if (compileScript({words->tokens.begin(), words->tokens.end()}, *script))
+            command.script = std::move(script);
+    }
+    return command;
+}
+
+const CommandTemplate *findUserCommand(const std::string &name)
+{
+    auto user = userCommands.find(name);
+    if (user == userCommands.end() || std::find(expandingAliases.begin(), expandingAliases.end(), name) != expandingAliases.end())
+        return nullptr;
+    return &user->second;
+}
+
+WordList compileWords(std::vector<std::string_view> tokens)
+{
+    WordList list;
+    list.words.reserve(tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i)
+        list.words.push_back(i > 0 && tokens[i - 1] == "<<" ? std::vector<TemplateSegment>{{tokens[i], -1, {}, {}}} : compileWord(tokens[i]));
+    list.tokens = std::move(tokens);
+    return list;
+}
+
+std::vector<TemplateSegment> compileWord(std::string_view word)
+{
+    std::vector<TemplateSegment> segments;
+    size_t literal = 0;
+    auto isNameChar = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+    for (size_t i = 0; i + 1 < word.size(); ++i)
+    {
+        size_t groupEnd = findGroupEnd(word, i);
+        if (word[i] != '$' && groupEnd == i)
+            continue;
+        TemplateSegment segment;
+        size_t end = i + 2;
+        if (groupEnd != i)
+        {
+            end = groupEnd;
+            size_t open = word[i] == '`' ? 1 : 2;
+            segment.substitution = word.substr(i + open, end - i - open - 1);
+        }
+        else if (std::isdigit(static_cast<unsigned char>(word[i + 1])) || word[i + 1] == '@')
+            segment.parameter = word[i + 1] == '@' ? 0 : word[i + 1] - '0';
+        else if (word[i + 1] == '{' && word.find('}', i + 2) != std::string_view::npos)
+        {
+            end = word.find('}', i + 2) + 1;
+            segment.variable = word.substr(i + 2, end - i - 3);
+        }
+        else if (word[i + 1] == '?' || std::isalpha(static_cast<unsigned char>(word[i + 1])) || word[i + 1] == '_')
+        {
+            while (word[i + 1] != '?' && end < word.size() && isNameChar(word[end]))
+                ++end;
+            segment.variable = word.substr(i + 1, end - i - 1);
+        }
+        else
+            continue;
+        if (i > literal)
+            segments.push_back({word.substr(literal, i - literal), -1, {}, {}});
+        segments.push_back(segment);
+        literal = end;
+        i = end - 1;
+    }
+    if (literal < word.size() || segments.empty())
+        segments.push_back({word.substr(literal), -1, {}, {}});
+    return segments;
+}
+
+std::vector<std::string> expandWords(std::span<const std::vector<TemplateSegment>> words, const std::vector<std::string> &arguments)
+{
+    std::vector<std::string> tokens;
+    tokens.reserve(words.size() + arguments.size());
+    for (const auto &segments : words)
+    {
+        if (segments.size() == 1 && segments[0].parameter == 0)
+        {
+            tokens.insert(tokens.end(), arguments.begin(), arguments.end());
+            continue;
+        }
+        std::string &token = tokens.emplace_back();
+        bool substituted = false;
+        for (const auto &segment : segments)
+        {
+            if (!segment.substitution.empty())
+            {
+                std::string output;
+                reportError(captureCommand(segment.substitution, output));
+                token.append(output);
+                substituted = true;
+            }
+            else if (!segment.variable.empty())
+            {
+                auto variable = shellVariables.find(std::string(segment.variable));
+                if (variable != shellVariables.end())
+                    token.append(variable->second);
+            }
+            else if (segment.parameter < 0)
+                token.append(segment.text);
+            else if (segment.parameter > 0 && static_cast<size_t>(segment.parameter) <= arguments.size())
+                token.append(arguments[segment.parameter - 1]);
+            else if (segment.parameter == 0)
+                for (size_t i = 0; i < arguments.size(); ++i)
+                    token.append(i ? " " : "").append(arguments[i]);
+        }
+        bool assignment = tokens.size() == 1 && segments[0].parameter < 0 && segments[0].text.find('=') != std::string_view::npos;
+        if (substituted && !assignment)
+        {
+            std::string text = std::move(token);
+            tokens.pop_back();
+            std::replace_if(text.begin(), text.end(), [](char c) { return c == '\n' || c == '\t'; }, ' ');
+            for (auto word : splitWords(text))
+                tokens.emplace_back(word);
+        }
+        else if (token.empty())
+            tokens.pop_back();
+    }
+    return tokens;
+}
+
+CommandError captureCommand(std::string_view commandLine, std::string &output)
+{
+    std::vector<std::string> tokens = splitStringBySpace(std::string(commandLine));
+    if (tokens.empty())
+        return CommandError::OK;
+    CommandError e = CommandError::OK;
+    if (pureBuiltins.contains(tokens[0]) && !findUserCommand(tokens[0])
+        && std::none_of(tokens.begin(), tokens.end(), [](const std::string &token) { return token == "&&" || token == "|" || isRedirection(token); }))
+    {
+        CaptureBuffer buffer(output);
+        std::ostream stream(&buffer);
+        std::ostream *previous = std::exchange(currentOutput, &stream);
+        ++captureDepth;
+        e = runTokens(tokens);
+        --captureDepth;
+        currentOutput = previous;
+    }
+    else
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0)
+            return fail(CommandError::FORK_ERROR, commandLine);
+        commandOutput().flush();
+        pid_t pid = execShell({}, {std::string(commandLine)}, 0, -1, fds[1]);
+        close(fds[1]);
+        if (pid < 0)
+        {
+            CommandError e = fail(CommandError::FORK_ERROR, commandLine);
+            close(fds[0]);
+            return e;
+        }
+        size_t capacity = 4096;
+        while (true)
+        {
+            size_t size = output.size();
+            output.resize(std::max(size + capacity / 2, capacity));
+            ssize_t n = read(fds[0], output.data() + size, output.size() - size);
+            output.resize(size + std::max<ssize_t>(n, 0));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            capacity = std::min<size_t>(output.capacity() * 2, 1 << 24);
+        }
+        close(fds[0]);
+        setPipeStatus({waitJob(pid, true)});
+    }
+    while (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    return e;
+}
+
+CaptureBuffer::int_type CaptureBuffer::overflow(int_type c)
+{
+    if (c != traits_type::eof())
+        output.push_back(static_cast<char>(c));
+    return c;
+}
+
+std::streamsize CaptureBuffer::xsputn(const char *data, std::streamsize length)
+{
+    output.append(data, length);
+    return length;
+}
+
+FdBuffer::FdBuffer(int fd) : fd(fd), buffer(IO_CHUNK_SIZE)
+{
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+FdBuffer::~FdBuffer()
+{
+    sync();
+}
+
+FdBuffer::int_type FdBuffer::overflow(int_type c)
+{
+    if (sync() != 0)
+        return traits_type::eof();
+    if (c != traits_type::eof())
+        sputc(static_cast<char>(c));
+    return traits_type::not_eof(c);
+}
+
+std::streamsize FdBuffer::xsputn(const char *data, std::streamsize length)
+{
+    if (length < epptr() - pptr())
+    {
+        std::memcpy(pptr(), data, length);
+        pbump(static_cast<int>(length));
+        return length;
+    }
+    if (sync() != 0 || !writeAll(data, length))
+        return 0;
+    return length;
+}
+
+int FdBuffer::sync()
+{
+    size_t pending = pptr() - pbase();
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return writeAll(buffer.data(), pending) ? 0 : -1;
+}
+
+// Читатель канала мог завершиться раньше: SIGPIPE игнорируется, и EPIPE просто обрывает вывод
+bool FdBuffer::writeAll(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+std::ostream &commandOutput()
+{
+    return *currentOutput;
+}
+
+CommandError runPipeline(const std::vector<std::string> &tokens, int depth, bool background)
+{
+    std::vector<std::vector<std::string>> stages(1);
+    for (const auto &token : tokens)
+    {
+        if (token == "|")
+            stages.emplace_back();
+        else
+            stages.back().push_back(token);
+    }
+    if (std::any_of(stages.begin(), stages.end(), [](const auto &stage) { return stage.empty(); }))
+        return CommandError::SYNTAX_ERROR;
+    std::vector<std::array<int, 2>> pipes(stages.size() - 1);
+    for (size_t i = 0; i < pipes.size(); ++i)
+    {
+        if (pipe2(pipes[i].data(), O_CLOEXEC) == 0)
+            continue;
+        fail(CommandError::FORK_ERROR);
+        for (size_t j = 0; j < i; ++j)
+        {
+            close(pipes[j][0]);
+            close(pipes[j][1]);
+        }
+        return CommandError::FORK_ERROR;
+    }
+    // Первая встроенная стадия работает в потоке терминала, поэтому дочерние процессы создаются до его запуска
+    bool inProcess = runsInProcess(stages[0]);
+    CommandError e = CommandError::OK;
+    std::vector<pid_t> stagePids(stages.size(), -1);
+    std::vector<CommandError> stageErrors(stages.size(), CommandError::OK);
+    commandOutput().flush();
+    // Все процессы конвейера в одной группе: терминал передаётся им вместе
+    pid_t group = 0;
+    for (size_t i = inProcess ? 1 : 0; i < stages.size() && e == CommandError::OK; ++i)
+    {
+        int outputFd = i < pipes.size() ? pipes[i][1] : background ? -1 : recordOutputFd;
+        e = stageErrors[i] = spawnStage(stages[i], i > 0 ? pipes[i - 1][0] : -1, outputFd, depth, group, stagePids[i], background);
+        group = group ? group : std::max(stagePids[i], 0);
+    }
+    for (size_t i = 0; i < pipes.size(); ++i)
+    {
+        close(pipes[i][0]);
+        if (i > 0 || !inProcess)
+            close(pipes[i][1]);
+    }
+    CommandError stageError = CommandError::OK;
+    if (inProcess)
+    {
+        std::thread stage([&stageError, &first = stages[0], fd = pipes[0][1]]
+        {
+            {
+                FdBuffer sink(fd);
+                std::ostream stream(&sink);
+                currentOutput = &stream;
+                captureDepth = 1;
+                stageError = executeCommand(first);
+                stream.flush();
+            }
+            close(fd);
+        });
+        stage.join();
+    }
+    std::vector<int> statuses;
+    for (size_t i = 0; i < stages.size(); ++i)
+    {
+        if (i == 0 && inProcess)
+            statuses.push_back(exitStatus(stageError));
+        else if (stagePids[i] < 0)
+            statuses.push_back(exitStatus(stageErrors[i] == CommandError::OK ? CommandError::FORK_ERROR : stageErrors[i]));
+        else if (background)
+        {
+            pids.insert(stagePids[i]);
+            statuses.push_back(0);
+        }
+        else
+            statuses.push_back(waitJob(stagePids[i], true));
+    }
+    setPipeStatus(statuses);
+    if (e != CommandError::OK)
+        return e;
+    return lastStatus == 0 ? CommandError::OK : CommandError::CONDITION_FALSE;
+}
+
+// Встроенные команды читают только именованные файлы, поэтому в процессе терминала
+// выполняется лишь первая стадия конвейера
+bool runsInProcess(const std::vector<std::string> &stage)
+{
+    return terminalCommands.contains(stage[0]) && !findUserCommand(stage[0]) && !definitionCommands.contains(stage[0])
+        && std::none_of(stage.begin(), stage.end(), isRedirection);
+}
+
+CommandError spawnStage(const std::vector<std::string> &stage, int input, int outputFd, int depth, pid_t group, pid_t &pid, bool background)
+{
+    // Встроенная команда не прочитает канал, поэтому со входом из конвейера запускается внешняя программа
+    if (!findUserCommand(stage[0]) && (input >= 0 || !terminalCommands.contains(stage[0])))
+        return spawnProcess(stage, pid, 0, input, outputFd, group, background);
+    pid = execShell(stage, {}, depth + 1, input, outputFd, group);
+    return pid < 0 ? fail(CommandError::FORK_ERROR, stage[0]) : CommandError::OK;
+}
+
+// Состояние терминала для дочернего процесса: переменные, псевдонимы и функции записываются
+// в memfd записями «вид, имя, значение», разделёнными нулевыми байтами
+int saveShellState(const std::vector<std::string> &lines, int depth, int childCaptureDepth)
+{
+    std::string state;
+    auto record = [&state](char kind, std::string_view name, std::string_view value) {
+        state.push_back(kind);
+        state.append(name).push_back('\0');
+        state.append(value).push_back('\0');
+    };
+    record('d', std::to_string(depth), std::to_string(childCaptureDepth));
+    for (const auto &[name, value] : shellVariables)
+        record('v', name, value);
+    for (const auto &[name, command] : userCommands)
+        record(command.appendArguments ? 'a' : 'f', name, *command.source);
+    for (const auto &line : lines)
+        record('l', "", line);
+    if (rateTable)
+        record('r', std::to_string(rateTableFd), "");
+    int fd = memfd_create("term-state", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (!writeAll(fd, state.data(), state.size()))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool loadShellState(int fd, std::vector<std::string> &lines, int &depth)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    std::string state(st.st_size, '\0');
+    if (preadFull(fd, state.data(), state.size(), 0) != static_cast<ssize_t>(state.size()))
+        return false;
+    close(fd);
+    std::string_view rest = state;
+    auto field = [&rest] {
+        size_t end = std::min(rest.find('\0'), rest.size());
+        std::string_view value = rest.substr(0, end);
+        rest.remove_prefix(std::min(end + 1, rest.size()));
+        return std::string(value);
+    };
+    while (!rest.empty())
+    {
+        char kind = rest[0];
+        rest.remove_prefix(1);
+        std::string name = field();
+        std::string value = field();
+        if (kind == 'd')
+        {
+            depth = std::stoi(name);
+            captureDepth = std::stoi(value);
+        }
+        else if (kind == 'v')
+            shellVariables[name] = value;
+        else if (kind == 'a' || kind == 'f')
+            userCommands[name] = compileTemplate(value, kind == 'a');
+        else if (kind == 'l')
+            lines.push_back(value);
+        else if (kind == 'r')
+        {
+            // Таблица остаётся открытой для внуков, но не для запускаемых программ
+            int tableFd = std::stoi(name);
+            void *table = mmap(nullptr, sizeof(RateClass) * RATE_MAX_CLASSES, PROT_READ | PROT_WRITE, MAP_SHARED, tableFd, 0);
+            fcntl(tableFd, F_SETFD, FD_CLOEXEC);
+            if (table != MAP_FAILED)
+            {
+                rateTableFd = tableFd;
+                rateTable = static_cast<RateClass *>(table);
+            }
+        }
+    }
+    return true;
+}
+
+// После fork в многопоточном терминале замки других потоков могут остаться занятыми навсегда,
+// поэтому ребёнок только перенаправляет дескрипторы и сразу вызывает exec самого терминала
+// в режиме -s: строки и токены выполняются уже в новом однопоточном процессе
+pid_t execShell(const std::vector<std::string> &tokens, const std::vector<std::string> &lines, int depth, int input, int outputFd, pid_t group)
+{
+    int stateFd = saveShellState(lines, depth, outputFd >= 0 ? 1 : captureDepth);
+    if (stateFd < 0)
+        return -1;
+    std::vector<std::string> arguments = {"term", "-s", std::to_string(stateFd)};
+    arguments.insert(arguments.end(), tokens.begin(), tokens.end());
+    char **argv = new char*[arguments.size() + 1];
+    tokensToArgv(arguments, argv);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setpgid(0, group);
+        if (input >= 0)
+            dup2(input, STDIN_FILENO);
+        if (outputFd >= 0)
+            dup2(outputFd, STDOUT_FILENO);
+        fcntl(stateFd, F_SETFD, 0);
+        if (rateTableFd >= 0)
+            fcntl(rateTableFd, F_SETFD, 0);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    int forkError = errno;
+    delete[] argv;
+    close(stateFd);
+    if (pid > 0)
+        setpgid(pid, group ? group : pid);
+    errno = forkError;
+    return pid;
+}
+
+// term -s FD [TOKENS...]: токены выполняются как одна команда, а строки из состояния —
+// по очереди до первой ошибки
+int runShellChild(int argc, char **argv)
+{
+    std::vector<std::string> lines;
+    int depth = 0;
+    if (!loadShellState(std::atoi(argv[2]), lines, depth))
+        return 126;
+    CommandError e = CommandError::OK;
+    if (argc > 3)
+        e = runCommand(std::vector<std::string>(argv + 3, argv + argc), depth);
+    for (size_t i = 0; i < lines.size() && e == CommandError::OK; ++i)
+    {
+        std::vector<std::string> tokens = splitStringBySpace(lines[i]);
+        if (!tokens.empty())
+            e = runInput(tokens);
+    }
+    reportError(e);
+    commandOutput().flush();
+    return e == CommandError::OK ? 0 : lastStatus ? lastStatus : 1;
+}
+
+CommandError aliasCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.empty())
+    {
+        for (const auto &[name, command] : userCommands)
+            if (command.appendArguments)
+                commandOutput() << "alias " << name << "='" << *command.source << "'" << std::endl;
+        return CommandError::OK;
+    }
+    size_t equals = arguments[0].find('=');
+    if (equals == std::string::npos || equals == 0)
+        return CommandError::INVALID_ARGUMENT;
+    std::string source = arguments[0].substr(equals + 1);
+    for (size_t i = 1; i < arguments.size(); ++i)
+        source += " " + arguments[i];
+    userCommands[arguments[0].substr(0, equals)] = compileTemplate(source, true);
+    return CommandError::OK;
+}
+
+CommandError functionCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.empty())
+    {
+        for (const auto &[name, command] : userCommands)
+            if (!command.appendArguments)
+                commandOutput() << "function " << name << " " << *command.source << std::endl;
+        return CommandError::OK;
+    }
+    if (arguments.size() < 2)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    std::string source = arguments[1];
+    for (size_t i = 2; i < arguments.size(); ++i)
+        source += " " + arguments[i];
+    userCommands[arguments[0]] = compileTemplate(source, false);
+    return CommandError::OK;
+}
+
+CommandError unaliasCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 1)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    if (userCommands.erase(arguments[0]) == 0)
+        return CommandError::INVALID_ARGUMENT;
+    return CommandError::OK;
+}
+
+CommandError killCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 1)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    int pid = std::stoi(arguments[0]);
+    adoptLaunchedJobs();
+    if (!pids.contains(pid))
+        return CommandError::INVALID_PID;
+    eraseLine();
+    printKill("kill " + arguments[0]);
+    killJobs({pid});
+    pids.erase(pid);
+    return CommandError::OK;
+}
+
+CommandError killAllCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 0)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    eraseLine();
+    printKill("killall");
+    cancelQueuedLaunches();
+    adoptLaunchedJobs();
+    std::vector<pid_t> jobs = cancelRetryJobs();
+    jobs.insert(jobs.end(), pids.begin(), pids.end());
+    killJobs(jobs);
+    pids.clear();
+    return CommandError::OK;
+}
+
+// Задание убивается целиком: через cgroup.kill, если терминал создал ему cgroup, иначе сигналом
+// его группе процессов и каждому потомку из одного общего снимка /proc, снятого до первого сигнала
+void killJobs(const std::vector<pid_t> &jobs)
+{
+    std::vector<pid_t> remaining;
+    for (auto pid : jobs)
+        if (!killJobCgroup(pid))
+            remaining.push_back(pid);
+    if (remaining.empty())
+        return;
+    ProcessTable table;
+    std::vector<pid_t> descendants;
+    if (scanProcesses(table))
+    {
+        std::vector<int> stack;
+        for (auto pid : remaining)
+        {
+            int root = table.find(pid);
+            if (root >= 0)
+                stack.push_back(root);
+        }
+        while (!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            for (int child = table.firstChild[index]; child >= 0; child = table.nextSibling[child])
+            {
+                descendants.push_back(table.processes[child].pid);
+                stack.push_back(child);
+            }
+        }
+    }
+    for (auto pid : remaining)
+    {
+        if (getpgid(pid) == pid)
+            killpg(pid, SIGKILL);
+        kill(pid, SIGKILL);
+    }
+    for (auto pid : descendants)
+        kill(pid, SIGKILL);
+}
+
+// Задание, которое само перешло в чужую cgroup, убивается сигналами: её соседи заданию не принадлежат
+bool killJobCgroup(pid_t pid)
+{
+    std::string created;
+    {
+        std::lock_guard<std::mutex> lock(jobCgroupMutex);
+        auto found = jobCgroups.find(pid);
+        if (found == jobCgroups.end())
+            return false;
+        created = found->second;
+    }
+    if (cgroupRoot() + readCgroupPath("/proc/" + std::to_string(pid) + "/cgroup") != created)
+        return false;
+    int fd = open((created + "/cgroup.kill").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool killed = write(fd, "1", 1) == 1;
+    close(fd);
+    return killed;
+}
+
+// Точка монтирования cgroup v2: в гибридной иерархии она лежит в unified
+const std::string &cgroupRoot()
+{
+    static const std::string root = access("/sys/fs/cgroup/cgroup.procs", F_OK) == 0 ? "/sys/fs/cgroup"
+        : access("/sys/fs/cgroup/unified/cgroup.procs", F_OK) == 0 ? "/sys/fs/cgroup/unified" : "";
+    return root;
+}
+
+// Пустая cgroup рядом с терминалом; ребёнок переходит в неё сам до exec, так что все его потомки
+// рождаются уже внутри. Без делегирования cgroup не создаётся, и задание убивается сигналами
+std::string createJobCgroup()
+{
+    if (!jobCgroupsEnabled)
+        return "";
+    std::string self = readCgroupPath("/proc/self/cgroup");
+    if (cgroupRoot().empty() || self.empty())
+        return "";
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(jobCgroupMutex);
+        path = cgroupRoot() + (self == "/" ? "" : self) + "/term-" + std::to_string(getpid()) + "-" + std::to_string(nextJobCgroup++);
+    }
+    return mkdir(path.c_str(), 0755) == 0 ? path : "";
+}
+
+// Cgroup удаляется, когда в ней не осталось процессов; занятые ждут следующего вызова
+void releaseJobCgroups()
+{
+    std::lock_guard<std::mutex> lock(jobCgroupMutex);
+    std::erase_if(jobCgroups, [](const auto &entry) { return rmdir(entry.second.c_str()) == 0 || errno == ENOENT; });
+}
+
+std::string readCgroupPath(const std::string &procPath)
+{
+    std::ifstream file(procPath);
+    std::string line;
+    while (std::getline(file, line))
+        if (line.compare(0, 3, "0::") == 0)
+            return line.substr(3);
+    return "";
+}
+
+CommandError niceCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 2)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    int prio = std::stoi(arguments[0]);
+    std::string command = arguments[1];
+    createProcess({command}, prio, true);
+    return CommandError::OK;
+}
+
+CommandError showPids(const std::vector<std::string> &arguments)
+{
+    adoptLaunchedJobs();
+    if (arguments.size() > 1)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    if (arguments.size() == 1)
+    {
+        if (arguments[0] != "tree")
+            return CommandError::INVALID_ARGUMENT;
+        ProcessTable table;
+        if (!scanProcesses(table))
+            return CommandError::READ_ERROR;
+        for (auto pid : pids)
+        {
+            int root = table.find(pid);
+            if (root < 0)
+                commandOutput() << pid << "\t-" << '\n';
+            else
+                printProcessTree(table, root);
+        }
+        commandOutput().flush();
+        return CommandError::OK;
+    }
+    commandOutput() << "PIDS:\t";
+    for (auto pid : pids)
+    {
+        commandOutput() << pid << '\t';
+    }
+    commandOutput() << std::endl;
+    std::lock_guard<std::mutex> lock(retryMutex);
+    if (retryJobs.empty())
+        return CommandError::OK;
+    // Повтор в паузе между попытками показывается без процесса
+    commandOutput() << "RETRY:\t";
+    for (const auto &[id, job] : retryJobs)
+        commandOutput() << id << ':' << (job->pid > 0 ? std::to_string(job->pid) : "-") << '\t';
+    commandOutput() << std::endl;
+    return CommandError::OK; 
+}
+
+// /proc читается одним проходом getdents64 по закэшированному дескриптору, stat каждого
+// процесса открывается через openat в общий буфер. Дерево хранится плоскими массивами индексов
+bool scanProcesses(ProcessTable &table)
+{
+    static int procFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procFd < 0)
+        return false;
+    std::array<char, 64 * 1024> entries;
+    lseek(procFd, 0, SEEK_SET);
+    while (true)
+    {
+        long length = syscall(SYS_getdents64, procFd, entries.data(), entries.size());
+        if (length < 0)
+            return false;
+        if (length == 0)
+            break;
+        for (long offset = 0; offset < length;)
+        {
+            auto *entry = reinterpret_cast<struct dirent64*>(entries.data() + offset);
+            offset += entry->d_reclen;
+            ProcessInfo info;
+            if (entry->d_type == DT_DIR && std::isdigit(static_cast<unsigned char>(entry->d_name[0])) && readProcessStat(procFd, entry->d_name, info))
+                table.processes.push_back(std::move(info));
+        }
+    }
+    auto &processes = table.processes;
+    std::sort(processes.begin(), processes.end(), [](const ProcessInfo &a, const ProcessInfo &b) { return a.pid < b.pid; });
+    table.parent.assign(processes.size(), -1);
+    table.firstChild.assign(processes.size(), -1);
+    table.nextSibling.assign(processes.size(), -1);
+    // Потомки связываются в порядке убывания pid, чтобы обход стеком выводил их по возрастанию
+    for (int i = 0; i < static_cast<int>(processes.size()); ++i)
+    {
+        table.parent[i] = table.find(processes[i].ppid);
+        if (table.parent[i] < 0)
+            continue;
+        table.nextSibling[i] = table.firstChild[table.parent[i]];
+        table.firstChild[table.parent[i]] = i;
+    }
+    return true;
+}
+
+bool readProcessStat(int procFd, const char *pid, ProcessInfo &info)
+{
+    thread_local std::array<char, 4096> buffer;
+    char path[32];
+    std::snprintf(path, sizeof(path), "%s/stat", pid);
+    int fd = openat(procFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t length = read(fd, buffer.data(), buffer.size());
+    close(fd);
+    if (length <= 0)
+        return false;
+    std::string_view stat(buffer.data(), length);
+    size_t open = stat.find('(');
+    size_t close = stat.rfind(')');
+    if (open == std::string_view::npos || close == std::string_view::npos || close + 4 >= stat.size())
+        return false;
+    info.pid = std::atoi(pid);
+    info.name = stat.substr(open + 1, close - open - 1);
+    info.ppid = std::atoi(stat.data() + close + 4);
+    return true;
+}
+
+int ProcessTable::find(pid_t pid) const
+{
+    auto found = std::lower_bound(processes.begin(), processes.end(), pid, [](const ProcessInfo &info, pid_t pid) { return info.pid < pid; });
+    return found != processes.end() && found->pid == pid ? static_cast<int>(found - processes.begin()) : -1;
+}
+
+void printProcessTree(const ProcessTable &table, int root)
+{
+    std::vector<std::pair<int, int>> stack = {{root, 0}};
+    while (!stack.empty())
+    {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        commandOutput() << std::string(2 * depth, ' ') << table.processes[index].pid << '\t' << table.processes[index].name << '\n';
+        for (int child = table.firstChild[index]; child >= 0; child = table.nextSibling[child])
+            stack.emplace_back(child, depth + 1);
+    }
+}
+
+CommandError listDirContent(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 0)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    for (const auto &entry : std::filesystem::directory_iterator(std::filesystem::current_path()))
+    {
+        if (captureDepth > 0)
+        {
+            commandOutput() << entry.path().filename().string() << '\n';
+            continue;
+        }
+        std::string textColor = getTextColor(entry.status());
+        commandOutput() << textColor << entry.path().filename().string() << "\033[0m\t";
+    }
+    commandOutput() << std::endl;
+    return CommandError::OK;
+}
+
+std::string getTextColor(std::filesystem::file_status status)
+{
+    switch (status.type())
+    {
+    case std::filesystem::file_type::regular:
+        return "";
+    case std::filesystem::file_type::directory:
+        return "\033[34m";
+    default:
+        return "\033[31m";
+    }
+}
+
+CommandError printFileContents(const std::vector<std::string> &arguments)
+{
+    if (arguments.empty())
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    for (const auto &argument : arguments)
+        if (!std::filesystem::is_regular_file(argument))
+            return fail(CommandError::INVALID_FILE_PATH, argument, 0);
+    eraseLine();
+    std::string command = "cat";
+    for (const auto &argument : arguments)
+        command += " " + argument;
+    printKitten(command);
+    for (const auto &argument : arguments)
+    {
+        CommandError e = readDecodedFile(argument, [](std::string_view chunk) {
+            commandOutput().write(chunk.data(), chunk.size());
+            return true;
+        });
+        if (e != CommandError::OK)
+            return e;
+    }
+    commandOutput() << std::endl;
+    return CommandError::OK;
+}
+
+CommandError parseLineCount(const std::vector<std::string> &arguments, size_t &count, std::string &path)
+{
+    count = 10;
+    if (arguments.size() == 1)
+    {
+        path = arguments[0];
+        return CommandError::OK;
+    }
+    if (arguments.size() != 3)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    if (arguments[0] != "-n" || arguments[1].empty() || !std::all_of(arguments[1].begin(), arguments[1].end(), ::isdigit))
+        return CommandError::INVALID_ARGUMENT;
+    count = std::stoull(arguments[1]);
+    path = arguments[2];
+    return CommandError::OK;
+}
+
+CommandError headCommand(const std::vector<std::string> &arguments)
+{
+    size_t count;
+    std::string path;
+    CommandError e = parseLineCount(arguments, count, path);
+    if (e != CommandError::OK || count == 0)
+        return e;
+    size_t printed = 0;
+    e = forEachLine(path, [&](std::string_view line) {
+        commandOutput().write(line.data(), line.size()) << '\n';
+        return ++printed < count;
+    });
+    commandOutput().flush();
+    return e;
+}
+
+CommandError tailCommand(const std::vector<std::string> &arguments)
+{
+    size_t count;
+    std::string path;
+    CommandError e = parseLineCount(arguments, count, path);
+    if (e != CommandError::OK || count == 0)
+        return e;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(CommandError::INVALID_FILE_PATH, path.c_str());
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        std::deque<std::string> lines;
+        e = forEachLine(path, [&](std::string_view line) {
+            lines.emplace_back(line);
+            if (lines.size() > count)
+                lines.pop_front();
+            return true;
+        });
+        for (const auto &line : lines)
+            commandOutput() << line << '\n';
+        commandOutput().flush();
+        return e;
+    }
+    std::vector<char> buffer(IO_CHUNK_SIZE);
+    off_t end = st.st_size;
+    off_t start = 0;
+    size_t newlines = 0;
+    bool found = false;
+    while (end > 0 && !found)
+    {
+        off_t begin = std::max<off_t>(0, end - static_cast<off_t>(buffer.size()));
+        ssize_t n = preadFull(fd, buffer.data(), end - begin, begin);
+        if (n != end - begin)
+        {
+            close(fd);
+            return CommandError::READ_ERROR;
+        }
+        for (off_t i = n - 1; i >= 0; --i)
+        {
+            if (buffer[i] != '\n' || begin + i == st.st_size - 1)
+                continue;
+            if (++newlines == count)
+            {
+                start = begin + i + 1;
+                found = true;
+                break;
+            }
+        }
+        end = begin;
+    }
+    close(fd);
+    e = readFile(path, [](std::string_view chunk) {
+        commandOutput().write(chunk.data(), chunk.size());
+        return true;
+    }, start);
+    commandOutput().flush();
+    return e;
+}
+
+CommandError grepCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() != 2)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    const std::string &pattern = arguments[0];
+    if (pattern.empty())
+        return CommandError::INVALID_ARGUMENT;
+    std::boyer_moore_horspool_searcher searcher(pattern.begin(), pattern.end());
+    // Совпадение подсвечивается только на терминале: в файл, канал и захват идут чистые строки
+    bool color = captureDepth == 0 && isatty(STDOUT_FILENO);
+    CommandError e = forEachLine(arguments[1], [&](std::string_view line) {
+        auto match = std::search(line.begin(), line.end(), searcher);
+        if (match == line.end())
+            return true;
+        if (!color)
+        {
+            commandOutput().write(line.data(), line.size()) << '\n';
+            return true;
+        }
+        size_t position = match - line.begin();
+        commandOutput().write(line.data(), position);
+        commandOutput() << "\033[31m" << pattern << "\033[0m";
+        commandOutput().write(line.data() + position + pattern.size(), line.size() - position - pattern.size()) << '\n';
+        return true;
+    });
+    commandOutput().flush();
+    return e;
+}
+
+CommandError wcCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.empty())
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    for (const auto &argument : arguments)
+    {
+        size_t lines = 0, words = 0, bytes = 0;
+        bool inWord = false;
+        CommandError e = readDecodedFile(argument, [&](std::string_view chunk) {
+            bytes += chunk.size();
+            lines += std::count(chunk.begin(), chunk.end(), '\n');
+            for (char c : chunk)
+            {
+                bool space = std::isspace(static_cast<unsigned char>(c));
+                if (!space && !inWord)
+                    ++words;
+                inWord = !space;
+            }
+            return true;
+        });
+        if (e != CommandError::OK)
+            return e;
+        commandOutput() << lines << '\t' << words << '\t' << bytes << '\t' << argument << std::endl;
+    }
+    return CommandError::OK;
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+    for (unsigned i = 0; i < threadCount; ++i)
+        workers.emplace_back([this] {
+            while (true)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock lock(mutex);
+                    condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (stopping && tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+                task();
+            }
+        });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+ThreadPool &workerPool()
+{
+    static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+IoUring::~IoUring()
+{
+    if (buffers)
+        munmap(buffers, IO_CHUNK_SIZE * IO_QUEUE_DEPTH);
+    if (sqesMemory != MAP_FAILED)
+        munmap(sqesMemory, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool ioUringInit(IoUring &ring, unsigned entries)
+{
+    io_uring_params params{};
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0)
+        return false;
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+    ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED)
+        return false;
+    ring.cqRing = singleMmap ? ring.sqRing : mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cqRing == MAP_FAILED)
+        return false;
+    ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring.sqesMemory = mmap(nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqesMemory == MAP_FAILED)
+        return false;
+    char *sq = static_cast<char*>(ring.sqRing);
+    char *cq = static_cast<char*>(ring.cqRing);
+    ring.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring.sqes = static_cast<io_uring_sqe*>(ring.sqesMemory);
+    return true;
+}
+
+bool ioUringRegisterBuffers(IoUring &ring)
+{
+    void *memory = mmap(nullptr, IO_CHUNK_SIZE * IO_QUEUE_DEPTH, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+    ring.buffers = static_cast<char*>(memory);
+    iovec iovecs[IO_QUEUE_DEPTH];
+    for (unsigned i = 0; i < IO_QUEUE_DEPTH; ++i)
+        iovecs[i] = {ring.buffers + i * IO_CHUNK_SIZE, IO_CHUNK_SIZE};
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, IO_QUEUE_DEPTH) == 0;
+}
+
+void ioUringQueueRead(IoUring &ring, unsigned slot, size_t filled, size_t length, off_t offset)
+{
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & *ring.sqMask;
+    io_uring_sqe *sqe = &ring.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = reinterpret_cast<uintptr_t>(ring.buffers + slot * IO_CHUNK_SIZE + filled);
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int ioUringEnter(IoUring &ring, unsigned toSubmit, unsigned minComplete)
+{
+    int result;
+    do
+        result = syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    while (result < 0 && errno == EINTR);
+    return result;
+}
+
+bool ioUringPopCompletion(IoUring &ring, io_uring_cqe &cqe)
+{
+    unsigned head = *ring.cqHead;
+    if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = ring.cqes[head & *ring.cqMask];
+    __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+IoUring *getFileRing()
+{
+    thread_local IoUring ring;
+    thread_local int state = -1;
+    if (state == -1)
+        state = !std::getenv("TERM_NO_IO_URING") && ioUringInit(ring, IO_QUEUE_DEPTH) && ioUringRegisterBuffers(ring);
+    return state && !ring.broken ? &ring : nullptr;
+}
+
+ssize_t preadFull(int fd, char *buffer, size_t length, off_t offset)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+CommandError readFile(const std::filesystem::path &path, const ChunkHandler &handler, off_t offset)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(CommandError::INVALID_FILE_PATH, path.c_str());
+    struct stat st;
+    int statError = fstat(fd, &st) != 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : 0;
+    if (statError != 0)
+    {
+        CommandError e = fail(CommandError::INVALID_FILE_PATH, path.c_str(), statError);
+        close(fd);
+        return e;
+    }
+    CommandError e;
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+        e = readStream(fd, handler);
+    else if (IoUring *ring = getFileRing())
+        e = readFileWithUring(*ring, fd, offset, st.st_size, handler);
+    else
+        e = readFileWithPread(fd, offset, st.st_size, handler);
+    close(fd);
+    return e;
+}
+
+CommandError readFileWithUring(IoUring &ring, int fd, off_t offset, off_t size, const ChunkHandler &handler)
+{
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, &fd, 1) != 0)
+        return readFileWithPread(fd, offset, size, handler);
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    struct ReadSlot
+    {
+        off_t offset = -1;
+        size_t length = 0;
+        size_t filled = 0;
+        bool done = false;
+    };
+    ReadSlot slots[IO_QUEUE_DEPTH];
+    off_t nextOffset = offset;
+    off_t deliverOffset = offset;
+    unsigned inFlight = 0, toSubmit = 0;
+    auto queueSlot = [&](unsigned i) {
+        slots[i] = {nextOffset, std::min<size_t>(IO_CHUNK_SIZE, size - nextOffset), 0, false};
+        ioUringQueueRead(ring, i, 0, slots[i].length, slots[i].offset);
+        nextOffset += slots[i].length;
+        ++inFlight;
+        ++toSubmit;
+    };
+    for (unsigned i = 0; i < IO_QUEUE_DEPTH && nextOffset < size; ++i)
+        queueSlot(i);
+    CommandError e = CommandError::OK;
+    bool stopped = false;
+    while (inFlight > 0)
+    {
+        if (ioUringEnter(ring, toSubmit, 1) < 0)
+        {
+            e = CommandError::READ_ERROR;
+            break;
+        }
+        toSubmit = 0;
+        io_uring_cqe cqe;
+        while (ioUringPopCompletion(ring, cqe))
+        {
+            ReadSlot &slot = slots[cqe.user_data];
+            --inFlight;
+            if (cqe.res < 0 && e == CommandError::OK)
+                e = CommandError::READ_ERROR;
+            if (cqe.res <= 0 || stopped || e != CommandError::OK)
+            {
+                slot.done = true;
+                continue;
+            }
+            slot.filled += cqe.res;
+            slot.done = slot.filled == slot.length;
+            if (!slot.done)
+            {
+                ioUringQueueRead(ring, cqe.user_data, slot.filled, slot.length - slot.filled, slot.offset + slot.filled);
+                ++inFlight;
+                ++toSubmit;
+            }
+        }
+        if (e != CommandError::OK)
+            stopped = true;
+        bool delivered = true;
+        while (!stopped && delivered)
+        {
+            delivered = false;
+            for (unsigned i = 0; i < IO_QUEUE_DEPTH && !stopped; ++i)
+            {
+                if (!slots[i].done || slots[i].offset != deliverOffset)
+                    continue;
+                char *data = ring.buffers + i * IO_CHUNK_SIZE;
+                bool truncated = slots[i].filled < slots[i].length;
+                if (!handler(std::string_view(data, slots[i].filled)) || truncated)
+                    stopped = true;
+                deliverOffset += slots[i].filled;
+                slots[i].offset = -1;
+                if (!stopped && nextOffset < size)
+                    queueSlot(i);
+                delivered = true;
+            }
+        }
+    }
+    // После сбоя io_uring_enter в полёте могут остаться чтения: их буферы нельзя отдавать
+    // следующему файлу, пока ядро не вернёт завершения. Если дождаться не удалось, кольцо
+    // в этом потоке больше не используется и чтение уходит на pread
+    while (inFlight > 0 && ioUringEnter(ring, toSubmit, 1) >= 0)
+    {
+        toSubmit = 0;
+        io_uring_cqe cqe;
+        while (ioUringPopCompletion(ring, cqe))
+            --inFlight;
+    }
+    if (inFlight > 0)
+    {
+        ring.broken = true;
+        return e;
+    }
+    syscall(__NR_io_uring_register, ring.fd, IORING_UNREGISTER_FILES, nullptr, 0);
+    return e;
+}
+
+CommandError readFileWithPread(int fd, off_t offset, off_t size, const ChunkHandler &handler)
+{
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<std::vector<char>> buffers(IO_QUEUE_DEPTH, std::vector<char>(IO_CHUNK_SIZE));
+    std::deque<std::pair<unsigned, std::future<ssize_t>>> inFlight;
+    off_t nextOffset = offset;
+    auto queueRead = [&](unsigned i) {
+        size_t length = std::min<size_t>(IO_CHUNK_SIZE, size - nextOffset);
+        off_t at = nextOffset;
+        char *buffer = buffers[i].data();
+        inFlight.emplace_back(i, workerPool().submit([=] { return preadFull(fd, buffer, length, at); }));
+        nextOffset += length;
+    };
+    for (unsigned i = 0; i < IO_QUEUE_DEPTH && nextOffset < size; ++i)
+        queueRead(i);
+    CommandError e = CommandError::OK;
+    bool stopped = false;
+    while (!inFlight.empty())
+    {
+        auto [i, future] = std::move(inFlight.front());
+        inFlight.pop_front();
+        ssize_t n = future.get();
+        if (stopped)
+            continue;
+        if (n < 0)
+            e = CommandError::READ_ERROR;
+        if (n <= 0 || !handler(std::string_view(buffers[i].data(), n)))
+        {
+            stopped = true;
+            continue;
+        }
+        if (nextOffset < size)
+            queueRead(i);
+    }
+    return e;
+}
+
+CommandError readStream(int fd, const ChunkHandler &handler)
+{
+    std::vector<char> buffer(IO_CHUNK_SIZE);
+    while (true)
+    {
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return fail(CommandError::READ_ERROR);
+        if (n == 0 || !handler(std::string_view(buffer.data(), n)))
+            return CommandError::OK;
+    }
+}
+
+Compression detectCompression(const std::filesystem::path &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return Compression::NONE;
+    unsigned char magic[4] = {};
+    ssize_t n = preadFull(fd, reinterpret_cast<char*>(magic), sizeof(magic), 0);
+    close(fd);
+    if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+        return Compression::GZIP;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return Compression::ZSTD;
+    return Compression::NONE;
+}
+
+CommandError readDecodedFile(const std::filesystem::path &path, const ChunkHandler &handler)
+{
+    switch (detectCompression(path))
+    {
+#if defined(TERM_HAVE_ZLIB)
+    case Compression::GZIP:
+        return readGzipFile(path, handler);
+#endif
+#if defined(TERM_HAVE_ZSTD)
+    case Compression::ZSTD:
+        return readZstdFile(path, handler);
+#endif
+    default:
+        return readFile(path, handler);
+    }
+}
+
+#if defined(TERM_HAVE_ZLIB)
+CommandError readGzipFile(const std::filesystem::path &path, const ChunkHandler &handler)
+{
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+        return CommandError::READ_ERROR;
+    std::vector<char> output(IO_CHUNK_SIZE);
+    CommandError e = CommandError::OK;
+    bool stopped = false;
+    CommandError readError = readFile(path, [&](std::string_view chunk) {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+        stream.avail_in = chunk.size();
+        do
+        {
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = output.size();
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_STREAM_END)
+                inflateReset(&stream);
+            else if (result != Z_OK && result != Z_BUF_ERROR)
+            {
+                e = fail(CommandError::READ_ERROR, path.c_str(), 0);
+                return false;
+            }
+            size_t produced = output.size() - stream.avail_out;
+            if (produced > 0 && !handler(std::string_view(output.data(), produced)))
+            {
+                stopped = true;
+                return false;
+            }
+            if (result == Z_BUF_ERROR)
+                break;
+        } while (stream.avail_in > 0 || stream.avail_out == 0);
+        return true;
+    });
+    // После конца каждого члена inflateReset обнуляет total_in, так что ненулевой счётчик — оборванный член
+    if (readError == CommandError::OK && e == CommandError::OK && !stopped && stream.total_in > 0)
+        e = fail(CommandError::TRUNCATED_INPUT, path.c_str(), 0);
+    inflateEnd(&stream);
+    return readError != CommandError::OK ? readError : e;
+}
+#endif
+
+#if defined(TERM_HAVE_ZSTD)
+CommandError readZstdFile(const std::filesystem::path &path, const ChunkHandler &handler)
+{
+    MappedFile file;
+    CommandError e = mapFile(path, file);
+    if (e != CommandError::OK)
+        return e;
+    std::string_view data = file.view();
+    struct Frame
+    {
+        std::string_view compressed;
+        unsigned long long size;
+    };
+    std::vector<Frame> frames;
+    bool sizesKnown = true;
+    for (size_t offset = 0; offset < data.size() && sizesKnown;)
+    {
+        // Оборванный или испорченный кадр разбирает потоковый путь: он выдаст целые кадры и назовёт ошибку
+        size_t length = ZSTD_findFrameCompressedSize(data.data() + offset, data.size() - offset);
+        if (ZSTD_isError(length))
+        {
+            sizesKnown = false;
+            break;
+        }
+        unsigned long long size = ZSTD_getFrameContentSize(data.data() + offset, length);
+        // Размер из заголовка не проверен: слишком большой кадр не выделяется целиком, а идёт потоком
+        sizesKnown = size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR && size <= ZSTD_PARALLEL_FRAME_LIMIT;
+        frames.push_back({data.substr(offset, length), size});
+        offset += length;
+    }
+    if (sizesKnown && frames.size() > 1)
+    {
+        using Decoded = std::pair<CommandError, std::string>;
+        auto decode = [](Frame frame) {
+            std::string output;
+            try
+            {
+                output.resize(frame.size);
+            }
+            catch (const std::bad_alloc &)
+            {
+                return Decoded(CommandError::READ_ERROR, "");
+            }
+            size_t result = ZSTD_decompress(output.data(), output.size(), frame.compressed.data(), frame.compressed.size());
+            bool valid = !ZSTD_isError(result) && result == frame.size;
+            return Decoded(valid ? CommandError::OK : CommandError::READ_ERROR, std::move(output));
+        };
+        size_t window = 2 * std::max(1u, std::thread::hardware_concurrency());
+        std::deque<std::future<Decoded>> pending;
+        size_t next = 0;
+        bool stopped = false;
+        while (next < frames.size() || !pending.empty())
+        {
+            while (!stopped && next < frames.size() && pending.size() < window)
+                pending.push_back(workerPool().submit([decode, frame = frames[next++]] { return decode(frame); }));
+            if (pending.empty())
+                break;
+            auto [frameError, output] = pending.front().get();
+            pending.pop_front();
+            if (stopped)
+                continue;
+            if (frameError != CommandError::OK)
+                e = fail(frameError, path.c_str(), 0);
+            stopped = e != CommandError::OK || (!output.empty() && !handler(output));
+        }
+        return e;
+    }
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    std::vector<char> output(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer input = {data.data(), data.size(), 0};
+    bool stopped = false;
+    // Ненулевой ответ decompressStream значит, что кадр ещё не закончен; полный буфер — что вывод не весь
+    size_t result = 0;
+    bool outputFull = false;
+    while (!stopped && e == CommandError::OK && (input.pos < input.size || outputFull))
+    {
+        ZSTD_outBuffer out = {output.data(), output.size(), 0};
+        result = ZSTD_decompressStream(context, &out, &input);
+        outputFull = out.pos == out.size;
+        if (ZSTD_isError(result))
+            e = fail(CommandError::READ_ERROR, path.c_str(), 0);
+        else if (out.pos > 0)
+            stopped = !handler(std::string_view(output.data(), out.pos));
+    }
+    if (!stopped && e == CommandError::OK && result != 0)
+        e = fail(CommandError::TRUNCATED_INPUT, path.c_str(), 0);
+    ZSTD_freeDCtx(context);
+    return e;
+}
+#endif
+
+CommandError forEachLine(const std::filesystem::path &path, const ChunkHandler &handler)
+{
+    std::string carry;
+    bool stopped = false;
+    CommandError e = readDecodedFile(path, [&](std::string_view chunk) {
+        size_t start = 0;
+        size_t newline;
+        while ((newline = chunk.find('\n', start)) != std::string_view::npos)
+        {
+            std::string_view line = chunk.substr(start, newline - start);
+            start = newline + 1;
+            if (!carry.empty())
+            {
+                carry.append(line);
+                stopped = !handler(carry);
+                carry.clear();
+            }
+            else
+                stopped = !handler(line);
+            if (stopped)
+                return false;
+        }
+        carry.append(chunk.substr(start));
+        return true;
+    });
+    if (e == CommandError::OK && !stopped && !carry.empty())
+        handler(carry);
+    return e;
+}
+
+CommandError copyCommand(const std::vector<std::string> &arguments)
+{
+    bool recursive = !arguments.empty() && arguments[0] == "-r";
+    if (arguments.size() != (recursive ? 3u : 2u))
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    std::filesystem::path source(arguments[recursive]);
+    std::filesystem::path destination(arguments[recursive + 1]);
+    std::error_code error;
+    auto status = std::filesystem::symlink_status(source, error);
+    if (error)
+        return fail(CommandError::INVALID_FILE_PATH, source.c_str(), error.value());
+    if (std::filesystem::is_directory(destination))
+        destination /= source.filename();
+    if (std::filesystem::is_directory(status))
+        return recursive ? copyTree(source, destination) : CommandError::INVALID_ARGUMENT;
+    return copyFile(source, destination);
+}
+
+CommandError copyFile(const std::filesystem::path &source, const std::filesystem::path &destination)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return fail(CommandError::INVALID_FILE_PATH, source.c_str());
+    struct stat st;
+    if (fstat(in, &st) != 0)
+    {
+        CommandError e = fail(CommandError::READ_ERROR, source.c_str());
+        close(in);
+        return e;
+    }
+    // O_TRUNC на самом источнике стёр бы его раньше, чем он будет прочитан
+    struct stat target;
+    if (stat(destination.c_str(), &target) == 0 && target.st_dev == st.st_dev && target.st_ino == st.st_ino)
+    {
+        close(in);
+        return fail(CommandError::COPY_ERROR, destination.c_str(), 0);
+    }
+    int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out < 0)
+    {
+        CommandError e = fail(CommandError::COPY_ERROR, destination.c_str());
+        close(in);
+        return e;
+    }
+    CommandError e = CommandError::OK;
+    if (ioctl(out, FICLONE, in) != 0)
+    {
+        bool fallback = false;
+        size_t copied = 0;
+        while (true)
+        {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                fallback = true;
+            else if (n < 0)
+                e = fail(CommandError::COPY_ERROR, destination.c_str());
+            if (n <= 0)
+                break;
+            copied += n;
+        }
+        if (fallback || (copied == 0 && st.st_size == 0))
+            e = readStream(in, [&](std::string_view chunk) {
+                if (writeAll(out, chunk.data(), chunk.size()))
+                    return true;
+                e = fail(CommandError::COPY_ERROR, destination.c_str());
+                return false;
+            });
+    }
+    close(in);
+    if (close(out) != 0 && e == CommandError::OK)
+        e = fail(CommandError::COPY_ERROR, destination.c_str());
+    return e;
+}
+
+CommandError copyTree(const std::filesystem::path &source, const std::filesystem::path &destination)
+{
+    struct PendingScan
+    {
+        std::filesystem::path destination;
+        std::future<std::vector<std::filesystem::directory_entry>> entries;
+    };
+    auto scanDirectory = [](std::filesystem::path directory) {
+        return workerPool().submit([directory] {
+            return std::vector<std::filesystem::directory_entry>(std::filesystem::directory_iterator(directory), {});
+        });
+    };
+    std::deque<PendingScan> scans;
+    std::deque<std::future<CommandError>> copies;
+    CommandError e = CommandError::OK;
+    if (isWithinTree(source, destination))
+        return fail(CommandError::COPY_ERROR, destination.c_str(), 0);
+    std::error_code error;
+    std::filesystem::create_directory(destination, source, error);
+    if (error)
+        return fail(CommandError::COPY_ERROR, destination.c_str(), error.value());
+    scans.push_back({destination, scanDirectory(source)});
+    while (!scans.empty() && e == CommandError::OK)
+    {
+        PendingScan scan = std::move(scans.front());
+        scans.pop_front();
+        std::vector<std::filesystem::directory_entry> entries;
+        try
+        {
+            entries = scan.entries.get();
+        }
+        catch (const std::filesystem::filesystem_error &)
+        {
+            e = CommandError::READ_ERROR;
+            break;
+        }
+        for (const auto &entry : entries)
+        {
+            std::filesystem::path target = scan.destination / entry.path().filename();
+            if (entry.is_symlink(error))
+                std::filesystem::copy_symlink(entry.path(), target, error);
+            else if (entry.is_directory(error))
+            {
+                std::filesystem::create_directory(target, entry.path(), error);
+                if (!error)
+                    scans.push_back({target, scanDirectory(entry.path())});
+            }
+            else
+            {
+                while (copies.size() >= COPY_MAX_IN_FLIGHT)
+                {
+                    CommandError copyError = copies.front().get();
+                    copies.pop_front();
+                    if (e == CommandError::OK)
+                        e = copyError;
+                }
+                copies.push_back(workerPool().submit([source = entry.path(), target] { return copyFile(source, target); }));
+            }
+            if (error)
+                e = CommandError::COPY_ERROR;
+        }
+    }
+    for (auto &scan : scans)
+        scan.entries.wait();
+    for (auto &copy : copies)
+    {
+        CommandError copyError = copy.get();
+        if (e == CommandError::OK)
+            e = copyError;
+    }
+    return e;
+}
+
+// Копия каталога внутрь самого себя росла бы вместе с обходом. Сравниваются устройство и inode
+// каждого предка пути, так что ссылки и ".." не обходят проверку
+bool isWithinTree(const std::filesystem::path &root, const std::filesystem::path &path)
+{
+    struct stat rootStat, st;
+    std::error_code error;
+    auto current = std::filesystem::weakly_canonical(path, error);
+    if (error || stat(root.c_str(), &rootStat) != 0)
+        return false;
+    while (true)
+    {
+        if (stat(current.c_str(), &st) == 0 && st.st_dev == rootStat.st_dev && st.st_ino == rootStat.st_ino)
+            return true;
+        if (!current.has_relative_path())
+            return false;
+        current = current.parent_path();
+    }
+}
+
+bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+CommandError removeCommand(const std::vector<std::string> &arguments)
+{
+    bool recursive = !arguments.empty() && arguments[0] == "-r";
+    if (arguments.size() < (recursive ? 2u : 1u))
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    for (size_t i = recursive; i < arguments.size(); ++i)
+    {
+        struct stat st;
+        if (lstat(arguments[i].c_str(), &st) != 0)
+            return fail(CommandError::INVALID_FILE_PATH, arguments[i]);
+        if (S_ISDIR(st.st_mode) && !recursive)
+            return CommandError::INVALID_ARGUMENT;
+        if (S_ISDIR(st.st_mode) && isProtectedRemoval(arguments[i], st))
+            return fail(CommandError::INVALID_ARGUMENT, arguments[i], 0);
+        CommandError e = S_ISDIR(st.st_mode) ? removeTree(arguments[i]) : CommandError::OK;
+        if (!S_ISDIR(st.st_mode) && unlink(arguments[i].c_str()) != 0)
+            e = fail(CommandError::REMOVE_ERROR, arguments[i]);
+        if (e != CommandError::OK)
+            return e;
+    }
+    return CommandError::OK;
+}
+
+// Корень, текущий и родительский каталоги не удаляются, как бы они ни были записаны
+bool isProtectedRemoval(const std::string &path, const struct stat &st)
+{
+    struct stat root;
+    if (stat("/", &root) == 0 && st.st_dev == root.st_dev && st.st_ino == root.st_ino)
+        return true;
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos)
+        return true;
+    size_t start = path.find_last_of('/', end);
+    std::string_view name = std::string_view(path).substr(start == std::string::npos ? 0 : start + 1, end + 1 - (start == std::string::npos ? 0 : start + 1));
+    return name == "." || name == "..";
+}
+
+CommandError removeTree(const std::string &path)
+{
+    auto root = std::make_shared<RemovalNode>();
+    root->name = path;
+    root->done = std::make_shared<std::promise<void>>();
+    root->failed = std::make_shared<std::atomic<bool>>(false);
+    root->openDirectories = std::make_shared<std::atomic<size_t>>(1);
+    auto done = root->done->get_future();
+    auto failed = root->failed;
+    workerPool().submit([root] { scanForRemoval(root); });
+    done.wait();
+    return *failed ? CommandError::REMOVE_ERROR : CommandError::OK;
+}
+
+void scanForRemoval(std::shared_ptr<RemovalNode> node)
+{
+    int parentFd = node->parent ? dirfd(node->parent->directory) : AT_FDCWD;
+    int fd = openat(parentFd, node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    node->directory = fd < 0 ? nullptr : fdopendir(fd);
+    if (!node->directory)
+    {
+        fail(CommandError::REMOVE_ERROR, node->name);
+        if (fd >= 0)
+            close(fd);
+        --*node->openDirectories;
+        *node->failed = true;
+        finishRemoval(node);
+        return;
+    }
+    static const size_t budget = [] {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+            return REMOVE_MAX_OPEN_DIRECTORIES;
+        return std::max<size_t>(1, std::min<size_t>(REMOVE_MAX_OPEN_DIRECTORIES, limit.rlim_cur / 4));
+    }();
+    fd = dirfd(node->directory);
+    while (dirent *entry = readdir(node->directory))
+    {
+        if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (!isDirectoryEntry(fd, entry))
+        {
+            if (unlinkat(fd, entry->d_name, 0) != 0)
+            {
+                fail(CommandError::REMOVE_ERROR, entry->d_name);
+                *node->failed = true;
+            }
+            continue;
+        }
+        // Каталог держит дескриптор, пока не удалено всё его поддерево. Место в бюджете занимается
+        // при постановке в очередь, а не при открытии, иначе очередь успевает набрать сверх лимита.
+        // Когда бюджет исчерпан, поддерево удаляется сразу в этом же потоке
+        if (node->openDirectories->fetch_add(1) >= budget)
+        {
+            --*node->openDirectories;
+            removeSubtree(fd, entry->d_name, *node->failed, *node->openDirectories, budget);
+            continue;
+        }
+        auto child = std::make_shared<RemovalNode>();
+        child->parent = node;
+        child->name = entry->d_name;
+        child->done = node->done;
+        child->failed = node->failed;
+        child->openDirectories = node->openDirectories;
+        ++node->pending;
+        workerPool().submit([child] { scanForRemoval(child); });
+    }
+    finishRemoval(node);
+}
+
+// Обход явным стеком, поэтому глубина дерева не расходует стек вызовов. Открытые кадры входят
+// в общий бюджет дескрипторов: сверх него и при EMFILE дескриптор отдаёт старший кадр, а на
+// обратном пути родитель открывается через ".." с проверкой устройства и inode. Позиция чтения
+// при этом не нужна: из опустошаемого каталога заново читается только то, что в нём осталось,
+// кроме записей, которые удалить не удалось
+void removeSubtree(int parentFd, const std::string &name, std::atomic<bool> &failed, std::atomic<size_t> &openDirectories, size_t budget)
+{
+    struct Frame
+    {
+        std::string name;
+        DIR *directory = nullptr;
+        bool known = false;
+        dev_t device = 0;
+        ino_t inode = 0;
+        std::vector<std::string> skipped;
+    };
+    std::vector<Frame> stack;
+    size_t oldest = 0;
+    auto closeFrame = [&](Frame &frame)
+    {
+        closedir(frame.directory);
+        frame.directory = nullptr;
+        --openDirectories;
+    };
+    // Кадры от limit и выше нужны открытыми: относительно них идёт текущее открытие
+    auto release = [&](size_t limit)
+    {
+        for (; oldest < limit; ++oldest)
+            if (stack[oldest].directory)
+            {
+                closeFrame(stack[oldest]);
+                return true;
+            }
+        return false;
+    };
+    auto openAt = [&](int at, const char *path, size_t limit)
+    {
+        if (openDirectories.fetch_add(1) >= budget)
+            release(limit);
+        while (true)
+        {
+            int fd = openat(at, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0 || (errno != EMFILE && errno != ENFILE) || !release(limit))
+            {
+                if (fd < 0)
+                    --openDirectories;
+                return fd;
+            }
+        }
+    };
+    // Кадр, который уже открывался, принимает только тот же каталог
+    auto attach = [&](Frame &frame, size_t index, int fd)
+    {
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool replaced = false;
+        if (fstat(fd, &st) != 0 || (replaced = frame.known && (st.st_dev != frame.device || st.st_ino != frame.inode)) || !(frame.directory = fdopendir(fd)))
+        {
+            int error = replaced ? ESTALE : errno;
+            close(fd);
+            --openDirectories;
+            errno = error;
+            return false;
+        }
+        frame.known = true;
+        frame.device = st.st_dev;
+        frame.inode = st.st_ino;
+        oldest = std::min(oldest, index);
+        return true;
+    };
+    // Запасной путь по именам от ближайшего открытого предка; промежуточные кадры снова закрываются
+    auto reopen = [&](size_t index)
+    {
+        size_t first = index;
+        while (first > 0 && !stack[first - 1].directory)
+            --first;
+        for (size_t i = first; i <= index; ++i)
+        {
+            int at = i == 0 ? parentFd : dirfd(stack[i - 1].directory);
+            if (!attach(stack[i], i, openAt(at, stack[i].name.c_str(), i == 0 ? 0 : i - 1)))
+                return false;
+            if (i > first)
+                closeFrame(stack[i - 1]);
+        }
+        return true;
+    };
+    auto report = [&](const std::string &entry)
+    {
+        fail(CommandError::REMOVE_ERROR, entry);
+        failed = true;
+        if (!stack.empty())
+            stack.back().skipped.push_back(entry);
+    };
+    stack.push_back({name});
+    if (!attach(stack[0], 0, openAt(parentFd, name.c_str(), 0)))
+    {
+        stack.clear();
+        report(name);
+    }
+    while (!stack.empty())
+    {
+        size_t top = stack.size() - 1;
+        if (!stack[top].directory && !reopen(top))
+        {
+            std::string lost = std::move(stack[top].name);
+            stack.pop_back();
+            report(lost);
+            continue;
+        }
+        DIR *directory = stack[top].directory;
+        int fd = dirfd(directory);
+        bool descended = false;
+        while (dirent *entry = readdir(directory))
+        {
+            std::string_view entryName = entry->d_name;
+            const auto &skipped = stack[top].skipped;
+            if (entryName == "." || entryName == ".." || std::find(skipped.begin(), skipped.end(), entryName) != skipped.end())
+                continue;
+            if (!isDirectoryEntry(fd, entry))
+            {
+                if (unlinkat(fd, entry->d_name, 0) != 0)
+                    report(entry->d_name);
+                continue;
+            }
+            stack.push_back({entry->d_name});
+            if (attach(stack.back(), top + 1, openAt(fd, entry->d_name, top)))
+            {
+                descended = true;
+                break;
+            }
+            stack.pop_back();
+            report(entry->d_name);
+        }
+        if (descended)
+            continue;
+        if (top > 0 && !stack[top - 1].directory)
+            attach(stack[top - 1], top - 1, openAt(fd, "..", top - 1));
+        closeFrame(stack[top]);
+        std::string emptied = std::move(stack[top].name);
+        stack.pop_back();
+        if (!stack.empty() && !stack.back().directory && !reopen(top - 1))
+            report(emptied);
+        else if (unlinkat(stack.empty() ? parentFd : dirfd(stack.back().directory), emptied.c_str(), AT_REMOVEDIR) != 0)
+            report(emptied);
+    }
+}
+
+bool isDirectoryEntry(int fd, const dirent *entry)
+{
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_DIR;
+    struct stat st;
+    return fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+void finishRemoval(std::shared_ptr<RemovalNode> node)
+{
+    while (node && --node->pending == 0)
+    {
+        if (node->directory)
+        {
+            closedir(node->directory);
+            --*node->openDirectories;
+        }
+        int parentFd = node->parent ? dirfd(node->parent->directory) : AT_FDCWD;
+        if (unlinkat(parentFd, node->name.c_str(), AT_REMOVEDIR) != 0)
+        {
+            fail(CommandError::REMOVE_ERROR, node->name);
+            *node->failed = true;
+        }
+        if (!node->parent)
+            node->done->set_value();
+        node = node->parent;
+    }
+}
+
+CommandError sumCommand(const std::vector<std::string> &arguments)
+{
+    HashAlgorithm algorithm = HashAlgorithm::BLAKE3;
+    size_t first = 0;
+    if (arguments.size() >= 2 && arguments[0] == "-a")
+    {
+        const std::unordered_map<std::string, HashAlgorithm> algorithms = {
+            {"crc32c", HashAlgorithm::CRC32C},
+            {"xxh3", HashAlgorithm::XXH3},
+            {"blake3", HashAlgorithm::BLAKE3}};
+        auto it = algorithms.find(arguments[1]);
+        if (it == algorithms.end())
+            return CommandError::INVALID_ARGUMENT;
+        algorithm = it->second;
+        first = 2;
+    }
+    if (arguments.size() == first)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    std::vector<std::future<std::pair<CommandError, std::string>>> digests;
+    auto hashPath = [algorithm](std::string path, bool parallel) {
+        MappedFile file;
+        CommandError e = mapFile(path, file);
+        return std::make_pair(e, e == CommandError::OK ? hashData(file.view(), algorithm, parallel) : "");
+    };
+    for (size_t i = first; i < arguments.size(); ++i)
+    {
+        // Размер есть только у обычного файла: канал и /proc читаются потоком в mapFile
+        struct stat st;
+        if (stat(arguments[i].c_str(), &st) != 0)
+            return fail(CommandError::INVALID_FILE_PATH, arguments[i]);
+        if (algorithm == HashAlgorithm::BLAKE3 && S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) > BLAKE3_PARALLEL_SUBTREE)
+            digests.emplace_back();
+        else
+            digests.push_back(workerPool().submit([hashPath, path = arguments[i]] { return hashPath(path, false); }));
+    }
+    for (size_t i = first; i < arguments.size(); ++i)
+    {
+        auto &digest = digests[i - first];
+        auto [e, hex] = digest.valid() ? digest.get() : hashPath(arguments[i], true);
+        if (e != CommandError::OK)
+            return e;
+        commandOutput() << hex << "  " << arguments[i] << '\n';
+    }
+    commandOutput().flush();
+    return CommandError::OK;
+}
+
+std::string_view MappedFile::view() const
+{
+    if (data == MAP_FAILED)
+        return contents;
+    return std::string_view(static_cast<const char*>(data), size);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != MAP_FAILED)
+        munmap(data, size);
+}
+
+CommandError mapFile(const std::filesystem::path &path, MappedFile &file)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(CommandError::INVALID_FILE_PATH, path.c_str());
+    struct stat st;
+    int statError = fstat(fd, &st) != 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : 0;
+    if (statError != 0)
+    {
+        CommandError e = fail(CommandError::INVALID_FILE_PATH, path.c_str(), statError);
+        close(fd);
+        return e;
+    }
+    CommandError e = CommandError::OK;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        file.size = st.st_size;
+        file.data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file.data == MAP_FAILED)
+            e = CommandError::READ_ERROR;
+        else
+            madvise(file.data, file.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+    else
+        e = readStream(fd, [&](std::string_view chunk) {
+            file.contents.append(chunk);
+            return true;
+        });
+    close(fd);
+    return e;
+}
+
+std::string hashData(std::string_view data, HashAlgorithm algorithm, bool parallel)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data.data());
+    char hex[17];
+    switch (algorithm)
+    {
+    case HashAlgorithm::CRC32C:
+        std::snprintf(hex, sizeof(hex), "%08x", crc32c(bytes, data.size()));
+        return hex;
+    case HashAlgorithm::XXH3:
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(xxh3(bytes, data.size())));
+        return hex;
+    case HashAlgorithm::BLAKE3:
+        return blake3(bytes, data.size(), parallel);
+    }
+    return "";
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t length)
+{
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; length > 0; ++data, --length)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t length)
+{
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; length > 0; ++data, --length)
+        crc = __crc32cb(crc, *data);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const uint8_t *data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32cHardware(crc, data, length);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    return ~crc32cHardware(crc, data, length);
+#endif
+    static const auto table = [] {
+        std::array<uint32_t, 256> table;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+                value = (value >> 1) ^ (value & 1 ? 0x82F63B78 : 0);
+            table[i] = value;
+        }
+        return table;
+    }();
+    for (size_t i = 0; i < length; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+const uint64_t XXH_PRIME32_1 = 0x9E3779B1;
+const uint64_t XXH_PRIME32_2 = 0x85EBCA77;
+const uint64_t XXH_PRIME32_3 = 0xC2B2AE3D;
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4F;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5;
+const uint8_t XXH3_SECRET[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e};
+
+uint64_t readLE64(const uint8_t *data)
+{
+    uint64_t value;
+    std::memcpy(&value, data, 8);
+    return value;
+}
+
+uint32_t readLE32(const uint8_t *data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, 4);
+    return value;
+}
+
+uint64_t xxh3Fold(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+uint64_t xxh3Avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9;
+    return h ^ (h >> 32);
+}
+
+uint64_t xxh3Mix16(const uint8_t *data, const uint8_t *secret)
+{
+    return xxh3Fold(readLE64(data) ^ readLE64(secret), readLE64(data + 8) ^ readLE64(secret + 8));
+}
+
+void xxh3Accumulate512(uint64_t acc[8], const uint8_t *data, const uint8_t *secret)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        uint64_t value = readLE64(data + 8 * i);
+        uint64_t key = value ^ readLE64(secret + 8 * i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+uint64_t xxh3(const uint8_t *data, size_t length)
+{
+    const uint8_t *secret = XXH3_SECRET;
+    if (length == 0)
+    {
+        uint64_t h = readLE64(secret + 56) ^ readLE64(secret + 64);
+        h ^= h >> 33;
+        h *= XXH_PRIME64_2;
+        h ^= h >> 29;
+        h *= XXH_PRIME64_3;
+        return h ^ (h >> 32);
+    }
+    if (length <= 3)
+    {
+        uint32_t combined = (data[0] << 16) | (data[length >> 1] << 24) | data[length - 1] | (length << 8);
+        uint64_t h = combined ^ static_cast<uint64_t>(readLE32(secret) ^ readLE32(secret + 4));
+        h ^= h >> 33;
+        h *= XXH_PRIME64_2;
+        h ^= h >> 29;
+        h *= XXH_PRIME64_3;
+        return h ^ (h >> 32);
+    }
+    if (length <= 8)
+    {
+        uint64_t input = readLE32(data + length - 4) + (static_cast<uint64_t>(readLE32(data)) << 32);
+        uint64_t h = input ^ (readLE64(secret + 8) ^ readLE64(secret + 16));
+        h ^= std::rotl(h, 49) ^ std::rotl(h, 24);
+        h *= 0x9FB21C651E98DF25;
+        h ^= (h >> 35) + length;
+        h *= 0x9FB21C651E98DF25;
+        return h ^ (h >> 28);
+    }
+    if (length <= 16)
+    {
+        uint64_t low = readLE64(data) ^ (readLE64(secret + 24) ^ readLE64(secret + 32));
+        uint64_t high = readLE64(data + length - 8) ^ (readLE64(secret + 40) ^ readLE64(secret + 48));
+        return xxh3Avalanche(length + __builtin_bswap64(low) + high + xxh3Fold(low, high));
+    }
+    if (length <= 128)
+    {
+        uint64_t acc = length * XXH_PRIME64_1;
+        if (length > 32)
+        {
+            if (length > 64)
+            {
+                if (length > 96)
+                {
+                    acc += xxh3Mix16(data + 48, secret + 96);
+                    acc += xxh3Mix16(data + length - 64, secret + 112);
+                }
+                acc += xxh3Mix16(data + 32, secret + 64);
+                acc += xxh3Mix16(data + length - 48, secret + 80);
+            }
+            acc += xxh3Mix16(data + 16, secret + 32);
+            acc += xxh3Mix16(data + length - 32, secret + 48);
+        }
+        acc += xxh3Mix16(data, secret);
+        acc += xxh3Mix16(data + length - 16, secret + 16);
+        return xxh3Avalanche(acc);
+    }
+    if (length <= 240)
+    {
+        uint64_t acc = length * XXH_PRIME64_1;
+        for (size_t i = 0; i < 8; ++i)
+            acc += xxh3Mix16(data + 16 * i, secret + 16 * i);
+        acc = xxh3Avalanche(acc);
+        for (size_t i = 8; i < length / 16; ++i)
+            acc += xxh3Mix16(data + 16 * i, secret + 16 * (i - 8) + 3);
+        acc += xxh3Mix16(data + length - 16, secret + 136 - 17);
+        return xxh3Avalanche(acc);
+    }
+    uint64_t acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+    const size_t stripesPerBlock = (sizeof(XXH3_SECRET) - 64) / 8;
+    const size_t blockLength = 64 * stripesPerBlock;
+    size_t blocks = (length - 1) / blockLength;
+    for (size_t block = 0; block < blocks; ++block)
+    {
+        for (size_t stripe = 0; stripe < stripesPerBlock; ++stripe)
+            xxh3Accumulate512(acc, data + block * blockLength + stripe * 64, secret + stripe * 8);
+        for (int i = 0; i < 8; ++i)
+        {
+            acc[i] ^= acc[i] >> 47;
+            acc[i] ^= readLE64(secret + sizeof(XXH3_SECRET) - 64 + 8 * i);
+            acc[i] *= XXH_PRIME32_1;
+        }
+    }
+    size_t stripes = ((length - 1) - blockLength * blocks) / 64;
+    for (size_t stripe = 0; stripe < stripes; ++stripe)
+        xxh3Accumulate512(acc, data + blocks * blockLength + stripe * 64, secret + stripe * 8);
+    xxh3Accumulate512(acc, data + length - 64, secret + sizeof(XXH3_SECRET) - 64 - 7);
+    uint64_t result = length * XXH_PRIME64_1;
+    for (int i = 0; i < 4; ++i)
+        result += xxh3Fold(acc[2 * i] ^ readLE64(secret + 11 + 16 * i), acc[2 * i + 1] ^ readLE64(secret + 11 + 16 * i + 8));
+    return xxh3Avalanche(result);
+}
+
+const uint32_t BLAKE3_IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+const uint32_t BLAKE3_CHUNK_START = 1;
+const uint32_t BLAKE3_CHUNK_END = 2;
+const uint32_t BLAKE3_PARENT = 4;
+const uint32_t BLAKE3_ROOT = 8;
+
+void blake3Compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t out[16])
+{
+    static const uint8_t permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+    uint32_t state[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        BLAKE3_IV[0], BLAKE3_IV[1], BLAKE3_IV[2], BLAKE3_IV[3],
+        static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLength, flags};
+    uint32_t m[16];
+    std::memcpy(m, block, sizeof(m));
+    auto g = [&state](int a, int b, int c, int d, uint32_t x, uint32_t y) {
+        state[a] += state[b] + x;
+        state[d] = std::rotr(state[d] ^ state[a], 16);
+        state[c] += state[d];
+        state[b] = std::rotr(state[b] ^ state[c], 12);
+        state[a] += state[b] + y;
+        state[d] = std::rotr(state[d] ^ state[a], 8);
+        state[c] += state[d];
+        state[b] = std::rotr(state[b] ^ state[c], 7);
+    };
+    for (int round = 0; round < 7; ++round)
+    {
+        g(0, 4, 8, 12, m[0], m[1]);
+        g(1, 5, 9, 13, m[2], m[3]);
+        g(2, 6, 10, 14, m[4], m[5]);
+        g(3, 7, 11, 15, m[6], m[7]);
+        g(0, 5, 10, 15, m[8], m[9]);
+        g(1, 6, 11, 12, m[10], m[11]);
+        g(2, 7, 8, 13, m[12], m[13]);
+        g(3, 4, 9, 14, m[14], m[15]);
+        uint32_t permuted[16];
+        for (int i = 0; i < 16; ++i)
+            permuted[i] = m[permutation[i]];
+        std::memcpy(m, permuted, sizeof(m));
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+void blake3ChainingValue(const Blake3Output &output, uint32_t cv[8])
+{
+    uint32_t out[16];
+    blake3Compress(output.cv, output.block, output.counter, output.blockLength, output.flags, out);
+    std::memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+Blake3Output blake3ChunkOutput(const uint8_t *data, size_t length, uint64_t counter)
+{
+    Blake3Output output;
+    std::memcpy(output.cv, BLAKE3_IV, sizeof(output.cv));
+    output.counter = counter;
+    size_t blocks = length == 0 ? 1 : (length + 63) / 64;
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        size_t blockLength = std::min<size_t>(64, length - i * 64);
+        uint8_t bytes[64] = {};
+        std::memcpy(bytes, data + i * 64, blockLength);
+        for (int word = 0; word < 16; ++word)
+            output.block[word] = readLE32(bytes + 4 * word);
+        output.blockLength = blockLength;
+        output.flags = (i == 0 ? BLAKE3_CHUNK_START : 0) | (i == blocks - 1 ? BLAKE3_CHUNK_END : 0);
+        if (i != blocks - 1)
+            blake3ChainingValue(output, output.cv);
+    }
+    return output;
+}
+
+Blake3Output blake3ParentOutput(const uint32_t left[8], const uint32_t right[8])
+{
+    Blake3Output output;
+    std::memcpy(output.cv, BLAKE3_IV, sizeof(output.cv));
+    std::memcpy(output.block, left, 8 * sizeof(uint32_t));
+    std::memcpy(output.block + 8, right, 8 * sizeof(uint32_t));
+    output.counter = 0;
+    output.blockLength = 64;
+    output.flags = BLAKE3_PARENT;
+    return output;
+}
+
+Blake3Output blake3Subtree(const uint8_t *data, size_t length, uint64_t counter)
+{
+    if (length <= BLAKE3_CHUNK_LEN)
+        return blake3ChunkOutput(data, length, counter);
+    size_t leftLength = BLAKE3_CHUNK_LEN << (63 - __builtin_clzll((length - 1) / BLAKE3_CHUNK_LEN));
+    uint32_t left[8], right[8];
+    blake3ChainingValue(blake3Subtree(data, leftLength, counter), left);
+    blake3ChainingValue(blake3Subtree(data + leftLength, length - leftLength, counter + leftLength / BLAKE3_CHUNK_LEN), right);
+    return blake3ParentOutput(left, right);
+}
+
+Blake3Output blake3MergeSubtrees(const std::vector<std::array<uint32_t, 8>> &cvs, size_t begin, size_t end)
+{
+    size_t leftCount = size_t(1) << (63 - __builtin_clzll(end - begin - 1));
+    uint32_t left[8], right[8];
+    if (leftCount == 1)
+        std::memcpy(left, cvs[begin].data(), sizeof(left));
+    else
+        blake3ChainingValue(blake3MergeSubtrees(cvs, begin, begin + leftCount), left);
+    if (end - begin - leftCount == 1)
+        std::memcpy(right, cvs[begin + leftCount].data(), sizeof(right));
+    else
+        blake3ChainingValue(blake3MergeSubtrees(cvs, begin + leftCount, end), right);
+    return blake3ParentOutput(left, right);
+}
+
+std::string blake3(const uint8_t *data, size_t length, bool parallel)
+{
+    Blake3Output root;
+    if (!parallel || length <= BLAKE3_PARALLEL_SUBTREE)
+        root = blake3Subtree(data, length, 0);
+    else
+    {
+        size_t subtrees = (length + BLAKE3_PARALLEL_SUBTREE - 1) / BLAKE3_PARALLEL_SUBTREE;
+        std::vector<std::array<uint32_t, 8>> cvs(subtrees);
+        std::vector<std::future<void>> pending;
+        for (size_t i = 0; i < subtrees; ++i)
+            pending.push_back(workerPool().submit([&, i] {
+                size_t offset = i * BLAKE3_PARALLEL_SUBTREE;
+                size_t subtreeLength = std::min(BLAKE3_PARALLEL_SUBTREE, length - offset);
+                blake3ChainingValue(blake3Subtree(data + offset, subtreeLength, offset / BLAKE3_CHUNK_LEN), cvs[i].data());
+            }));
+        for (auto &future : pending)
+            future.get();
+        root = blake3MergeSubtrees(cvs, 0, subtrees);
+    }
+    root.flags |= BLAKE3_ROOT;
+    uint32_t out[16];
+    blake3Compress(root.cv, root.block, root.counter, root.blockLength, root.flags, out);
+    char hex[65];
+    for (int i = 0; i < 32; ++i)
+        std::snprintf(hex + 2 * i, 3, "%02x", (out[i / 4] >> (8 * (i % 4))) & 0xFF);
+    return hex;
+}
+
+CommandError sortCommand(const std::vector<std::string> &arguments)
+{
+    size_t budget = SORT_DEFAULT_BUDGET_MB << 20;
+    size_t first = 0;
+    if (arguments.size() >= 2 && arguments[0] == "-S")
+    {
+        if (arguments[1].empty() || !std::all_of(arguments[1].begin(), arguments[1].end(), ::isdigit))
+            return CommandError::INVALID_ARGUMENT;
+        budget = std::max<size_t>(1, std::stoull(arguments[1])) << 20;
+        first = 2;
+    }
+    if (arguments.size() == first)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    LineArena arena;
+    std::vector<std::string_view> lines;
+    std::vector<std::unique_ptr<SortRun>> runs;
+    CommandError e = CommandError::OK;
+    for (size_t i = first; i < arguments.size() && e == CommandError::OK; ++i)
+        e = forEachLine(arguments[i], [&](std::string_view line) {
+            lines.push_back(arena.store(line));
+            // Поразрядной сортировке нужны ещё два массива ключей на время сортировки
+            if (arena.bytes + lines.size() * (sizeof(std::string_view) + 2 * sizeof(RadixLine)) < budget)
+                return true;
+            sortLines(lines);
+            e = spillRun(lines, runs);
+            if (e == CommandError::OK)
+                e = compactRuns(runs);
+            lines.clear();
+            arena.clear();
+            return e == CommandError::OK;
+        });
+    // Последнее слияние читает не больше SORT_MERGE_FAN_IN источников вместе с остатком в памяти
+    while (e == CommandError::OK && runs.size() >= SORT_MERGE_FAN_IN)
+        e = mergeRuns(runs, runs.size() - SORT_MERGE_FAN_IN);
+    if (e != CommandError::OK)
+        return e;
+    sortLines(lines);
+    if (runs.empty())
+    {
+        for (auto line : lines)
+            commandOutput().write(line.data(), line.size()) << '\n';
+        commandOutput().flush();
+        return CommandError::OK;
+    }
+    using Head = std::pair<std::string_view, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (size_t i = 0; i < runs.size(); ++i)
+        if (runs[i]->next())
+            heads.emplace(runs[i]->line, i);
+    size_t memoryPosition = 0;
+    if (!lines.empty())
+        heads.emplace(lines[memoryPosition++], runs.size());
+    while (!heads.empty())
+    {
+        auto [line, source] = heads.top();
+        heads.pop();
+        commandOutput().write(line.data(), line.size()) << '\n';
+        if (source == runs.size())
+        {
+            if (memoryPosition < lines.size())
+                heads.emplace(lines[memoryPosition++], source);
+        }
+        else if (runs[source]->next())
+            heads.emplace(runs[source]->line, source);
+    }
+    commandOutput().flush();
+    return CommandError::OK;
+}
+
+void sortLines(std::vector<std::string_view> &lines)
+{
+    size_t parts = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), lines.size() / SORT_PARALLEL_MIN_LINES);
+    if (parts <= 1)
+    {
+        radixSortLines(lines.data(), lines.size(), 0);
+        return;
+    }
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= parts; ++i)
+        bounds.push_back(lines.size() * i / parts);
+    std::vector<std::future<void>> pending;
+    for (size_t i = 0; i < parts; ++i)
+        pending.push_back(workerPool().submit([&, i] {
+            radixSortLines(lines.data() + bounds[i], bounds[i + 1] - bounds[i], 0);
+        }));
+    for (auto &future : pending)
+        future.get();
+    while (bounds.size() > 2)
+    {
+        pending.clear();
+        std::vector<size_t> merged;
+        for (size_t i = 0; i + 2 < bounds.size(); i += 2)
+        {
+            pending.push_back(workerPool().submit([&, i] {
+                std::inplace_merge(lines.begin() + bounds[i], lines.begin() + bounds[i + 1], lines.begin() + bounds[i + 2]);
+            }));
+            merged.push_back(bounds[i]);
+        }
+        if (bounds.size() % 2 == 0)
+            merged.push_back(bounds[bounds.size() - 2]);
+        merged.push_back(bounds.back());
+        for (auto &future : pending)
+            future.get();
+        bounds = std::move(merged);
+    }
+}
+
+// Поразрядная сортировка по восьми байтам строки с позиции offset, дополненным нулями: порядок
+// ключей совпадает с лексикографическим, потому что ноль не больше любого байта. Группы с равным
+// ключом доупорядочиваются по следующим восьми байтам, а мелкие, короткие и слишком глубокие
+// группы сортируются сравнением. На 2 млн строк std::sort тратит 0.9-1.6 с, эта сортировка
+// 0.2-0.7 с; хуже всего ей на длинных общих префиксах вроде путей
+void radixSortLines(std::string_view *lines, size_t count, size_t offset)
+{
+    if (count < SORT_RADIX_MIN_LINES || offset >= SORT_RADIX_MAX_OFFSET)
+    {
+        std::sort(lines, lines + count);
+        return;
+    }
+    std::vector<RadixLine> items(count);
+    std::vector<RadixLine> scratch(count);
+    std::array<std::array<size_t, 256>, 8> counts{};
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t bytes[8] = {};
+        if (lines[i].size() > offset)
+            std::memcpy(bytes, lines[i].data() + offset, std::min<size_t>(8, lines[i].size() - offset));
+        uint64_t key;
+        std::memcpy(&key, bytes, sizeof(key));
+        items[i] = {__builtin_bswap64(key), lines[i]};
+        for (size_t digit = 0; digit < 8; ++digit)
+            ++counts[digit][(items[i].key >> (8 * digit)) & 0xFF];
+    }
+    for (size_t digit = 0; digit < 8; ++digit)
+    {
+        auto &buckets = counts[digit];
+        // Разряд, одинаковый у всех ключей, порядка не меняет
+        if (buckets[(items[0].key >> (8 * digit)) & 0xFF] == count)
+            continue;
+        size_t position = 0;
+        for (auto &bucket : buckets)
+            position += std::exchange(bucket, position);
+        for (const auto &item : items)
+            scratch[buckets[(item.key >> (8 * digit)) & 0xFF]++] = item;
+        items.swap(scratch);
+    }
+    scratch = {};
+    for (size_t i = 0; i < count; ++i)
+        lines[i] = items[i].line;
+    for (size_t i = 0, j; i < count; i = j)
+    {
+        bool longer = lines[i].size() > offset + 8;
+        for (j = i + 1; j < count && items[j].key == items[i].key; ++j)
+            longer |= lines[j].size() > offset + 8;
+        if (j - i > 1 && longer)
+            radixSortLines(lines + i, j - i, offset + 8);
+        else if (j - i > 1)
+            std::sort(lines + i, lines + j);
+    }
+}
+
+int createSpillFile(std::string &path)
+{
+    path = (std::filesystem::temp_directory_path() / "term-sort-XXXXXX").string();
+    int fd = mkstemp(path.data());
+    if (fd >= 0)
+        unlink(path.c_str());
+    return fd;
+}
+
+CommandError spillRun(const std::vector<std::string_view> &lines, std::vector<std::unique_ptr<SortRun>> &runs)
+{
+    std::string path;
+    auto run = std::make_unique<SortRun>();
+    run->fd = createSpillFile(path);
+    if (run->fd < 0)
+        return fail(CommandError::WRITE_ERROR, path);
+    std::string buffer;
+    buffer.reserve(IO_CHUNK_SIZE * 2);
+    for (auto line : lines)
+    {
+        buffer.append(line);
+        buffer.push_back('\n');
+        if (buffer.size() >= IO_CHUNK_SIZE)
+        {
+            if (!writeAll(run->fd, buffer.data(), buffer.size()))
+                return fail(CommandError::WRITE_ERROR, path);
+            buffer.clear();
+        }
+    }
+    if (!writeAll(run->fd, buffer.data(), buffer.size()) || lseek(run->fd, 0, SEEK_SET) != 0)
+        return fail(CommandError::WRITE_ERROR, path);
+    posix_fadvise(run->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    runs.push_back(std::move(run));
+    return CommandError::OK;
+}
+
+// Прогоны сливаются по уровням: SORT_MERGE_FAN_IN прогонов одного уровня становятся одним
+// прогоном следующего, так что открытых файлов не больше fan-in на уровень, а данные
+// переписываются лишь логарифмическое число раз
+CommandError compactRuns(std::vector<std::unique_ptr<SortRun>> &runs)
+{
+    while (true)
+    {
+        size_t count = 0;
+        while (count < runs.size() && runs[runs.size() - 1 - count]->level == runs.back()->level)
+            ++count;
+        if (count < SORT_MERGE_FAN_IN)
+            return CommandError::OK;
+        CommandError e = mergeRuns(runs, runs.size() - count);
+        if (e != CommandError::OK)
+            return e;
+    }
+}
+
+// Сливает прогоны с индекса first до конца в один новый прогон
+CommandError mergeRuns(std::vector<std::unique_ptr<SortRun>> &runs, size_t first)
+{
+    std::string path;
+    auto merged = std::make_unique<SortRun>();
+    merged->fd = createSpillFile(path);
+    if (merged->fd < 0)
+        return fail(CommandError::WRITE_ERROR, path);
+    using Head = std::pair<std::string_view, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (size_t i = first; i < runs.size(); ++i)
+    {
+        merged->level = std::max(merged->level, runs[i]->level + 1);
+        if (runs[i]->next())
+            heads.emplace(runs[i]->line, i);
+    }
+    std::string buffer;
+    buffer.reserve(IO_CHUNK_SIZE * 2);
+    while (!heads.empty())
+    {
+        auto [line, source] = heads.top();
+        heads.pop();
+        buffer.append(line);
+        buffer.push_back('\n');
+        if (buffer.size() >= IO_CHUNK_SIZE)
+        {
+            if (!writeAll(merged->fd, buffer.data(), buffer.size()))
+                return fail(CommandError::WRITE_ERROR, path);
+            buffer.clear();
+        }
+        if (runs[source]->next())
+            heads.emplace(runs[source]->line, source);
+    }
+    if (!writeAll(merged->fd, buffer.data(), buffer.size()) || lseek(merged->fd, 0, SEEK_SET) != 0)
+        return fail(CommandError::WRITE_ERROR, path);
+    posix_fadvise(merged->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    runs.resize(first);
+    runs.push_back(std::move(merged));
+    return CommandError::OK;
+}
+
+std::string_view LineArena::store(std::string_view line)
+{
+    bytes += line.size();
+    if (line.size() > ARENA_BLOCK_SIZE / 4)
+    {
+        auto block = std::make_unique_for_overwrite<char[]>(line.size());
+        std::memcpy(block.get(), line.data(), line.size());
+        std::string_view stored(block.get(), line.size());
+        blocks.insert(blocks.end() - !blocks.empty(), std::move(block));
+        return stored;
+    }
+    if (blockUsed == ARENA_BLOCK_SIZE || ARENA_BLOCK_SIZE - blockUsed < line.size())
+    {
+        blocks.push_back(std::make_unique_for_overwrite<char[]>(ARENA_BLOCK_SIZE));
+        blockUsed = 0;
+    }
+    char *destination = blocks.back().get() + blockUsed;
+    std::memcpy(destination, line.data(), line.size());
+    blockUsed += line.size();
+    return std::string_view(destination, line.size());
+}
+
+void LineArena::clear()
+{
+    blocks.clear();
+    blockUsed = ARENA_BLOCK_SIZE;
+    bytes = 0;
+}
+
+bool SortRun::next()
+{
+    line.clear();
+    while (true)
+    {
+        const char *start = buffer.data() + begin;
+        const char *newline = static_cast<const char*>(std::memchr(start, '\n', end - begin));
+        if (newline)
+        {
+            line.append(start, newline);
+            begin = newline - buffer.data() + 1;
+            return true;
+        }
+        line.append(start, end - begin);
+        begin = end = 0;
+        ssize_t n;
+        do
+            n = read(fd, buffer.data(), buffer.size());
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return !line.empty();
+        end = n;
+    }
+}
+
+SortRun::~SortRun()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+CommandError countCommand(const std::vector<std::string> &arguments)
+{
+    size_t limit = SIZE_MAX;
+    size_t first = 0;
+    if (arguments.size() >= 2 && arguments[0] == "-k")
+    {
+        if (arguments[1].empty() || !std::all_of(arguments[1].begin(), arguments[1].end(), ::isdigit))
+            return CommandError::INVALID_ARGUMENT;
+        limit = std::stoull(arguments[1]);
+        first = 2;
+    }
+    if (arguments.size() == first)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    std::vector<MappedFile> files(arguments.size() - first);
+    std::deque<CountMap> maps;
+    std::vector<std::future<void>> pending;
+    size_t waited = 0;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    // Распакованный поток считается блоками по целым строкам; блоков в работе не больше
+    // двух на поток, чтобы быстрая распаковка не держала в памяти весь файл
+    auto submitBlock = [&](std::string block) {
+        if (pending.size() - waited >= threads * 2)
+            pending[waited++].get();
+        CountMap &map = maps.emplace_back();
+        pending.push_back(workerPool().submit([&map, block = std::move(block)] { countLines(block, map); }));
+    };
+    auto finish = [&](CommandError e) {
+        for (auto &future : pending)
+            future.wait();
+        return e;
+    };
+    for (size_t i = first; i < arguments.size(); ++i)
+    {
+        if (detectCompression(arguments[i]) != Compression::NONE)
+        {
+            std::string block;
+            CommandError e = readDecodedFile(arguments[i], [&](std::string_view chunk) {
+                block.append(chunk);
+                size_t cut = block.size() >= COUNT_PARALLEL_MIN_BYTES ? block.rfind('\n') : std::string::npos;
+                if (cut != std::string::npos)
+                {
+                    submitBlock(block.substr(0, cut + 1));
+                    block.erase(0, cut + 1);
+                }
+                return true;
+            });
+            if (e != CommandError::OK)
+                return finish(e);
+            if (!block.empty())
+                submitBlock(std::move(block));
+            continue;
+        }
+        MappedFile &file = files[i - first];
+        CommandError e = mapFile(arguments[i], file);
+        if (e != CommandError::OK)
+            return finish(e);
+        std::string_view data = file.view();
+        size_t parts = std::clamp<size_t>(data.size() / COUNT_PARALLEL_MIN_BYTES, 1, threads);
+        size_t begin = 0;
+        for (size_t part = 1; part <= parts; ++part)
+        {
+            size_t end = data.size() * part / parts;
+            while (end < data.size() && end > 0 && data[end - 1] != '\n')
+                ++end;
+            if (end <= begin)
+                continue;
+            CountMap &map = maps.emplace_back();
+            pending.push_back(workerPool().submit([&map, range = data.substr(begin, end - begin)] { countLines(range, map); }));
+            begin = end;
+        }
+    }
+    for (size_t i = waited; i < pending.size(); ++i)
+        pending[i].get();
+    if (maps.empty())
+        return CommandError::OK;
+    CountMap &total = maps.front();
+    for (size_t i = 1; i < maps.size(); ++i)
+        for (const auto &slot : maps[i].slots)
+            if (slot.count)
+                total.add(slot.key, slot.hash, slot.count, false);
+    // Записи копируются подряд: сортировка указателей на слоты промахивается мимо кэша на каждом
+    // сравнении. partial_sort строит кучу и годится только для малого -k; иначе записи сначала
+    // упорядочиваются по частоте, а ключи одной частоты — поразрядной сортировкой строк
+    std::vector<CountMap::Slot> entries;
+    entries.reserve(total.size);
+    for (const auto &slot : total.slots)
+        if (slot.count)
+            entries.push_back(slot);
+    limit = std::min(limit, entries.size());
+    if (limit < entries.size() / 2)
+        std::partial_sort(entries.begin(), entries.begin() + limit, entries.end(), [](const auto &a, const auto &b) {
+            return a.count != b.count ? a.count > b.count : a.key < b.key;
+        });
+    else
+    {
+        std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.count > b.count; });
+        std::vector<std::string_view> keys;
+        for (size_t i = 0, j; i < limit; i = j)
+        {
+            keys.clear();
+            for (j = i; j < entries.size() && entries[j].count == entries[i].count; ++j)
+                keys.push_back(entries[j].key);
+            radixSortLines(keys.data(), keys.size(), 0);
+            for (size_t k = 0; k < keys.size(); ++k)
+                entries[i + k].key = keys[k];
+        }
+    }
+    std::string output;
+    for (size_t i = 0; i < limit; ++i)
+    {
+        output.append(std::to_string(entries[i].count)).push_back('\t');
+        output.append(entries[i].key).push_back('\n');
+        if (output.size() >= IO_CHUNK_SIZE)
+        {
+            commandOutput().write(output.data(), output.size());
+            output.clear();
+        }
+    }
+    commandOutput().write(output.data(), output.size());
+    commandOutput().flush();
+    return CommandError::OK;
+}
+
+void countLines(std::string_view data, CountMap &map)
+{
+    while (!data.empty())
+    {
+        size_t newline = data.find('\n');
+        std::string_view line = data.substr(0, newline);
+        map.add(line, xxh3(reinterpret_cast<const uint8_t*>(line.data()), line.size()), 1);
+        data.remove_prefix(newline == std::string_view::npos ? data.size() : newline + 1);
+    }
+}
+
+void CountMap::add(std::string_view key, uint64_t hash, size_t count, bool copyKey)
+{
+    size_t mask = slots.size() - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask)
+    {
+        Slot &slot = slots[index];
+        if (slot.count == 0)
+        {
+            slot = {hash, copyKey ? arena.store(key) : key, count};
+            if (++size * 2 > slots.size())
+                grow();
+            return;
+        }
+        if (slot.hash == hash && slot.key == key)
+        {
+            slot.count += count;
+            return;
+        }
+    }
+}
+
+void CountMap::grow()
+{
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (const auto &slot : old)
+    {
+        if (slot.count == 0)
+            continue;
+        size_t index = slot.hash & mask;
+        while (slots[index].count)
+            index = (index + 1) & mask;
+        slots[index] = slot;
+    }
+}
+
+CommandError hexdumpCommand(const std::vector<std::string> &arguments)
+{
+    size_t offset = 0;
+    size_t length = SIZE_MAX;
+    size_t i = 0;
+    for (; i + 1 < arguments.size(); i += 2)
+    {
+        size_t *target = arguments[i] == "-s" ? &offset : arguments[i] == "-n" ? &length : nullptr;
+        if (!target)
+            break;
+        if (!parseSize(arguments[i + 1], *target))
+            return CommandError::INVALID_ARGUMENT;
+    }
+    if (i + 1 != arguments.size())
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    int fd = open(arguments[i].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(CommandError::INVALID_FILE_PATH, arguments[i]);
+    struct stat st;
+    int statError = fstat(fd, &st) != 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : 0;
+    if (statError != 0)
+    {
+        CommandError e = fail(CommandError::INVALID_FILE_PATH, arguments[i], statError);
+        close(fd);
+        return e;
+    }
+    std::vector<uint8_t> buffer(IO_CHUNK_SIZE);
+    std::vector<char> hex(2 * IO_CHUNK_SIZE);
+    std::string output;
+    output.reserve(IO_CHUNK_SIZE / 16 * 80);
+    CommandError e = CommandError::OK;
+    while (length > 0)
+    {
+        ssize_t n = preadFull(fd, reinterpret_cast<char*>(buffer.data()), std::min(length, buffer.size()), offset);
+        if (n < 0)
+            e = CommandError::READ_ERROR;
+        if (n <= 0)
+            break;
+        bytesToHex(buffer.data(), n, hex.data());
+        for (ssize_t line = 0; line < n; line += 16)
+            formatHexLine(offset + line, buffer.data() + line, std::min<size_t>(16, n - line), hex.data() + 2 * line, output);
+        commandOutput().write(output.data(), output.size());
+        output.clear();
+        offset += n;
+        length -= n;
+        if (static_cast<size_t>(n) < buffer.size())
+            break;
+    }
+    close(fd);
+    commandOutput().flush();
+    return e;
+}
+
+// Десятичное число или шестнадцатеричное с явным 0x: ведущий ноль не делает число восьмеричным
+bool parseSize(const std::string &text, size_t &value)
+{
+    bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+    const char *digits = text.c_str() + (hex ? 2 : 0);
+    if (hex ? !std::isxdigit(static_cast<unsigned char>(*digits)) : !std::isdigit(static_cast<unsigned char>(*digits)))
+        return false;
+    char *end;
+    errno = 0;
+    value = std::strtoull(digits, &end, hex ? 16 : 10);
+    return errno == 0 && *end == '\0';
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) void bytesToHexSsse3(const uint8_t *data, size_t length, char *hex)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i lowMask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), lowMask));
+        __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, lowMask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hex + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hex + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+    for (; i < length; ++i)
+    {
+        hex[2 * i] = "0123456789abcdef"[data[i] >> 4];
+        hex[2 * i + 1] = "0123456789abcdef"[data[i] & 0x0F];
+    }
+}
+#endif
+
+void bytesToHex(const uint8_t *data, size_t length, char *hex)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        bytesToHexSsse3(data, length, hex);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < length; ++i)
+    {
+        hex[2 * i] = "0123456789abcdef"[data[i] >> 4];
+        hex[2 * i + 1] = "0123456789abcdef"[data[i] & 0x0F];
+    }
+}
+
+void formatHexLine(size_t offset, const uint8_t *data, size_t length, const char *hex, std::string &output)
+{
+    length = std::min<size_t>(length, 16);
+    char line[80];
+    int position = std::snprintf(line, sizeof(line), "%08zx  ", offset);
+    for (size_t i = 0; i < 16; ++i)
+    {
+        if (i < length)
+        {
+            line[position++] = hex[2 * i];
+            line[position++] = hex[2 * i + 1];
+        }
+        else
+        {
+            line[position++] = ' ';
+            line[position++] = ' ';
+        }
+        line[position++] = ' ';
+        if (i == 7)
+            line[position++] = ' ';
+    }
+    line[position++] = ' ';
+    line[position++] = '|';
+    for (size_t i = 0; i < length; ++i)
+        line[position++] = data[i] >= 0x20 && data[i] < 0x7F ? data[i] : '.';
+    line[position++] = '|';
+    line[position++] = '\n';
+    output.append(line, position);
+}
+
+// Запись журнала: магическая строка и записи вида varint длина, varint число токенов,
+// токены с varint длинами, время в микросекундах, статус и перехваченный вывод.
+// Длина перед записью позволяет пропускать записи без разбора при повторе с середины
+CommandError recordCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.size() > 1)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    if (recordFd >= 0)
+    {
+        close(recordFd);
+        recordFd = -1;
+    }
+    if (arguments.empty())
+        return CommandError::OK;
+    recordFd = open(arguments[0].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (recordFd < 0)
+        return fail(CommandError::INVALID_FILE_PATH, arguments[0]);
+    if (write(recordFd, RECORD_MAGIC.data(), RECORD_MAGIC.size()) != static_cast<ssize_t>(RECORD_MAGIC.size()))
+    {
+        CommandError e = fail(CommandError::WRITE_ERROR, arguments[0]);
+        close(recordFd);
+        recordFd = -1;
+        return e;
+    }
+    return CommandError::OK;
+}
+
+// Вывод встроенных команд и внешних программ переднего плана идёт в один канал, поэтому
+// копия сохраняет их порядок. Поток чтения не трогает потоков std::ostream главного потока:
+// на экран он пишет прямо в дескриптор под замком отчётов, а в перехват копию переносит
+// главный поток после join. Фоновые задания пишут мимо канала, и их вывод в запись не попадает:
+// они переживают строку, к которой относится запись
+CommandError runTimed(const std::vector<std::string> &tokens, std::string &copy, uint64_t &micros)
+{
+    int fds[2];
+    int stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd < 0 || pipe2(fds, O_CLOEXEC) != 0)
+    {
+        if (stopFd >= 0)
+            close(stopFd);
+        auto start = std::chrono::steady_clock::now();
+        CommandError e = runInput(tokens);
+        micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        return e;
+    }
+    std::ostream *previous = currentOutput;
+    bool live = previous == &std::cout;
+    std::cout.flush();
+    // Канал может держать открытым и потомок, ушедший в фон, поэтому конец строки отмечает stopFd:
+    // поток дочитывает то, что уже лежит в канале, и завершается, не дожидаясь EOF
+    std::thread reader([&copy, live, fd = fds[0], stopFd]
+    {
+        std::array<char, 4096> buffer;
+        auto forward = [&](size_t limit)
+        {
+            ssize_t n;
+            while ((n = read(fd, buffer.data(), std::min(limit, buffer.size()))) < 0 && errno == EINTR)
+                ;
+            if (n <= 0)
+                return static_cast<size_t>(0);
+            copy.append(buffer.data(), n);
+            if (live)
+                writeReport({buffer.data(), static_cast<size_t>(n)});
+            return static_cast<size_t>(n);
+        };
+        std::array<pollfd, 2> sources = {{{fd, POLLIN, 0}, {stopFd, POLLIN, 0}}};
+        while (true)
+        {
+            if (poll(sources.data(), sources.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            // Ушедший в фон потомок может писать и дальше, поэтому дочитывается только накопленное
+            if (sources[1].revents & POLLIN)
+            {
+                int pending = 0;
+                ioctl(fd, FIONREAD, &pending);
+                for (size_t n; pending > 0 && (n = forward(pending)) > 0;)
+                    pending -= static_cast<int>(n);
+                break;
+            }
+            if ((sources[0].revents & (POLLIN | POLLHUP | POLLERR)) && forward(buffer.size()) == 0)
+                break;
+        }
+        close(fd);
+    });
+    auto start = std::chrono::steady_clock::now();
+    CommandError e;
+    {
+        FdBuffer sink(fds[1]);
+        std::ostream stream(&sink);
+        currentOutput = &stream;
+        recordOutputFd = fds[1];
+        e = runInput(tokens);
+        stream.flush();
+        recordOutputFd = -1;
+        currentOutput = previous;
+    }
+    close(fds[1]);
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t stopped = write(stopFd, &one, sizeof(one));
+    reader.join();
+    close(stopFd);
+    micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    if (!live)
+        previous->write(copy.data(), copy.size()).flush();
+    return e;
+}
+
+void recordInput(const std::vector<std::string> &tokens)
+{
+    std::string copy;
+    uint64_t micros;
+    CommandError e = runTimed(tokens, copy, micros);
+    reportError(e);
+    int status = lastStatus;
+    std::string payload;
+    appendVarint(payload, tokens.size());
+    for (const auto &token : tokens)
+    {
+        appendVarint(payload, token.size());
+        payload.append(token);
+    }
+    appendVarint(payload, micros);
+    appendVarint(payload, static_cast<uint64_t>(status));
+    appendVarint(payload, copy.size());
+    payload.append(copy);
+    std::string entry;
+    appendVarint(entry, payload.size());
+    entry.append(payload);
+    if (write(recordFd, entry.data(), entry.size()) != static_cast<ssize_t>(entry.size()))
+        reportError(CommandError::WRITE_ERROR);
+}
+
+void appendVarint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool readVarint(std::string_view &data, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && !data.empty(); shift += 7)
+    {
+        uint8_t byte = data.front();
+        data.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool readRecordEntry(std::string_view &data, RecordEntry &entry)
+{
+    uint64_t count, length;
+    if (!readVarint(data, count) || count > data.size())
+        return false;
+    entry.tokens.clear();
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        if (!readVarint(data, length) || length > data.size())
+            return false;
+        entry.tokens.emplace_back(data.substr(0, length));
+        data.remove_prefix(length);
+    }
+    if (!readVarint(data, entry.micros) || !readVarint(data, entry.status) || !readVarint(data, length) || length > data.size())
+        return false;
+    entry.output = data.substr(0, length);
+    data.remove_prefix(length);
+    return !entry.tokens.empty();
+}
+
+CommandError replayCommand(const std::vector<std::string> &arguments)
+{
+    if (arguments.empty() || arguments.size() > 3)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    uint64_t first = 0, count = UINT64_MAX;
+    try
+    {
+        if (arguments.size() > 1)
+            first = std::stoull(arguments[1]);
+        if (arguments.size() > 2)
+            count = std::stoull(arguments[2]);
+    }
+    catch (const std::exception &)
+    {
+        return CommandError::INVALID_ARGUMENT;
+    }
+    MappedFile file;
+    CommandError e = mapFile(arguments[0], file);
+    if (e != CommandError::OK)
+        return e;
+    std::string_view data = file.view();
+    if (data.substr(0, RECORD_MAGIC.size()) != RECORD_MAGIC)
+        return CommandError::READ_ERROR;
+    data.remove_prefix(RECORD_MAGIC.size());
+    uint64_t length;
+    for (uint64_t skipped = 0; skipped < first && !data.empty(); ++skipped)
+    {
+        if (!readVarint(data, length) || length > data.size())
+            return CommandError::READ_ERROR;
+        data.remove_prefix(length);
+    }
+    uint64_t replayed = 0, recordedMicros = 0, replayedMicros = 0, statusDiffs = 0, outputDiffs = 0;
+    RecordEntry entry;
+    for (; replayed < count && !data.empty(); ++replayed)
+    {
+        std::string_view payload;
+        if (!readVarint(data, length) || length > data.size())
+            return CommandError::READ_ERROR;
+        payload = data.substr(0, length);
+        data.remove_prefix(length);
+        if (!readRecordEntry(payload, entry))
+            return CommandError::READ_ERROR;
+        std::string copy;
+        uint64_t micros;
+        CommandError e = runTimed(entry.tokens, copy, micros);
+        reportError(e);
+        recordedMicros += entry.micros;
+        replayedMicros += micros;
+        statusDiffs += static_cast<uint64_t>(lastStatus) != entry.status;
+        outputDiffs += copy != entry.output;
+    }
+    commandOutput() << "REPLAY:\t" << replayed << " commands\t" << recordedMicros / 1000.0 << " ms recorded\t"
+        << replayedMicros / 1000.0 << " ms replayed\t" << statusDiffs << " status diffs\t" << outputDiffs << " output diffs" << std::endl;
+    return CommandError::OK;
+}
+
+// История — текстовый файл строк и индекс записей фиксированного размера рядом с ним, поэтому
+// при старте ничего не разбирается: обращение к записи i — одно смещение в отображённом индексе
+void openHistory()
+{
+    const char *path = getenv("TERM_HISTORY");
+    const char *home = getenv("HOME");
+    if (!path && (!isatty(STDIN_FILENO) || !home))
+        return;
+    historyPath = path ? path : std::string(home) + "/.term_history";
+    historyFd = open(historyPath.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    historyIndexFd = open((historyPath + ".idx").c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (historyFd >= 0 && historyIndexFd >= 0)
+        return;
+    if (historyFd >= 0)
+        close(historyFd);
+    if (historyIndexFd >= 0)
+        close(historyIndexFd);
+    historyFd = historyIndexFd = -1;
+}
+
+// Терминалы дописывают историю под flock на файле строк, так что строка, её запись
+// в индексе и счётчик частоты меняются вместе и не перемешиваются с чужими
+void appendHistory(std::string_view line)
+{
+    if (historyFd < 0 || line.find('\n') != std::string_view::npos)
+        return;
+    while (flock(historyFd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+    struct stat st;
+    uint64_t entry;
+    if (fstat(historyFd, &st) == 0 && syncHistoryIndex(st.st_size, entry))
+    {
+        std::string text(line);
+        text.push_back('\n');
+        auto now = static_cast<uint32_t>(time(nullptr));
+        HistoryRecord record{static_cast<uint64_t>(st.st_size), static_cast<uint32_t>(line.size()), now};
+        if (write(historyFd, text.data(), text.size()) == static_cast<ssize_t>(text.size())
+            && write(historyIndexFd, &record, sizeof(record)) == sizeof(record))
+            updateFrecency(xxh3(reinterpret_cast<const uint8_t*>(line.data()), line.size()), entry, now);
+    }
+    flock(historyFd, LOCK_UN);
+}
+
+// Доводит индекс до конца файла строк, если запись прервалась между ними, и возвращает номер
+// следующей записи. Досчитывается только хвост после последней проиндексированной строки
+bool syncHistoryIndex(uint64_t dataSize, uint64_t &entry)
+{
+    struct stat st;
+    if (fstat(historyIndexFd, &st) != 0)
+        return false;
+    entry = st.st_size / sizeof(HistoryRecord);
+    if (st.st_size % sizeof(HistoryRecord) != 0 && ftruncate(historyIndexFd, entry * sizeof(HistoryRecord)) != 0)
+        return false;
+    uint64_t indexed = 0;
+    HistoryRecord last;
+    if (entry > 0 && pread(historyIndexFd, &last, sizeof(last), (entry - 1) * sizeof(last)) == sizeof(last))
+        indexed = last.offset + last.length + 1;
+    if (indexed >= dataSize)
+        return true;
+    std::string tail(dataSize - indexed, '\0');
+    if (preadFull(historyFd, tail.data(), tail.size(), indexed) != static_cast<ssize_t>(tail.size()))
+        return false;
+    std::vector<HistoryRecord> missing;
+    auto now = static_cast<uint32_t>(time(nullptr));
+    for (size_t start = 0, end; (end = tail.find('\n', start)) != std::string::npos; start = end + 1)
+        missing.push_back({indexed + start, static_cast<uint32_t>(end - start), now});
+    auto bytes = static_cast<ssize_t>(missing.size() * sizeof(HistoryRecord));
+    if (bytes > 0 && write(historyIndexFd, missing.data(), bytes) != bytes)
+        return false;
+    entry += missing.size();
+    return true;
+}
+
+// Таблица частоты — открытая адресация в отображённом файле: обновление меняет один слот на месте,
+// а при заполнении на три четверти таблица перестраивается вдвое большей и подменяется rename
+void updateFrecency(uint64_t hash, uint64_t entry, uint32_t now)
+{
+    std::string path = historyPath + ".freq";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    struct stat st;
+    FrecencyHeader stored{};
+    bool valid = fstat(fd, &st) == 0 && pread(fd, &stored, sizeof(stored), 0) == sizeof(stored) && validFrecency(stored, st.st_size);
+    // Пустой или повреждённый файл заводится заново: частоты из него всё равно не прочитать
+    if (!valid && (ftruncate(fd, 0) != 0 || !initFrecency(fd, HISTORY_FRECENCY_INITIAL_SLOTS) || fstat(fd, &st) != 0))
+    {
+        close(fd);
+        return;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return;
+    auto *header = static_cast<FrecencyHeader*>(data);
+    auto *slots = reinterpret_cast<FrecencySlot*>(header + 1);
+    // Слота нет только в таблице, заполненной вопреки счётчику used: она перестраивается вдвое большей
+    FrecencySlot *slot = findFrecencySlot(slots, header->slots, hash);
+    if (slot)
+    {
+        if (slot->hash == 0)
+        {
+            slot->hash = hash | 1;
+            ++header->used;
+        }
+        slot->entry = entry;
+        ++slot->count;
+        slot->lastUsed = now;
+    }
+    if (!slot || header->used * 4 > header->slots * 3)
+        growFrecency(path, slots, header->slots);
+    munmap(data, st.st_size);
+}
+
+bool initFrecency(int fd, uint64_t slotCount)
+{
+    FrecencyHeader header{};
+    std::memcpy(header.magic, HISTORY_FRECENCY_MAGIC.data(), sizeof(header.magic));
+    header.slots = slotCount;
+    return ftruncate(fd, sizeof(header) + slotCount * sizeof(FrecencySlot)) == 0
+        && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+// Файл мог записать чужой или сбойный процесс: маска пробирования годится только для степени двойки,
+// а заполненная таблица не дала бы пробированию найти пустой слот
+bool validFrecency(const FrecencyHeader &header, uint64_t fileSize)
+{
+    return fileSize >= sizeof(FrecencyHeader) && std::string_view(header.magic, sizeof(header.magic)) == HISTORY_FRECENCY_MAGIC
+        && std::has_single_bit(header.slots) && header.used < header.slots
+        && header.slots <= (fileSize - sizeof(FrecencyHeader)) / sizeof(FrecencySlot);
+}
+
+// Младший бит хэша всегда выставлен, чтобы нулевой хэш означал пустой слот. Пробирование
+// обходит таблицу не больше одного раза и в заполненной таблице возвращает nullptr
+FrecencySlot *findFrecencySlot(FrecencySlot *slots, uint64_t slotCount, uint64_t hash)
+{
+    hash |= 1;
+    for (uint64_t step = 0, i = hash & (slotCount - 1); step < slotCount; ++step, i = (i + 1) & (slotCount - 1))
+        if (slots[i].hash == hash || slots[i].hash == 0)
+            return &slots[i];
+    return nullptr;
+}
+
+void growFrecency(const std::string &path, const FrecencySlot *slots, uint64_t slotCount)
+{
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    uint64_t grown = slotCount * 2;
+    size_t size = sizeof(FrecencyHeader) + grown * sizeof(FrecencySlot);
+    void *data = initFrecency(fd, grown) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        unlink(temporary.c_str());
+        return;
+    }
+    auto *header = static_cast<FrecencyHeader*>(data);
+    auto *target = reinterpret_cast<FrecencySlot*>(header + 1);
+    for (uint64_t i = 0; i < slotCount; ++i)
+        if (FrecencySlot *slot = slots[i].hash != 0 ? findFrecencySlot(target, grown, slots[i].hash) : nullptr)
+        {
+            *slot = slots[i];
+            ++header->used;
+        }
+    munmap(data, size);
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+        unlink(temporary.c_str());
+}
+
+// Индекс отображается раньше файла строк: всё, что в нём есть, уже дописано в файл строк
+bool openHistoryView(HistoryView &view)
+{
+    if (historyFd < 0)
+        return false;
+    for (auto [fd, file] : {std::pair{historyIndexFd, &view.index}, std::pair{historyFd, &view.data}})
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            return false;
+        if (st.st_size == 0)
+            continue;
+        file->size = st.st_size;
+        file->data = mmap(nullptr, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (file->data == MAP_FAILED)
+            return false;
+        madvise(file->data, file->size, MADV_RANDOM);
+    }
+    view.records = reinterpret_cast<const HistoryRecord*>(view.index.view().data());
+    view.count = view.index.view().size() / sizeof(HistoryRecord);
+    while (view.count > 0 && view.records[view.count - 1].offset + view.records[view.count - 1].length > view.data.size)
+        --view.count;
+    return true;
+}
+
+std::string_view HistoryView::entry(size_t i) const
+{
+    return data.view().substr(records[i].offset, records[i].length);
+}
+
+// Номер самой новой записи до before, содержащей text, или SIZE_MAX. Запрос короче триграммы
+// не сужает выбор и проверяется по записям подряд
+size_t searchHistory(const HistoryView &view, std::string_view text, size_t before)
+{
+    if (text.size() < HISTORY_NGRAM)
+    {
+        for (size_t i = std::min(before, view.count); i-- > 0;)
+            if (view.entry(i).find(text) != std::string_view::npos)
+                return i;
+        return SIZE_MAX;
+    }
+    HistoryIndex &index = historyIndex();
+    std::lock_guard<std::mutex> lock(index.mutex);
+    index.extend(view, view.count);
+    return index.search(view, text, before);
+}
+
+// Индекс живёт до выхода процесса: его может достраивать поток загрузки подсказок
+HistoryIndex &historyIndex()
+{
+    static auto *index = new HistoryIndex;
+    return *index;
+}
+
+uint32_t ngramKey(std::string_view text, size_t position)
+{
+    auto byte = [&](size_t i) { return static_cast<uint32_t>(static_cast<unsigned char>(text[position + i])); };
+    return byte(0) << 16 | byte(1) << 8 | byte(2);
+}
+
+// Вызывающий держит mutex
+void HistoryIndex::extend(const HistoryView &view, size_t end)
+{
+    for (; indexed < std::min(end, view.count); ++indexed)
+    {
+        std::string_view entry = view.entry(indexed);
+        auto id = static_cast<uint32_t>(indexed);
+        for (size_t i = 0; i + HISTORY_NGRAM <= entry.size(); ++i)
+        {
+            auto &list = postings[ngramKey(entry, i)];
+            if (list.empty() || list.back() != id)
+                list.push_back(id);
+        }
+    }
+}
+
+// Кандидаты берутся из самого короткого списка триграмм запроса от новых к старым и проверяются
+// целиком: совпадение всех триграмм ещё не означает, что они идут подряд
+size_t HistoryIndex::search(const HistoryView &view, std::string_view text, size_t before) const
+{
+    const std::vector<uint32_t> *rarest = nullptr;
+    for (size_t i = 0; i + HISTORY_NGRAM <= text.size(); ++i)
+    {
+        auto found = postings.find(ngramKey(text, i));
+        if (found == postings.end())
+            return SIZE_MAX;
+        if (!rarest || found->second.size() < rarest->size())
+            rarest = &found->second;
+    }
+    before = std::min(before, view.count);
+    for (auto id = std::lower_bound(rarest->begin(), rarest->end(), before); id != rarest->begin();)
+        if (view.entry(*--id).find(text) != std::string_view::npos)
+            return *id;
+    return SIZE_MAX;
+}
+
+// Частота с поправкой на давность: свежие команды весят больше, давно забытые — меньше
+double frecencyScore(const FrecencySlot &slot, uint32_t now)
+{
+    uint32_t age = now > slot.lastUsed ? now - slot.lastUsed : 0;
+    double weight = age < 3600 ? 4 : age < 86400 ? 2 : age < 7 * 86400 ? 1 : 0.5;
+    return slot.count * weight;
+}
+
+// history [N] | history -s TEXT [N] | history -f [N]: последние записи, поиск подстроки
+// от новых к старым и самые частые команды с учётом давности
+CommandError historyCommand(const std::vector<std::string> &arguments)
+{
+    std::string mode = !arguments.empty() && arguments[0][0] == '-' ? arguments[0] : "";
+    if (!mode.empty() && mode != "-s" && mode != "-f")
+        return CommandError::INVALID_ARGUMENT;
+    size_t countArgument = mode.empty() ? 0 : mode == "-s" ? 2 : 1;
+    if (arguments.size() > countArgument + 1 || (mode == "-s" && arguments.size() < 2))
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    size_t limit = HISTORY_DEFAULT_COUNT;
+    if (arguments.size() == countArgument + 1)
+    {
+        try
+        {
+            limit = std::stoul(arguments[countArgument]);
+        }
+        catch (const std::exception &)
+        {
+            return CommandError::INVALID_ARGUMENT;
+        }
+    }
+    HistoryView view;
+    if (!openHistoryView(view))
+        return historyFd < 0 ? CommandError::OK : fail(CommandError::READ_ERROR, historyPath);
+    if (mode.empty())
+    {
+        for (size_t i = view.count - std::min(limit, view.count); i < view.count; ++i)
+            commandOutput() << i + 1 << '\t' << view.entry(i) << '\n';
+    }
+    else if (mode == "-s")
+    {
+        for (size_t i = view.count; limit > 0 && (i = searchHistory(view, arguments[1], i)) != SIZE_MAX; --limit)
+            commandOutput() << i + 1 << '\t' << view.entry(i) << '\n';
+    }
+    else
+    {
+        // Слоты копируются под разделяемой блокировкой: appendHistory меняет их на месте, и без неё
+        // закрытое отображение застало бы слот наполовину записанным
+        std::vector<std::pair<double, FrecencySlot>> ranked;
+        auto now = static_cast<uint32_t>(time(nullptr));
+        if (flock(historyFd, LOCK_SH) == 0)
+        {
+            MappedFile table;
+            if (std::filesystem::exists(historyPath + ".freq"))
+                mapFile(historyPath + ".freq", table);
+            std::string_view bytes = table.view();
+            auto *header = reinterpret_cast<const FrecencyHeader*>(bytes.data());
+            if (bytes.size() >= sizeof(FrecencyHeader) && validFrecency(*header, bytes.size()))
+            {
+                auto *slots = reinterpret_cast<const FrecencySlot*>(header + 1);
+                for (uint64_t i = 0; i < header->slots; ++i)
+                    if (slots[i].hash != 0 && slots[i].entry < view.count)
+                        ranked.emplace_back(frecencyScore(slots[i], now), slots[i]);
+            }
+            flock(historyFd, LOCK_UN);
+        }
+        limit = std::min(limit, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + limit, ranked.end(),
+            [](const auto &a, const auto &b) { return a.first > b.first; });
+        for (size_t i = 0; i < limit; ++i)
+            commandOutput() << ranked[i].second.count << '\t' << ranked[i].first << '\t' << view.entry(ranked[i].second.entry) << '\n';
+    }
+    commandOutput().flush();
+    return CommandError::OK;
+}
+
+// Сжатый префиксный лес по истории: метки рёбер ссылаются на строки в общей арене, а каждый узел
+// помнит самую новую команду своего поддерева, так что подсказка — один спуск по префиксу.
+// Вызывающий держит mutex
+void SuggestionTrie::insert(std::string_view entry, uint32_t id)
+{
+    if (entry.empty() || arena.size() + entry.size() > UINT32_MAX)
+        return;
+    auto offset = static_cast<uint32_t>(arena.size());
+    auto length = static_cast<uint32_t>(entry.size());
+    arena.append(entry);
+    auto claim = [&](TrieNode &node)
+    {
+        if (node.bestLength == 0 || id >= node.bestId)
+        {
+            node.best = offset;
+            node.bestLength = length;
+            node.bestId = id;
+        }
+    };
+    claim(nodes[0]);
+    int32_t node = 0;
+    uint32_t position = 0;
+    while (position < length)
+    {
+        int32_t child = nodes[node].firstChild;
+        while (child >= 0 && arena[nodes[child].labelOffset] != entry[position])
+            child = nodes[child].nextSibling;
+        if (child < 0)
+        {
+            nodes.push_back({offset + position, length - position, offset, length, id, -1, nodes[node].firstChild});
+            nodes[node].firstChild = static_cast<int32_t>(nodes.size() - 1);
+            return;
+        }
+        uint32_t common = 0;
+        while (common < nodes[child].labelLength && position + common < length
+            && arena[nodes[child].labelOffset + common] == entry[position + common])
+            ++common;
+        // Ребро расходится с командой посередине: его остаток уходит в новый узел-потомок
+        if (common < nodes[child].labelLength)
+        {
+            TrieNode rest = nodes[child];
+            rest.labelOffset += common;
+            rest.labelLength -= common;
+            rest.nextSibling = -1;
+            nodes[child].labelLength = common;
+            nodes[child].firstChild = static_cast<int32_t>(nodes.size());
+            nodes.push_back(rest);
+        }
+        claim(nodes[child]);
+        node = child;
+        position += common;
+    }
+}
+
+std::string SuggestionTrie::suggest(std::string_view prefix) const
+{
+    int32_t node = 0;
+    size_t position = 0;
+    while (position < prefix.size())
+    {
+        int32_t child = nodes[node].firstChild;
+        while (child >= 0 && arena[nodes[child].labelOffset] != prefix[position])
+            child = nodes[child].nextSibling;
+        if (child < 0)
+            return {};
+        size_t length = std::min<size_t>(nodes[child].labelLength, prefix.size() - position);
+        if (arena.compare(nodes[child].labelOffset, length, prefix, position, length) != 0)
+            return {};
+        node = child;
+        position += length;
+    }
+    return arena.substr(nodes[node].best + prefix.size(), nodes[node].bestLength - prefix.size());
+}
+
+// Лес живёт до выхода процесса: его может достраивать поток загрузки
+SuggestionTrie &suggestionTrie()
+{
+    static auto *trie = new SuggestionTrie;
+    return *trie;
+}
+
+// Запись из файла истории загружается в фоне пачками, чтобы приглашение появилось сразу,
+// а подсказки во время загрузки не ждали дольше одной пачки
+void startSuggestions()
+{
+    if (!isatty(STDIN_FILENO))
+        return;
+    suggestionsEnabled = true;
+    struct stat st;
+    if (historyIndexFd < 0 || fstat(historyIndexFd, &st) != 0 || st.st_size == 0)
+        return;
+    size_t count = st.st_size / sizeof(HistoryRecord);
+    suggestionTrie().nextId = static_cast<uint32_t>(count);
+    std::thread([count]
+    {
+        HistoryView view;
+        if (!openHistoryView(view))
+            return;
+        size_t end = std::min(count, view.count);
+        SuggestionTrie &trie = suggestionTrie();
+        for (size_t first = 0; first < end; first += SUGGESTION_LOAD_BATCH)
+        {
+            std::lock_guard<std::mutex> lock(trie.mutex);
+            for (size_t i = first; i < std::min(end, first + SUGGESTION_LOAD_BATCH); ++i)
+                trie.insert(view.entry(i), static_cast<uint32_t>(i));
+        }
+        // Индекс для Ctrl-R строится следом, чтобы первый поиск не ждал всей истории
+        HistoryIndex &index = historyIndex();
+        for (size_t first = 0; first < end; first += SUGGESTION_LOAD_BATCH)
+        {
+            std::lock_guard<std::mutex> lock(index.mutex);
+            index.extend(view, first + SUGGESTION_LOAD_BATCH);
+        }
+    }).detach();
+}
+
+void addSuggestion(std::string_view line)
+{
+    if (!suggestionsEnabled)
+        return;
+    SuggestionTrie &trie = suggestionTrie();
+    std::lock_guard<std::mutex> lock(trie.mutex);
+    trie.insert(line, trie.nextId++);
+}
+
+// Ширина в колонках терминала: каждый символ UTF-8 считается за одну
+size_t countColumns(std::string_view text)
+{
+    return std::count_if(text.begin(), text.end(), [](char c) { return (c & 0xC0) != 0x80; });
+}
+
+// Строка приглашения с серой подсказкой из истории. Вывод за нажатие меняет только
+// хвост после курсора: совпавший с подсказкой символ просто печатается поверх неё
+bool readPromptLine(std::string &line, size_t promptWidth)
+{
+    line.clear();
+    std::cout.flush();
+    if (!suggestionsEnabled || tcgetattr(STDIN_FILENO, &savedTerminal) != 0)
+        return static_cast<bool>(std::getline(std::cin, line));
+    termios raw = savedTerminal;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    terminalRaw = true;
+    winsize size{};
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+    size_t columns = size.ws_col ? size.ws_col : 80;
+    std::string shown;
+    std::string out;
+    int pending = 0;
+    // Серый хвост ещё на экране, даже если подсказка уже сброшена посреди символа UTF-8
+    bool tail = false;
+    auto redraw = [&]
+    {
+        shown.clear();
+        if (!line.empty())
+        {
+            SuggestionTrie &trie = suggestionTrie();
+            std::lock_guard<std::mutex> lock(trie.mutex);
+            shown = trie.suggest(line);
+        }
+        // Подсказка обрезается по краю экрана, чтобы возврат курсора не зависел от переноса строк
+        size_t used = promptWidth + countColumns(line);
+        size_t room = used + 1 < columns ? columns - used - 1 : 0;
+        size_t cut = 0;
+        for (size_t fit = 0; cut < shown.size(); ++cut)
+            if ((shown[cut] & 0xC0) != 0x80 && fit++ == room)
+                break;
+        shown.resize(cut);
+        if (tail)
+            out += "\033[K";
+        tail = !shown.empty();
+        if (tail)
+            out += "\033[90m" + shown + "\033[0m\033[" + std::to_string(countColumns(shown)) + "D";
+    };
+    // Байт продолжения escape-последовательности ждётся недолго: одиночный ESC ничего не блокирует
+    auto readFollowing = [](unsigned char &next)
+    {
+        pollfd input{STDIN_FILENO, POLLIN, 0};
+        return poll(&input, 1, PROMPT_ESCAPE_TIMEOUT_MS) > 0 && read(STDIN_FILENO, &next, 1) == 1;
+    };
+    // Последовательность дочитывается до завершающего байта, чтобы её хвост не попал в строку.
+    // Подсказку принимают только стрелка вправо и End, остальные клавиши пропускаются
+    auto readEscape = [&]
+    {
+        unsigned char introducer, byte;
+        if (!readFollowing(introducer) || (introducer != '[' && introducer != 'O'))
+            return false;
+        std::string sequence;
+        while (readFollowing(byte))
+        {
+            sequence.push_back(static_cast<char>(byte));
+            if (introducer == 'O' || (byte >= 0x40 && byte <= 0x7E))
+                break;
+        }
+        return sequence == "C" || sequence == "F";
+    };
+    // Стирает хвост строки начиная с байта from вместе с подсказкой
+    auto eraseFrom = [&](size_t from)
+    {
+        size_t width = countColumns(std::string_view(line).substr(from));
+        line.resize(from);
+        pending = 0;
+        if (width > 0)
+            out += "\033[" + std::to_string(width) + "D";
+        out += "\033[K";
+        tail = false;
+        redraw();
+    };
+    // Ctrl-R ищет подстроку от новых записей истории к старым: на месте строки показываются запрос
+    // и найденная запись. Повторный Ctrl-R берёт запись старше, Ctrl-G возвращает прежнюю строку,
+    // любая другая клавиша оставляет найденное в строке и обрабатывается как обычно
+    std::unique_ptr<HistoryView> history;
+    bool searching = false;
+    std::string query, original;
+    size_t found = SIZE_MAX;
+    auto search = [&](size_t before)
+    {
+        size_t next = query.empty() ? SIZE_MAX : searchHistory(*history, query, before);
+        if (next != SIZE_MAX)
+        {
+            found = next;
+            line = history->entry(found);
+        }
+        out += "\r\033[" + std::to_string(promptWidth) + "C\033[K" + (next == SIZE_MAX && !query.empty() ? "(failed " : "(")
+            + "reverse-i-search)`" + query + "': " + line;
+    };
+    auto finishSearch = [&]
+    {
+        searching = false;
+        pending = 0;
+        out += "\r\033[" + std::to_string(promptWidth) + "C\033[K" + line;
+        tail = false;
+        redraw();
+    };
+    bool accepted = true;
+    while (true)
+    {
+        unsigned char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        out.clear();
+        if (n > 0 && (c == 18 || searching))
+        {
+            if (c == 18 && !searching)
+            {
+                history = std::make_unique<HistoryView>();
+                if (!openHistoryView(*history))
+                    continue;
+                searching = true;
+                original = line;
+                query.clear();
+                found = SIZE_MAX;
+                shown.clear();
+                search(history->count);
+            }
+            else if (c == 18)
+                search(found == SIZE_MAX ? history->count : found);
+            else if (c == 127 || c == '\b')
+            {
+                while (!query.empty() && (query.back() & 0xC0) == 0x80)
+                    query.pop_back();
+                if (!query.empty())
+                    query.pop_back();
+                search(history->count);
+            }
+            // Запрос растёт, и текущая запись может подойти и под него
+            else if (c >= 32)
+            {
+                query.push_back(static_cast<char>(c));
+                search(found == SIZE_MAX ? history->count : found + 1);
+            }
+            else if (c == 7)
+            {
+                line = original;
+                finishSearch();
+            }
+            else
+                finishSearch();
+            writeAll(STDOUT_FILENO, out.data(), out.size());
+            out.clear();
+            if (searching || c == 7)
+                continue;
+        }
+        if (n <= 0 || (c == 4 && line.empty()))
+        {
+            accepted = n <= 0 && !line.empty();
+            out += "\033[K";
+            if (accepted)
+                out += "\n";
+            writeAll(STDOUT_FILENO, out.data(), out.size());
+            break;
+        }
+        if (c == '\r' || c == '\n')
+        {
+            out += "\033[K\n";
+            writeAll(STDOUT_FILENO, out.data(), out.size());
+            break;
+        }
+        if (c == 127 || c == '\b')
+        {
+            if (line.empty())
+                continue;
+            while (!line.empty() && (line.back() & 0xC0) == 0x80)
+                line.pop_back();
+            line.pop_back();
+            pending = 0;
+            out += "\b\033[K";
+            tail = false;
+            redraw();
+        }
+        // Ctrl-U стирает строку, Ctrl-W — слово перед курсором
+        else if (c == 21)
+            eraseFrom(0);
+        else if (c == 23)
+        {
+            size_t from = line.find_last_not_of(' ');
+            from = from == std::string::npos ? 0 : line.find_last_of(' ', from);
+            eraseFrom(from == std::string::npos ? 0 : from + 1);
+        }
+        // Ctrl-F, стрелка вправо и End принимают подсказку
+        else if (c == 6 || c == 27)
+        {
+            if (c == 27 && !readEscape())
+                continue;
+            if (shown.empty())
+                continue;
+            out += shown;
+            line += shown;
+            shown.clear();
+            tail = false;
+        }
+        else if (c >= 32)
+        {
+            line.push_back(static_cast<char>(c));
+            out.push_back(static_cast<char>(c));
+            pending = c >= 0xC0 ? (c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1) : c >= 0x80 && pending > 0 ? pending - 1 : 0;
+            if (!shown.empty() && static_cast<unsigned char>(shown[0]) == c)
+            {
+                shown.erase(0, 1);
+                tail = !shown.empty();
+            }
+            else if (pending == 0)
+                redraw();
+            else
+                shown.clear();
+        }
+        writeAll(STDOUT_FILENO, out.data(), out.size());
+    }
+    restoreTerminalMode();
+    return accepted;
+}
+
+void restoreTerminalMode()
+{
+    if (!terminalRaw)
+        return;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &savedTerminal);
+    terminalRaw = false;
+}
+
+// dag [-j N] [-c] FILE [TARGET...]: строка 'цель: зависимости' открывает правило, строки с отступом
+// под ней задают его команды. Зависимость, не являющаяся правилом, считается входным файлом.
+// С -c актуальность определяется хешами содержимого из FILE.state вместо времён изменения
+CommandError dagCommand(const std::vector<std::string> &arguments)
+{
+    size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool contentHashes = false;
+    size_t i = 0;
+    for (; i < arguments.size() && arguments[i].size() > 1 && arguments[i][0] == '-'; ++i)
+    {
+        if (arguments[i] == "-c")
+            contentHashes = true;
+        else if (arguments[i] == "-j" && i + 1 < arguments.size())
+        {
+            try
+            {
+                jobs = std::stoul(arguments[++i]);
+            }
+            catch (const std::exception &)
+            {
+                return CommandError::INVALID_ARGUMENT;
+            }
+            if (jobs == 0)
+                return CommandError::INVALID_ARGUMENT;
+        }
+        else
+            return CommandError::INVALID_ARGUMENT;
+    }
+    if (i == arguments.size())
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    std::string specPath = arguments[i++];
+    std::vector<DagNode> nodes;
+    CommandError e = parseDag(specPath, nodes);
+    if (e != CommandError::OK)
+        return e;
+    if (nodes.empty())
+        return CommandError::OK;
+    std::unordered_map<std::string, size_t> byName;
+    for (size_t n = 0; n < nodes.size(); ++n)
+        byName[nodes[n].name] = n;
+    std::vector<size_t> stack;
+    for (; i < arguments.size(); ++i)
+    {
+        auto found = byName.find(arguments[i]);
+        if (found == byName.end())
+            return fail(CommandError::INVALID_ARGUMENT, arguments[i], 0);
+        stack.push_back(found->second);
+    }
+    if (stack.empty())
+        stack.push_back(0);
+    for (auto &node : nodes)
+        for (const auto &prerequisite : node.prerequisites)
+        {
+            auto found = byName.find(prerequisite);
+            if (found != byName.end())
+                node.dependencies.push_back(found->second);
+        }
+    while (!stack.empty())
+    {
+        size_t n = stack.back();
+        stack.pop_back();
+        if (nodes[n].needed)
+            continue;
+        nodes[n].needed = true;
+        for (size_t dependency : nodes[n].dependencies)
+            stack.push_back(dependency);
+    }
+    std::deque<size_t> ready;
+    size_t neededCount = 0;
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+        if (!nodes[n].needed)
+            continue;
+        ++neededCount;
+        nodes[n].waiting = nodes[n].dependencies.size();
+        for (size_t dependency : nodes[n].dependencies)
+            nodes[dependency].dependents.push_back(n);
+        if (nodes[n].waiting == 0)
+            ready.push_back(n);
+    }
+    std::unordered_map<std::string, std::string> state;
+    std::string statePath = specPath + ".state";
+    if (contentHashes)
+    {
+        std::ifstream stateFile(statePath);
+        std::string name, hash;
+        while (stateFile >> name >> hash)
+            state[name] = hash;
+    }
+    std::vector<std::tuple<size_t, std::chrono::steady_clock::time_point, pid_t>> running;
+    std::vector<pollfd> polled;
+    std::vector<size_t> order;
+    int failedStatus = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto complete = [&](size_t n)
+    {
+        order.push_back(n);
+        for (size_t dependent : nodes[n].dependents)
+            if (--nodes[dependent].waiting == 0)
+                ready.push_back(dependent);
+    };
+    auto finish = [&](size_t n, std::chrono::steady_clock::time_point launched, int code)
+    {
+        DagNode &node = nodes[n];
+        node.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - launched).count();
+        node.rebuilt = true;
+        commandOutput() << "[dag] " << node.name << '\t' << node.seconds << " s" << (code ? "\tfailed" : "") << std::endl;
+        if (code != 0)
+        {
+            failedStatus = failedStatus ? failedStatus : code;
+            return;
+        }
+        if (contentHashes)
+            state[node.name] = node.stateHash;
+        complete(n);
+    };
+    commandOutput().flush();
+    while (!ready.empty() || !running.empty())
+    {
+        while (failedStatus == 0 && !ready.empty() && running.size() < jobs)
+        {
+            size_t n = ready.front();
+            ready.pop_front();
+            if (dagUpToDate(nodes, nodes[n], contentHashes, state))
+            {
+                complete(n);
+                continue;
+            }
+            pid_t pid = launchDagNode(nodes[n]);
+            if (pid < 0)
+            {
+                failedStatus = exitStatus(CommandError::FORK_ERROR);
+                break;
+            }
+            auto launched = std::chrono::steady_clock::now();
+            // Без pidfd задание дожидается сразу, и граф выполняется последовательно
+            int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+            if (pidfd < 0)
+            {
+                finish(n, launched, waitJob(pid));
+                continue;
+            }
+            pids.insert(pid);
+            running.emplace_back(n, launched, pid);
+            polled.push_back({pidfd, POLLIN, 0});
+        }
+        if (running.empty())
+            break;
+        // Ждутся только свои задания: wait4(-1) забирал бы и чужие процессы, например попытки retry
+        if (poll(polled.data(), polled.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (size_t k = polled.size(); k-- > 0;)
+        {
+            if (polled[k].revents == 0)
+                continue;
+            int code = waitPidfd(polled[k].fd);
+            close(polled[k].fd);
+            auto [n, launched, pid] = running[k];
+            pids.erase(pid);
+            running[k] = running.back();
+            running.pop_back();
+            polled[k] = polled.back();
+            polled.pop_back();
+            finish(n, launched, code);
+        }
+    }
+    for (const auto &entry : polled)
+        close(entry.fd);
+    if (contentHashes)
+    {
+        std::ofstream stateFile(statePath, std::ios::trunc);
+        for (const auto &[name, hash] : state)
+            stateFile << name << ' ' << hash << '\n';
+    }
+    if (failedStatus == 0 && order.size() != neededCount)
+        return fail(CommandError::SYNTAX_ERROR, specPath, 0);
+    if (failedStatus == 0)
+        printCriticalPath(nodes, order, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    setPipeStatus({failedStatus});
+    return failedStatus == 0 ? CommandError::OK : CommandError::CONDITION_FALSE;
+}
+
+CommandError parseDag(const std::string &path, std::vector<DagNode> &nodes)
+{
+    std::ifstream file(path);
+    if (!file)
+        return fail(CommandError::INVALID_FILE_PATH, path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        if (first > 0)
+        {
+            if (nodes.empty())
+                return fail(CommandError::SYNTAX_ERROR, line, 0);
+            nodes.back().commands.push_back(line.substr(first));
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            return fail(CommandError::SYNTAX_ERROR, line, 0);
+        DagNode &node = nodes.emplace_back();
+        node.name = line.substr(0, colon);
+        node.prerequisites = splitStringBySpace(line.substr(colon + 1));
+    }
+    return CommandError::OK;
+}
+
+// Правило выполняется, если его цели нет, если пересобрана зависимость или если входы новее цели
+// (с хешами — если изменилось содержимое входов или текст команд)
+bool dagUpToDate(std::vector<DagNode> &nodes, DagNode &node, bool contentHashes, const std::unordered_map<std::string, std::string> &state)
+{
+    bool dependencyRebuilt = std::any_of(node.dependencies.begin(), node.dependencies.end(), [&](size_t n) { return nodes[n].rebuilt; });
+    if (node.commands.empty())
+    {
+        node.rebuilt = dependencyRebuilt;
+        return true;
+    }
+    // Хеш считается и для отсутствующей цели: после сборки он уходит в FILE.state
+    if (contentHashes)
+    {
+        std::string combined;
+        for (const auto &command : node.commands)
+            combined.append(command).push_back('\n');
+        for (const auto &prerequisite : node.prerequisites)
+        {
+            MappedFile file;
+            if (mapFile(prerequisite, file) == CommandError::OK)
+                combined.append(hashData(file.view(), HashAlgorithm::XXH3, false));
+            clearError();
+        }
+        node.stateHash = hashData(combined, HashAlgorithm::XXH3, false);
+        auto recorded = state.find(node.name);
+        return recorded != state.end() && recorded->second == node.stateHash && access(node.name.c_str(), F_OK) == 0;
+    }
+    struct stat target;
+    if (stat(node.name.c_str(), &target) != 0 || dependencyRebuilt)
+        return false;
+    for (const auto &prerequisite : node.prerequisites)
+    {
+        struct stat input;
+        if (stat(prerequisite.c_str(), &input) != 0)
+            return false;
+        if (input.st_mtim.tv_sec > target.st_mtim.tv_sec
+            || (input.st_mtim.tv_sec == target.st_mtim.tv_sec && input.st_mtim.tv_nsec > target.st_mtim.tv_nsec))
+            return false;
+    }
+    return true;
+}
+
+pid_t launchDagNode(const DagNode &node)
+{
+    return execShell({}, node.commands, 0, -1, -1);
+}
+
+void printCriticalPath(const std::vector<DagNode> &nodes, const std::vector<size_t> &order, double wallSeconds)
+{
+    std::vector<double> finish(nodes.size(), 0);
+    std::vector<int> previous(nodes.size(), -1);
+    int last = -1;
+    for (size_t n : order)
+    {
+        for (size_t dependency : nodes[n].dependencies)
+            if (finish[dependency] > finish[n])
+            {
+                finish[n] = finish[dependency];
+                previous[n] = static_cast<int>(dependency);
+            }
+        finish[n] += nodes[n].seconds;
+        if (last < 0 || finish[n] > finish[last])
+            last = static_cast<int>(n);
+    }
+    if (last < 0 || finish[last] == 0)
+        return;
+    std::vector<std::string_view> path;
+    for (int n = last; n >= 0; n = previous[n])
+        path.push_back(nodes[n].name);
+    commandOutput() << "[dag] critical path:";
+    for (auto name = path.rbegin(); name != path.rend(); ++name)
+        commandOutput() << (name == path.rbegin() ? " " : " -> ") << *name;
+    commandOutput() << '\t' << finish[last] << " s of " << wallSeconds << " s" << std::endl;
+}
+
+CommandError openNotepad(const std::vector<std::string> &arguments)
+{
+    pid_t pid = fork();
+    int status;
+    if (pid == -1)
+        return CommandError::UNABLE_TO_OPEN_NOTEPAD;
+    if (pid == 0)
+    {
+        execlp("notepad.exe", "notepad.exe", NULL);
+        return CommandError::UNABLE_TO_OPEN_NOTEPAD;
+    }
+    else
+    {
+        commandOutput() << "Opened notepad with PID:\t" << pid << std::endl;
+        pids.insert(pid);
+    }
+    return CommandError::OK;
+}
+
+CommandError createProcesses(const std::vector<std::string> &tokens, bool background)
+{
+    std::vector<std::string> currentTokens;
+    CommandError e = CommandError::OK;
+    for (const auto &arg : tokens)
+    {
+        if (arg == "&&")
+        {
+            e = createProcess(currentTokens, 0, background);
+            currentTokens.clear();
+        }
+        else
+            currentTokens.emplace_back(arg);
+        if (e != CommandError::OK)
+            return e;
+    }
+    e = createProcess(currentTokens, 0, background);
+    return e;
+}
+
+CommandError createProcess(const std::vector<std::string> &tokens, int priority, bool background)
+{
+    pid_t pid;
+    CommandError e;
+    if (background)
+    {
+        // Фоновый запуск не держит приглашение: он ждёт своей очереди в цикле событий
+        LaunchSlot slot = reserveLaunch(tokens);
+        if (slot.start > std::chrono::steady_clock::now())
+        {
+            deferLaunch(slot, [tokens, priority]
+            {
+                pid_t pid;
+                if (launchProcess(tokens, pid, priority, -1, -1, 0, true) != CommandError::OK)
+                    return;
+                std::lock_guard<std::mutex> lock(rateMutex);
+                launchedJobs.push_back(pid);
+            });
+            setPipeStatus({LAUNCH_QUEUED_STATUS});
+            return CommandError::OK;
+        }
+        e = launchProcess(tokens, pid, priority, -1, -1, 0, true);
+    }
+    else
+        e = spawnProcess(tokens, pid, priority, -1, recordOutputFd);
+    if (e != CommandError::OK)
+    {
+        setPipeStatus({exitStatus(e)});
+        return e;
+    }
+    if (background)
+    {
+        pids.insert(pid);
+        setPipeStatus({0});
+        return CommandError::OK;
+    }
+    setPipeStatus({waitJob(pid, true)});
+    return lastStatus == 0 ? CommandError::OK : CommandError::CONDITION_FALSE;
+}
+
+// Задание на переднем плане остаётся в pids, пока его ждём, чтобы killall из обработчика SIGINT его достал.
+// На время ожидания ему передаётся терминал, иначе чтение с него остановило бы задание по SIGTTIN;
+// остановленное задание так и остаётся в pids фоновым
+int waitJob(pid_t pid, bool foreground)
+{
+    pids.insert(pid);
+    int status = 0;
+    struct rusage usage;
+    bool terminal = foreground && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    // Задание могло успеть остановиться, прочитав терминал до передачи, поэтому его группа продолжается
+    if (terminal && tcsetpgrp(STDIN_FILENO, getpgid(pid)) == 0)
+        kill(-getpgid(pid), SIGCONT);
+    while (wait4(pid, &status, terminal ? WUNTRACED : 0, &usage) < 0 && errno == EINTR)
+        ;
+    if (terminal)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (WIFSTOPPED(status))
+    {
+        commandOutput() << "[" << pid << "] stopped" << std::endl;
+        return 128 + WSTOPSIG(status);
+    }
+    pids.erase(pid);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// Процесс, который успел дождаться кто-то другой, считается неудачным
+int waitPidfd(int pidfd)
+{
+    siginfo_t info{};
+    int result;
+    while ((result = waitid(P_PIDFD, pidfd, &info, WEXITED)) < 0 && errno == EINTR)
+        ;
+    if (result < 0)
+        return 1;
+    return info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+}
+
+void reapJobs()
+{
+    adoptLaunchedJobs();
+    int status;
+    for (auto pid = pids.begin(); pid != pids.end();)
+    {
+        if (wait4(*pid, &status, WNOHANG, nullptr) == *pid)
+            pid = pids.erase(pid);
+        else
+            ++pid;
+    }
+    releaseJobCgroups();
+}
+
+int exitStatus(CommandError e)
+{
+    switch (e)
+    {
+    case CommandError::OK:
+        return 0;
+    case CommandError::UNKNOWN_COMMAND:
+    case CommandError::INVALID_PROCESS_INPUT:
+        return 127;
+    case CommandError::SYNTAX_ERROR:
+        return 2;
+    case CommandError::LAUNCH_INTERRUPTED:
+        return 128 + SIGINT;
+    default:
+        return 1;
+    }
+}
+
+void setPipeStatus(const std::vector<int> &statuses)
+{
+    lastStatus = statuses.back();
+    shellVariables["?"] = std::to_string(lastStatus);
+    std::string joined;
+    for (size_t i = 0; i < statuses.size(); ++i)
+        joined.append(i ? " " : "").append(std::to_string(statuses[i]));
+    shellVariables["PIPESTATUS"] = joined;
+}
+
+// Все внешние программы запускаются отсюда: стадии конвейеров, команды правил dag в дочерних
+// term -s и команды приглашения ждут здесь своей очереди у ограничителя
+CommandError spawnProcess(const std::vector<std::string> &tokens, pid_t &pid, int priority, int input, int outputFd, pid_t group, bool background)
+{
+    CommandError e = waitForLaunch(reserveLaunch(tokens));
+    if (e != CommandError::OK)
+        return e;
+    return launchProcess(tokens, pid, priority, input, outputFd, group, background);
+}
+
+// Запуск без ограничителя: место в очереди вызывающий уже зарезервировал
+CommandError launchProcess(const std::vector<std::string> &tokens, pid_t &pid, int priority, int input, int outputFd, pid_t group, bool background)
+{
+    std::vector<std::string> arguments;
+    std::vector<Redirection> redirections;
+    std::vector<int> fds;
+    if (!extractRedirections(tokens, arguments, redirections) || arguments.empty())
+        return CommandError::SYNTAX_ERROR;
+    CommandError e = openRedirections(redirections, fds);
+    if (e != CommandError::OK)
+        return e;
+    // При включённом мультиплексоре вывод фонового задания идёт через каналы, если его не перенаправили
+    // явно; задание переднего плана пишет напрямую, и его вывод не отстаёт от следующих команд
+    std::array<std::array<int, 2>, 2> jobPipes = {{{-1, -1}, {-1, -1}}};
+    for (int target : {STDOUT_FILENO, STDERR_FILENO})
+    {
+        bool redirected = std::any_of(redirections.begin(), redirections.end(), [target](const Redirection &r) { return r.fd == target; });
+        if (multiplexOutput && background && !redirected && (target == STDERR_FILENO || outputFd < 0))
+            pipe2(jobPipes[target - 1].data(), O_CLOEXEC);
+    }
+    // Дескрипторы ребёнка в порядке dup2: явные перенаправления идут последними и побеждают
+    std::vector<std::pair<int, int>> moves;
+    if (input >= 0)
+        moves.push_back({input, STDIN_FILENO});
+    if (outputFd >= 0)
+        moves.push_back({outputFd, STDOUT_FILENO});
+    for (int target : {STDOUT_FILENO, STDERR_FILENO})
+        if (jobPipes[target - 1][1] >= 0)
+            moves.push_back({jobPipes[target - 1][1], target});
+    for (size_t i = 0; i < redirections.size(); ++i)
+        moves.push_back({fds[i], redirections[i].fd});
+    std::string cgroup = background ? createJobCgroup() : "";
+    std::string cgroupProcs = cgroup.empty() ? "" : cgroup + "/cgroup.procs";
+    char **argv = new char*[arguments.size() + 1];
+    tokensToArgv(arguments, argv);
+    int spawnError = onEventLoop ? spawnDirect(argv, moves, group, pid) : forkExec(argv, moves, group, cgroupProcs, pid);
+    delete[] argv;
+    for (int fd : fds)
+        close(fd);
+    for (int target : {STDOUT_FILENO, STDERR_FILENO})
+    {
+        if (jobPipes[target - 1][0] < 0)
+            continue;
+        close(jobPipes[target - 1][1]);
+        if (pid < 0 || !eventLoop().addStream(jobPipes[target - 1][0], target, pid))
+            close(jobPipes[target - 1][0]);
+    }
+    if (pid < 0)
+    {
+        if (!cgroup.empty())
+            rmdir(cgroup.c_str());
+        if (spawnError < 0)
+            return fail(CommandError::FORK_ERROR, arguments[0], -spawnError);
+        return fail(CommandError::INVALID_PROCESS_INPUT, arguments[0], spawnError);
+    }
+    if (!cgroup.empty())
+    {
+        // Ребёнок posix_spawn не может вступить в cgroup сам, и его переносит родитель
+        if (onEventLoop)
+        {
+            int procs = open(cgroupProcs.c_str(), O_WRONLY | O_CLOEXEC);
+            if (procs >= 0)
+            {
+                std::string number = std::to_string(pid);
+                [[maybe_unused]] ssize_t joined = write(procs, number.data(), number.size());
+                close(procs);
+            }
+        }
+        std::lock_guard<std::mutex> lock(jobCgroupMutex);
+        jobCgroups[pid] = cgroup;
+    }
+    setpgid(pid, group ? group : pid);
+    setpriority(PRIO_PROCESS, pid, priority);
+    return CommandError::OK;
+}
+
+// fork с главного потока: ребёнок вступает в cgroup задания до exec, так что и его потомки
+// рождаются внутри. Возвращает 0, errno неудачного exec или -errno неудачного fork
+int forkExec(char **argv, const std::vector<std::pair<int, int>> &moves, pid_t group, const std::string &cgroupProcs, pid_t &pid)
+{
+    // Канал закрывается при успешном exec, иначе ребёнок передаёт через него errno
+    int execPipe[2];
+    if (pipe2(execPipe, O_CLOEXEC) != 0)
+    {
+        pid = -1;
+        return -errno;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        close(execPipe[0]);
+        setpgid(0, group);
+        if (!cgroupProcs.empty())
+        {
+            int procs = open(cgroupProcs.c_str(), O_WRONLY | O_CLOEXEC);
+            if (procs >= 0)
+            {
+                [[maybe_unused]] ssize_t joined = write(procs, "0", 1);
+                close(procs);
+            }
+        }
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        for (const auto &[fd, target] : moves)
+            dup2(fd, target);
+        execvp(argv[0], argv);
+        int error = errno;
+        ssize_t written = write(execPipe[1], &error, sizeof(error));
+        _exit(written == sizeof(error) ? 127 : 126);
+    }
+    int forkError = errno;
+    close(execPipe[1]);
+    if (pid < 0)
+    {
+        close(execPipe[0]);
+        return -forkError;
+    }
+    int execError = 0;
+    ssize_t n;
+    while ((n = read(execPipe[0], &execError, sizeof(execError))) < 0 && errno == EINTR)
+        ;
+    close(execPipe[0]);
+    if (n != sizeof(execError))
+        return 0;
+    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+        ;
+    pid = -1;
+    return execError;
+}
+
+// Запуск из потока цикла событий: fork копировал бы замки, занятые другими потоками, поэтому
+// posix_spawn только переставляет дескрипторы и сразу выполняет exec. Коды возврата как у forkExec
+int spawnDirect(char **argv, const std::vector<std::pair<int, int>> &moves, pid_t group, pid_t &pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attributes);
+    for (const auto &[fd, target] : moves)
+        posix_spawn_file_actions_adddup2(&actions, fd, target);
+    sigset_t defaults, mask;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTTOU);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+    posix_spawnattr_setpgroup(&attributes, group);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    int error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0)
+        pid = -1;
+    return error;
+}
+
+EventLoop &eventLoop()
+{
+    static EventLoop loop;
+    return loop;
+}
+
+EventLoop::EventLoop() : epollFd(epoll_create1(EPOLL_CLOEXEC)), timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+{
+    if (epollFd < 0)
+        return;
+    if (timerFd >= 0)
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = &timerSource;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+    }
+    std::thread(runEventLoop, std::ref(*this)).detach();
+}
 
-std::vector<std::string> splitStringBySpace(const std::string &inputString);
+bool EventLoop::addStream(int fd, int target, pid_t pid)
+{
+    if (epollFd < 0)
+        return false;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    auto *stream = new JobStream{{EventKind::STREAM}, fd, target, "\033[3" + std::to_string(1 + pid % 6) + "m[" + std::to_string(pid) + "]\033[0m ", {}};
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = stream;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0)
+        return true;
+    delete stream;
+    return false;
+}
 
-int main()
+// Завершение процесса приходит как готовность pidfd, поэтому ждать его не нужно ни одному потоку
+bool EventLoop::watchProcess(pid_t pid, std::function<void(int)> onExit)
 {
-    signal(SIGINT, closeTerminal);
-    while (true)
+    if (epollFd < 0)
+        return false;
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd < 0)
+        return false;
+    auto *watch = new ProcessWatch{{EventKind::PROCESS}, pidfd, std::move(onExit)};
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = watch;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pidfd, &event) == 0)
+        return true;
+    close(pidfd);
+    delete watch;
+    return false;
+}
+
+bool Timer::operator>(const Timer &other) const
+{
+    return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+}
+
+void EventLoop::addTimer(std::chrono::steady_clock::time_point deadline, std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(timerMutex);
+    uint64_t sequence = nextSequence++;
+    timers.push({deadline, sequence, std::move(callback)});
+    if (timers.top().sequence == sequence)
+        armTimer();
+}
+
+// Все таймеры делят один timerfd, взведённый на ближайший срок кучи. Вызывается под timerMutex
+void EventLoop::armTimer()
+{
+    itimerspec spec{};
+    if (!timers.empty())
     {
-        std::cout << cursor;
-        std::string inputBuffer;
-        std::getline(std::cin, inputBuffer);
-        if (inputBuffer.empty())
-            continue;
-        std::vector<std::string> tokens = splitStringBySpace(inputBuffer);
-        CommandError e = executeCommand(tokens);
-        if (e == CommandError::UNKNOWN_COMMAND)
-            e = createProcesses(tokens);
-        if (e != CommandError::OK)
-            std::cout << "\033[31m" << getErrorMessage(e) << "\033[0m" << std::endl;
+        auto since = timers.top().deadline.time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since);
+        spec.it_value.tv_sec = seconds.count();
+        spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(since - seconds).count();
+        // Нулевое время снимает таймер, поэтому уже прошедший срок взводится на наименьшее ненулевое
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
     }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
 }
 
-std::vector<std::string> splitStringBySpace(const std::string &inputString)
+void EventLoop::takeDueTimers(std::vector<std::function<void()>> &due)
 {
-    std::istringstream iss(inputString);
-    std::vector<std::string> substrings;
-    std::string substring;
-    while (std::getline(iss, substring, ' '))
-        substrings.push_back(substring);
-    return substrings;
+    uint64_t expirations;
+    while (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+        ;
+    std::lock_guard<std::mutex> lock(timerMutex);
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() && timers.top().deadline <= now)
+    {
+        due.push_back(std::move(const_cast<Timer&>(timers.top()).callback));
+        timers.pop();
+    }
+    armTimer();
 }
 
-CommandError executeCommand(const std::vector<std::string> &tokens)
+// Все задания обслуживает один поток: за проход он читает из готовых каналов,
+// собирает целые строки с префиксами и выводит их одним writev на каждый поток вывода.
+// Сработавшие таймеры и завершения процессов обрабатываются после вывода, чтобы
+// строки задания печатались раньше отчёта о его завершении
+void runEventLoop(EventLoop &loop)
 {
-    std::string command = tokens[0];
-    std::vector<std::string> arguments(tokens.begin() + 1, tokens.end());
-    CommandError e;
-    try
+    std::array<epoll_event, EVENT_LOOP_MAX_EVENTS> events;
+    std::vector<JobStream*> ready;
+    std::array<std::vector<iovec>, 2> lines;
+    std::vector<std::function<void()>> callbacks;
+    onEventLoop = true;
+    while (true)
     {
-        e = terminalCommands.at(command)(arguments);
+        int count = epoll_wait(loop.epollFd, events.data(), events.size(), -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return;
+        ready.clear();
+        callbacks.clear();
+        for (int i = 0; i < count; ++i)
+        {
+            auto *source = static_cast<EventSource*>(events[i].data.ptr);
+            if (source->kind == EventKind::TIMER)
+            {
+                loop.takeDueTimers(callbacks);
+                continue;
+            }
+            if (source->kind == EventKind::PROCESS)
+            {
+                auto *watch = static_cast<ProcessWatch*>(source);
+                int status = waitPidfd(watch->pidfd);
+                // Копия pidfd в ребёнке, который ещё не дошёл до exec, держит регистрацию в epoll
+                // и после close, и следующий проход получил бы уже удалённый watch
+                epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, watch->pidfd, nullptr);
+                close(watch->pidfd);
+                callbacks.push_back([watch, status]
+                {
+                    watch->onExit(status);
+                    delete watch;
+                });
+                continue;
+            }
+            auto *stream = static_cast<JobStream*>(source);
+            if (stream->buffer.empty())
+                stream->buffer.resize(MUX_BUFFER_SIZE);
+            ssize_t n = read(stream->fd, stream->buffer.data() + stream->filled, stream->buffer.size() - stream->filled);
+            if (n > 0)
+                stream->filled += n;
+            else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                stream->closed = true;
+            ready.push_back(stream);
+        }
+        for (auto *stream : ready)
+            collectLines(*stream, lines[stream->target - 1]);
+        writeLines(STDOUT_FILENO, lines[0]);
+        writeLines(STDERR_FILENO, lines[1]);
+        for (auto *stream : ready)
+        {
+            if (!stream->closed)
+            {
+                std::memmove(stream->buffer.data(), stream->buffer.data() + stream->consumed, stream->filled - stream->consumed);
+                stream->filled -= stream->consumed;
+                continue;
+            }
+            epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, stream->fd, nullptr);
+            close(stream->fd);
+            delete stream;
+        }
+        for (auto &callback : callbacks)
+            callback();
     }
-    catch (const std::out_of_range &e)
+}
+
+// Добавляет целые строки из буфера задания; недописанный хвост сдвигается в начало уже после writev
+void collectLines(JobStream &stream, std::vector<iovec> &lines)
+{
+    static const char newline = '\n';
+    char *begin = stream.buffer.data();
+    char *end = begin + stream.filled;
+    char *line = begin;
+    while (line < end)
     {
-        return CommandError::UNKNOWN_COMMAND;
+        auto *found = static_cast<char*>(std::memchr(line, '\n', end - line));
+        if (!found)
+            break;
+        lines.push_back({stream.prefix.data(), stream.prefix.size()});
+        lines.push_back({line, static_cast<size_t>(found + 1 - line)});
+        line = found + 1;
     }
-    return e;
+    // Строка длиннее буфера или конец потока выводятся как есть, чтобы задание не зависло
+    if (line < end && (stream.closed || (line == begin && stream.filled == stream.buffer.size())))
+    {
+        lines.push_back({stream.prefix.data(), stream.prefix.size()});
+        lines.push_back({line, static_cast<size_t>(end - line)});
+        lines.push_back({const_cast<char*>(&newline), 1});
+        line = end;
+    }
+    stream.consumed = line - begin;
 }
 
-CommandError killCommand(const std::vector<std::string> &arguments)
+void writeLines(int fd, std::vector<iovec> &lines)
+{
+    size_t first = 0;
+    while (first < lines.size())
+    {
+        int batch = static_cast<int>(std::min<size_t>(lines.size() - first, IOV_MAX));
+        ssize_t n = writev(fd, lines.data() + first, batch);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        while (first < lines.size() && static_cast<size_t>(n) >= lines[first].iov_len)
+            n -= lines[first++].iov_len;
+        if (n > 0)
+        {
+            lines[first].iov_base = static_cast<char*>(lines[first].iov_base) + n;
+            lines[first].iov_len -= n;
+        }
+    }
+    lines.clear();
+}
+
+CommandError muxCommand(const std::vector<std::string> &arguments)
 {
     if (arguments.size() != 1)
         return CommandError::INVALID_ARGUMENT_NUMBER;
-    int pid = std::stoi(arguments[0]);
-    if (!pids.contains(pid))
-        return CommandError::INVALID_PID;
-    eraseLine();
-    printKill("kill " + arguments[0]);
-    kill(pid, SIGKILL);
-    pids.erase(pid);
+    if (arguments[0] != "on" && arguments[0] != "off")
+        return CommandError::INVALID_ARGUMENT;
+    multiplexOutput = arguments[0] == "on";
     return CommandError::OK;
 }
 
-CommandError killAllCommand(const std::vector<std::string> &arguments)
+// retry [-n N] [--backoff exp|fixed] [-d MS] COMMAND...: попытки запускаются в фоне, их завершение
+// и паузы между ними обслуживает цикл событий, так что приглашение не ждёт ни одной попытки
+CommandError retryCommand(const std::vector<std::string> &arguments)
 {
-    if (arguments.size() != 0)
+    auto job = std::make_shared<RetryJob>();
+    job->maxAttempts = RETRY_DEFAULT_ATTEMPTS;
+    job->exponential = true;
+    job->delay = std::chrono::milliseconds(RETRY_DEFAULT_DELAY_MS);
+    size_t i = 0;
+    for (; i + 1 < arguments.size() && arguments[i].size() > 1 && arguments[i][0] == '-'; i += 2)
+    {
+        const std::string &value = arguments[i + 1];
+        if (arguments[i] == "--backoff")
+        {
+            if (value != "exp" && value != "fixed")
+                return CommandError::INVALID_ARGUMENT;
+            job->exponential = value == "exp";
+            continue;
+        }
+        if (arguments[i] != "-n" && arguments[i] != "-d")
+            return CommandError::INVALID_ARGUMENT;
+        int number;
+        try
+        {
+            number = std::stoi(value);
+        }
+        catch (const std::exception &)
+        {
+            return CommandError::INVALID_ARGUMENT;
+        }
+        if (number < (arguments[i] == "-n" ? 1 : 0))
+            return CommandError::INVALID_ARGUMENT;
+        if (arguments[i] == "-n")
+            job->maxAttempts = number;
+        else
+            job->delay = std::chrono::milliseconds(number);
+    }
+    if (i == arguments.size())
         return CommandError::INVALID_ARGUMENT_NUMBER;
-    eraseLine();
-    printKill("killall");
-    for (auto pid : pids)
-        kill(pid, SIGKILL);
-    pids.clear();
+    job->command.assign(arguments.begin() + i, arguments.end());
+    LaunchSlot slot = reserveLaunch(job->command);
+    bool deferred = slot.start > std::chrono::steady_clock::now();
+    // Команда, которую нельзя даже запустить, не повторяется: ошибка exec сообщается сразу
+    pid_t pid = -1;
+    auto started = std::chrono::steady_clock::now();
+    if (!deferred)
+    {
+        CommandError e = launchProcess(job->command, pid, 0, -1, -1, 0, true);
+        if (e != CommandError::OK)
+            return e;
+    }
+    {
+        std::lock_guard<std::mutex> lock(retryMutex);
+        job->id = nextRetryId++;
+        job->pid = pid;
+        retryJobs[job->id] = job;
+    }
+    if (deferred)
+    {
+        commandOutput() << "[retry " << job->id << "] queued" << std::endl;
+        deferLaunch(slot, [job] { startRetryAttempt(job); });
+        return CommandError::OK;
+    }
+    commandOutput() << "[retry " << job->id << "] " << pid << std::endl;
+    if (!eventLoop().watchProcess(pid, [job, started](int status) { finishRetryAttempt(job, started, status); }))
+        finishRetryAttempt(job, started, waitJob(pid));
     return CommandError::OK;
 }
 
-CommandError niceCommand(const std::vector<std::string> &arguments)
+// Вызывается из потока цикла событий по таймеру паузы; ограничитель может отложить попытку ещё
+void launchRetryAttempt(const std::shared_ptr<RetryJob> &job)
 {
-    if (arguments.size() != 2)
-        return CommandError::INVALID_ARGUMENT_NUMBER;
-    int prio = std::stoi(arguments[0]);
-    std::string command = arguments[1];
-    createProcess({command}, prio);
-    return CommandError::OK;
+    LaunchSlot slot = reserveLaunch(job->command);
+    if (slot.start > std::chrono::steady_clock::now())
+        deferLaunch(slot, [job] { startRetryAttempt(job); });
+    else
+        startRetryAttempt(job);
 }
 
-CommandError showPids(const std::vector<std::string> &arguments)
+void startRetryAttempt(const std::shared_ptr<RetryJob> &job)
 {
-    if (arguments.size() != 0)
-        return CommandError::INVALID_ARGUMENT_NUMBER;
-    std::cout << "PIDS:\t";
-    for (auto pid : pids)
     {
-        std::cout << pid << '\t';
+        std::lock_guard<std::mutex> lock(retryMutex);
+        if (job->cancelled)
+            return;
     }
-    std::cout << std::endl;
-    return CommandError::OK; 
+    pid_t pid;
+    auto started = std::chrono::steady_clock::now();
+    if (launchProcess(job->command, pid, 0, -1, -1, 0, true) != CommandError::OK)
+    {
+        finishRetryAttempt(job, started, 127);
+        return;
+    }
+    bool cancelled;
+    {
+        std::lock_guard<std::mutex> lock(retryMutex);
+        job->pid = pid;
+        cancelled = job->cancelled;
+    }
+    if (cancelled)
+        killJobs({pid});
+    if (eventLoop().watchProcess(pid, [job, started](int status) { finishRetryAttempt(job, started, status); }))
+        return;
+    int status;
+    while (wait4(pid, &status, 0, nullptr) < 0 && errno == EINTR)
+        ;
+    finishRetryAttempt(job, started, WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
 }
 
-CommandError listDirContent(const std::vector<std::string> &arguments)
+void finishRetryAttempt(const std::shared_ptr<RetryJob> &job, std::chrono::steady_clock::time_point started, int status)
 {
-    if (arguments.size() != 0)
-        return CommandError::INVALID_ARGUMENT_NUMBER;
-    for (const auto &entry : std::filesystem::directory_iterator(std::filesystem::current_path()))
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    int attempt;
     {
-        std::string textColor = getTextColor(entry.status());
-        std::cout << textColor << entry.path().filename().string() << "\033[0m\t";
+        std::lock_guard<std::mutex> lock(retryMutex);
+        job->pid = -1;
+        if (job->cancelled)
+            return;
+        job->attempts.push_back({milliseconds, status});
+        attempt = static_cast<int>(job->attempts.size());
+        if (status == 0 || attempt == job->maxAttempts)
+            retryJobs.erase(job->id);
     }
-    std::cout << std::endl;
-    return CommandError::OK;
+    std::ostringstream report;
+    report << "[retry " << job->id << "] attempt " << attempt << '/' << job->maxAttempts
+        << "\texit " << status << '\t' << milliseconds << " ms\n";
+    bool last = status == 0 || attempt == job->maxAttempts;
+    if (last)
+    {
+        double total = 0;
+        for (const auto &previous : job->attempts)
+            total += previous.milliseconds;
+        report << "[retry " << job->id << "] " << (status == 0 ? "done" : "failed") << " after "
+            << attempt << " attempts\t" << total << " ms\n";
+    }
+    writeReport(report.str());
+    if (last)
+        return;
+    int shift = job->exponential ? std::min(attempt - 1, RETRY_MAX_BACKOFF_SHIFT) : 0;
+    eventLoop().addTimer(std::chrono::steady_clock::now() + job->delay * (1 << shift), [job] { launchRetryAttempt(job); });
 }
 
-std::string getTextColor(std::filesystem::file_status status)
+// Отчёты фоновых потоков уходят одним write под замком, мимо буфера std::cout главного потока
+void writeReport(std::string_view text)
 {
-    switch (status.type())
+    std::lock_guard<std::mutex> lock(reportMutex);
+    writeAll(STDOUT_FILENO, text.data(), text.size());
+}
+
+// Снимает все повторы; возвращает процессы попыток, которые сейчас выполняются
+std::vector<pid_t> cancelRetryJobs()
+{
+    std::lock_guard<std::mutex> lock(retryMutex);
+    std::vector<pid_t> running;
+    for (auto &[id, job] : retryJobs)
     {
-    case std::filesystem::file_type::regular:
-        return "";
-    case std::filesystem::file_type::directory:
-        return "\033[34m";
-    default:
-        return "\033[31m";
+        job->cancelled = true;
+        if (job->pid > 0)
+            running.push_back(job->pid);
     }
+    retryJobs.clear();
+    return running;
 }
 
-CommandError printFileContents(const std::vector<std::string> &arguments)
+// limit [CLASS RATE [BURST] | CLASS off]: класс запуска — имя программы. Без аргументов
+// выводит настроенные классы с числом отложенных запусков и задержкой запуска
+CommandError limitCommand(const std::vector<std::string> &arguments)
 {
-    if (arguments.size() != 1)
+    if (arguments.empty())
+    {
+        std::lock_guard<std::mutex> lock(rateMutex);
+        for (size_t i = 0; rateTable && i < RATE_MAX_CLASSES; ++i)
+        {
+            const RateClass &rateClass = rateTable[i];
+            if (!rateClass.active.load(std::memory_order_acquire))
+                continue;
+            uint64_t launched = rateClass.launched.load();
+            double average = launched ? rateClass.totalDelay.load() / 1e6 / launched : 0;
+            commandOutput() << rateClass.name << "\trate " << rateClass.rate << "/s\tburst " << rateClass.burst
+                << "\tqueued " << rateClass.queued.load() << "\tlaunched " << launched
+                << "\tdelay avg " << average << " ms\tmax " << rateClass.maxDelay.load() / 1e6 << " ms\n";
+        }
+        commandOutput().flush();
+        return CommandError::OK;
+    }
+    if (arguments.size() > 3)
         return CommandError::INVALID_ARGUMENT_NUMBER;
-    std::filesystem::path path(arguments[0]);
-    if (!std::filesystem::is_regular_file(path))
-        return CommandError::INVALID_FILE_PATH;
-    std::ifstream fin(path);
-    if (!fin)
-        return CommandError::INVALID_FILE_PATH;
-    eraseLine();
-    printKitten("cat " + arguments[0]);
-    std::cout << fin.rdbuf();
-    std::cout << std::endl;
+    std::lock_guard<std::mutex> lock(rateMutex);
+    RateClass *found = findRateClass(arguments[0]);
+    if (arguments.size() == 2 && arguments[1] == "off")
+    {
+        if (!found)
+            return fail(CommandError::INVALID_ARGUMENT, arguments[0], 0);
+        // Уже отложенные запуски выполнятся в зарезервированное время
+        found->active.store(false, std::memory_order_release);
+        return CommandError::OK;
+    }
+    if (arguments.size() == 1)
+        return CommandError::INVALID_ARGUMENT_NUMBER;
+    double rate, burst;
+    try
+    {
+        rate = std::stod(arguments[1]);
+        burst = arguments.size() == 3 ? std::stod(arguments[2]) : 1;
+    }
+    catch (const std::exception &)
+    {
+        return CommandError::INVALID_ARGUMENT;
+    }
+    if (!(rate > 0) || !(burst >= 1) || arguments[0].size() >= RATE_CLASS_NAME_SIZE)
+        return CommandError::INVALID_ARGUMENT;
+    if (!found)
+    {
+        RateClass *table = rateClasses();
+        if (!table)
+            return fail(CommandError::INVALID_ARGUMENT, arguments[0]);
+        for (size_t i = 0; i < RATE_MAX_CLASSES && !found; ++i)
+            if (!table[i].active.load(std::memory_order_acquire))
+                found = &table[i];
+        if (!found)
+            return fail(CommandError::INVALID_ARGUMENT, arguments[0], ENOSPC);
+        std::memcpy(found->name, arguments[0].c_str(), arguments[0].size() + 1);
+        found->arrival = 0;
+        found->launched = 0;
+        found->queued = 0;
+        found->totalDelay = 0;
+        found->maxDelay = 0;
+    }
+    // Смена скорости не трогает arrival: уже зарезервированные запуски остаются на своих местах
+    int64_t interval = static_cast<int64_t>(1e9 / rate);
+    found->rate = rate;
+    found->burst = burst;
+    found->interval = interval;
+    found->tolerance = static_cast<int64_t>((burst - 1) * interval);
+    found->active.store(true, std::memory_order_release);
     return CommandError::OK;
 }
 
-CommandError openNotepad(const std::vector<std::string> &arguments)
+// Таблица создаётся первым limit; дочерние term -s получают её дескриптор в состоянии
+RateClass *rateClasses()
 {
-    pid_t pid = fork();
-    int status;
-    if (pid == -1)
-        return CommandError::UNABLE_TO_OPEN_NOTEPAD;
-    if (pid == 0)
+    if (rateTable)
+        return rateTable;
+    size_t size = sizeof(RateClass) * RATE_MAX_CLASSES;
+    int fd = memfd_create("term-limits", MFD_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    void *table = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (table == MAP_FAILED)
     {
-        execlp("notepad.exe", "notepad.exe", NULL);
-        return CommandError::UNABLE_TO_OPEN_NOTEPAD;
+        close(fd);
+        return nullptr;
     }
-    else
+    rateTableFd = fd;
+    rateTable = static_cast<RateClass *>(table);
+    return rateTable;
+}
+
+RateClass *findRateClass(const std::string &program)
+{
+    if (!rateTable)
+        return nullptr;
+    std::string name = std::filesystem::path(program).filename().string();
+    for (size_t i = 0; i < RATE_MAX_CLASSES; ++i)
+        if (rateTable[i].active.load(std::memory_order_acquire) && name == rateTable[i].name)
+            return &rateTable[i];
+    return nullptr;
+}
+
+// Резервирует место в очереди класса программы и возвращает момент, с которого запуск разрешён.
+// Первые burst запусков подряд проходят сразу, дальше — по одному на interval
+LaunchSlot reserveLaunch(const std::vector<std::string> &tokens)
+{
+    LaunchSlot slot;
+    auto now = std::chrono::steady_clock::now();
+    slot.start = now;
+    slot.rateClass = tokens.empty() ? nullptr : findRateClass(tokens[0]);
+    if (!slot.rateClass)
+        return slot;
+    RateClass &rateClass = *slot.rateClass;
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    int64_t arrival = rateClass.arrival.load();
+    int64_t start;
+    do
     {
-        std::cout << "Opened notepad with PID:\t" << pid << std::endl;
-        pids.insert(pid);
+        start = std::max(nowNs, arrival - rateClass.tolerance.load());
+        slot.arrival = std::max(arrival, nowNs) + rateClass.interval.load();
+    } while (!rateClass.arrival.compare_exchange_weak(arrival, slot.arrival));
+    int64_t delay = start - nowNs;
+    slot.start = now + std::chrono::nanoseconds(delay);
+    ++rateClass.launched;
+    rateClass.totalDelay += delay;
+    int64_t longest = rateClass.maxDelay.load();
+    while (delay > longest && !rateClass.maxDelay.compare_exchange_weak(longest, delay))
+        ;
+    return slot;
+}
+
+// Возвращает место, если за ним ещё никто не встал; иначе следующие запуски просто сдвинутся
+void cancelReservation(const LaunchSlot &slot)
+{
+    if (!slot.rateClass)
+        return;
+    int64_t arrival = slot.arrival;
+    slot.rateClass->arrival.compare_exchange_strong(arrival, arrival - slot.rateClass->interval.load());
+}
+
+// Ждёт зарезервированного момента на переднем плане. У приглашения Ctrl-C снимает ожидание,
+// а не терминал: обработчик SIGINT видит launchWaiting и пишет в launchInterruptFd
+CommandError waitForLaunch(const LaunchSlot &slot)
+{
+    if (slot.start <= std::chrono::steady_clock::now())
+        return CommandError::OK;
+    launchWaiting = true;
+    bool interrupted = false;
+    for (auto now = std::chrono::steady_clock::now(); now < slot.start && !interrupted; now = std::chrono::steady_clock::now())
+    {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(slot.start - now).count();
+        // Отрицательный дескриптор poll пропускает, и ожидание без приглашения — просто сон
+        pollfd interrupt = {launchInterruptFd, POLLIN, 0};
+        interrupted = poll(&interrupt, 1, static_cast<int>(left)) > 0;
     }
-    return CommandError::OK;
+    launchWaiting = false;
+    // Сигнал мог прийти между последним poll и сбросом флага
+    uint64_t count;
+    if (launchInterruptFd >= 0 && read(launchInterruptFd, &count, sizeof(count)) == sizeof(count))
+        interrupted = true;
+    if (!interrupted)
+        return CommandError::OK;
+    cancelReservation(slot);
+    commandOutput() << std::endl;
+    return CommandError::LAUNCH_INTERRUPTED;
 }
 
-CommandError createProcesses(const std::vector<std::string> &tokens)
+// Отложенный фоновый запуск выполняет таймер цикла событий; killall снимает его через поколение
+void deferLaunch(const LaunchSlot &slot, std::function<void()> launch)
 {
-    std::vector<std::string> currentTokens;
-    CommandError e = CommandError::OK;
-    for (const auto &arg : tokens)
+    ++slot.rateClass->queued;
+    eventLoop().addTimer(slot.start, [rateClass = slot.rateClass, generation = launchGeneration.load(), launch = std::move(launch)]
     {
-        if (arg == "&&")
+        --rateClass->queued;
+        if (generation == launchGeneration)
+            launch();
+    });
+}
+
+// Фоновые задания, запущенные из цикла событий, переносятся в pids только главным потоком
+void adoptLaunchedJobs()
+{
+    std::lock_guard<std::mutex> lock(rateMutex);
+    pids.insert(launchedJobs.begin(), launchedJobs.end());
+    launchedJobs.clear();
+}
+
+// Снимает ожидающие фоновые запуски; их места в очереди классов не возвращаются
+void cancelQueuedLaunches()
+{
+    ++launchGeneration;
+}
+
+bool isRedirection(const std::string &token)
+{
+    return token == "<" || token == ">" || token == ">>" || token == "2>" || token == "<<" || token == "<<<";
+}
+
+bool extractRedirections(const std::vector<std::string> &tokens, std::vector<std::string> &arguments, std::vector<Redirection> &redirections)
+{
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        const std::string &token = tokens[i];
+        if (!isRedirection(token))
         {
-            e = createProcess(currentTokens);
-            currentTokens.clear();
+            arguments.push_back(token);
+            continue;
         }
+        // Пустой heredoc после подстановки теряет своё тело, остальным операторам нужен операнд
+        if (i + 1 == tokens.size() && token != "<<")
+            return false;
+        std::string target = i + 1 < tokens.size() ? tokens[++i] : "";
+        if (token == "<")
+            redirections.push_back({STDIN_FILENO, O_RDONLY, std::move(target)});
+        else if (token == ">")
+            redirections.push_back({STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, std::move(target)});
+        else if (token == ">>")
+            redirections.push_back({STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND, std::move(target)});
+        else if (token == "2>")
+            redirections.push_back({STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC, std::move(target)});
         else
-            currentTokens.emplace_back(arg);
-        if (e != CommandError::OK)
-            return e;
+            redirections.push_back({STDIN_FILENO, 0, token == "<<<" ? target + "\n" : std::move(target), true});
     }
-    e = createProcess(currentTokens);
-    return e;
+    return true;
 }
 
-CommandError createProcess(const std::vector<std::string> &tokens, int priority)
+// Данные heredoc лежат в запечатанном memfd: ребёнок получает обычный файл с seek,
+// а большой heredoc не упирается в ёмкость канала
+int openRedirection(const Redirection &redirection)
 {
-    pid_t pid;
-    int status;
-    char **argv = new char*[tokens.size() + 1];
-    tokensToArgv(tokens, argv);
-    pid = fork();
-    if (pid < 0)
-        return CommandError::FORK_ERROR;
-    if (pid == 0)
+    if (!redirection.inlineData)
+        return open(redirection.target.c_str(), redirection.flags | O_CLOEXEC, 0644);
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    const char *data = redirection.target.data();
+    size_t left = redirection.target.size();
+    while (left > 0)
     {
-        execvp(argv[0], argv);
-        return CommandError::INVALID_PROCESS_INPUT;
+        ssize_t n = write(fd, data, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        data += n;
+        left -= n;
     }
-    else
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+CommandError openRedirections(const std::vector<Redirection> &redirections, std::vector<int> &fds)
+{
+    for (const auto &redirection : redirections)
     {
-        pids.insert(pid);
-        setpriority(PRIO_PROCESS, pid, priority);
-        return CommandError::OK;
+        int fd = openRedirection(redirection);
+        if (fd < 0)
+        {
+            CommandError e = redirection.inlineData ? fail(CommandError::WRITE_ERROR, "heredoc") : fail(CommandError::INVALID_FILE_PATH, redirection.target);
+            for (int opened : fds)
+                close(opened);
+            fds.clear();
+            return e;
+        }
+        fds.push_back(fd);
     }
     return CommandError::OK;
 }
 
+CommandError runRedirectedBuiltin(const std::vector<std::string> &tokens)
+{
+    std::vector<std::string> arguments;
+    std::vector<Redirection> redirections;
+    std::vector<int> fds;
+    if (!extractRedirections(tokens, arguments, redirections) || arguments.empty())
+        return CommandError::SYNTAX_ERROR;
+    // Встроенные команды читают только именованные файлы, поэтому перенаправленный stdin отдаём внешней программе
+    if (!terminalCommands.contains(arguments[0]) || std::any_of(redirections.begin(), redirections.end(), [](const Redirection &r) { return r.fd == STDIN_FILENO; }))
+        return CommandError::UNKNOWN_COMMAND;
+    CommandError e = openRedirections(redirections, fds);
+    if (e != CommandError::OK)
+        return e;
+    commandOutput().flush();
+    std::vector<int> saved;
+    for (size_t i = 0; i < redirections.size(); ++i)
+    {
+        saved.push_back(fcntl(redirections[i].fd, F_DUPFD_CLOEXEC, 3));
+        dup2(fds[i], redirections[i].fd);
+        close(fds[i]);
+    }
+    int savedCapture = captureDepth;
+    std::ostream *savedOutput = currentOutput;
+    if (std::any_of(redirections.begin(), redirections.end(), [](const Redirection &r) { return r.fd == STDOUT_FILENO; }))
+    {
+        captureDepth = std::max(captureDepth, 1);
+        currentOutput = &std::cout;
+    }
+    e = executeCommand(arguments);
+    commandOutput().flush();
+    // Сообщение об ошибке встроенной команды уходит туда же, куда 2>, а не в приглашение
+    if (std::any_of(redirections.begin(), redirections.end(), [](const Redirection &r) { return r.fd == STDERR_FILENO; }))
+    {
+        FdBuffer sink(STDERR_FILENO);
+        std::ostream stream(&sink);
+        currentOutput = &stream;
+        reportError(e);
+        stream.flush();
+        lastError.reported = e != CommandError::OK && e != CommandError::CONDITION_FALSE;
+    }
+    captureDepth = savedCapture;
+    currentOutput = savedOutput;
+    for (size_t i = redirections.size(); i-- > 0;)
+    {
+        dup2(saved[i], redirections[i].fd);
+        close(saved[i]);
+    }
+    return e;
+}
+
+void readHeredocs(std::vector<std::string> &tokens)
+{
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (tokens[i].size() < 2 || tokens[i].compare(0, 2, "<<") != 0 || tokens[i] == "<<<")
+            continue;
+        std::string delimiter = tokens[i].substr(2);
+        if (delimiter.empty())
+        {
+            if (i + 1 == tokens.size())
+                return;
+            delimiter = tokens[i + 1];
+            tokens.erase(tokens.begin() + i + 1);
+        }
+        std::string body;
+        std::string line;
+        while (std::cout << "> " && std::getline(std::cin, line) && line != delimiter)
+            body.append(line).push_back('\n');
+        tokens[i] = "<<";
+        tokens.insert(tokens.begin() + i + 1, std::move(body));
+        ++i;
+    }
+}
+
 void tokensToArgv(const std::vector<std::string> &tokens, char **argv)
 {
     for (int i = 0; i < tokens.size(); ++i)
@@ -264,75 +6873,67 @@ void tokensToArgv(const std::vector<std::string> &tokens, char **argv)
 
 void eraseLine()
 {
-    std::cout << "\x1b[2K";
-    std::cout << "\x1b[1A";
+    if (captureDepth > 0)
+        return;
+    commandOutput() << "\x1b[2K";
+    commandOutput() << "\x1b[1A";
 }
 
 void printKitten(std::string command)
 {
-    std::cout << "\033[36m･ω･\033[0m " << command << std::endl;
+    if (captureDepth > 0)
+        return;
+    commandOutput() << "\033[36m･ω･\033[0m " << command << std::endl;
 }
 
 void printKill(std::string command)
 {
-    std::cout << "\033[31m🜏🜏🜏 " << command << "\033[0m" << std::endl;
+    if (captureDepth > 0)
+        return;
+    commandOutput() << "\033[31m🜏🜏🜏 " << command << "\033[0m" << std::endl;
 }
 
-std::string getErrorMessage(CommandError e)
+std::string_view getErrorMessage(CommandError e)
 {
-    switch (e)
-    {
-    case CommandError::INVALID_ARGUMENT_NUMBER:
-        return "Неверное число аргументов";
-        break;
-    case CommandError::INVALID_FILE_PATH:
-        return "Файл не найден";
-        break;
-    case CommandError::UNABLE_TO_OPEN_NOTEPAD:
-        return "Не получилось открыть блокнот";
-        break;
-    case CommandError::FORK_ERROR:
-        return "Ошибка создания процесса";
-        break;
-    case CommandError::INVALID_PROCESS_INPUT:
-        return "Неверное имя при создании процесса";
-        break;
-    case CommandError::INVALID_PID:
-        return "Неверный PID";
-        break;
-    }
-    return "";
+    return errorMessages[static_cast<size_t>(e)];
 }
 
 void closeTerminal(int sig)
 {
+    if (sig == SIGINT && launchWaiting)
+    {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t woken = write(launchInterruptFd, &one, sizeof(one));
+        return;
+    }
+    restoreTerminalMode();
     killAllCommand({});
     struct winsize w;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
 
-    std::cout << "\033[31m";
-    std::cout << std::endl;
+    commandOutput() << "\033[31m";
+    commandOutput() << std::endl;
     for (int i = 0; i < w.ws_row / 2; ++i)
     {
         for (int j = 0; j < w.ws_col / 2; ++j)
-            std::cout << "🜏 ";
-        std::cout << std::endl << std::endl;
+            commandOutput() << "🜏 ";
+        commandOutput() << std::endl << std::endl;
     }
     const std::vector<std::string> goodbye = {"FUN BUG FACT:", "ONE DAY YOU'LL HAVE TO ANSWER FOR YOUR SINS", "AND GOD MAY NOT BE SO", "M E R C I F U L"};
     for (int i = 0; i < goodbye.size(); ++i)
     {
         for (int j = 0; j < w.ws_col / 2 - goodbye[i].size() / 2; ++j)
-            std::cout << ' ';
-        std::cout << goodbye[i] << std::endl;
+            commandOutput() << ' ';
+        commandOutput() << goodbye[i] << std::endl;
         sleep(2);
     }
     for (int i = 0; i < w.ws_row / 4 - 1; ++i)
     {
         for (int j = 0; j < w.ws_col / 2; ++j)
-            std::cout << "🜏 ";
-        std::cout << std::endl << std::endl;
+            commandOutput() << "🜏 ";
+        commandOutput() << std::endl << std::endl;
     }
     sleep(2);
-    std::cout << "\033[0m" << std::endl;
+    commandOutput() << "\033[0m" << std::endl;
     exit(666);
 }
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Тренировочная нагрузка PGO и замер по разделам: разбор, VM (циклы, функции, alias), sort,
+# sum, count и интерактивный сеанс workload.term. Данные создаются во временном каталоге
+# Запуск: train.sh ПУТЬ_К_TERM
+term="$1"
+pgo=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+awk 'BEGIN {
+    srand(51)
+    for (i = 0; i < 1000000; i++) {
+        r = rand()
+        if (r < 0.3) printf "/usr/share/doc/pkg%d/file%d.txt\n", int(rand() * 5000), int(rand() * 100000)
+        else if (r < 0.6) printf "%s %d request %d\n", rand() < 0.5 ? "INFO" : "WARN", int(rand() * 1000), int(rand() * 100000)
+        else printf "%d\n", int(rand() * 1000000000)
+    }
+}' > lines
+# Частоты слов убывают как у текста: немногие слова встречаются часто
+awk 'BEGIN {
+    srand(52)
+    for (i = 0; i < 2000000; i++)
+        printf "w%d\n", int(50000 / (1 + rand() * 4999))
+}' > words
+head -c 67108864 /dev/urandom > blob
+cp "$pgo"/../CMakeLists.txt "$pgo"/../main.cpp .
+# Разбор: много разных строк, каждая компилируется заново
+awk 'BEGIN {
+    srand(53)
+    for (i = 0; i < 20000; i++) {
+        r = rand()
+        if (r < 0.25) printf "v%d=%d && w%d=${v%d}x\n", i % 97, i, i % 89, i % 97
+        else if (r < 0.5) printf "if test %d = %d; then t=yes; elif [ %d = 7 ]; then t=no; else t=other; fi\n", i % 13, i % 7, i % 11
+        else if (r < 0.75) printf "case item%d in *1) k=one;; item2*) k=two;; *) k=rest;; esac\n", i
+        else printf "for f in a%d b%d c%d; do last=$f; done && true && false || true\n", i, i, i
+    }
+}' > parse.term
+
+ms() { echo $(($(date +%s%N) / 1000000)); }
+for workload in parse.term "$pgo"/*.term; do
+    start=$(ms)
+    "$term" < "$workload" > /dev/null 2>&1
+    printf '%s\t%d ms\n' "$(basename "$workload" .term)" $(($(ms) - start))
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# killall и cgroup: cgroup.kill — только для cgroup, созданных терминалом; потомок, ушедший
+# из группы процессов, погибает вместе с заданием, а соседи по чужой cgroup остаются живы
+# Запуск: cgroup.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+root=/sys/fs/cgroup
+[ -e $root/cgroup.procs ] || root=/sys/fs/cgroup/unified
+self=$(sed -n 's/^0:://p' /proc/self/cgroup)
+foreign="$root${self%/}/term-test-$$"
+cleanup() {
+    for pid in $(cat escaped neighbour 2>/dev/null); do kill -9 "$pid" 2>/dev/null; done
+    for attempt in 1 2 3 4 5 6 7 8 9 10; do
+        rmdir "$foreign" 2>/dev/null || [ -e "$foreign" ] || break
+        sleep 0.1
+    done
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+if [ ! -e $root/cgroup.procs ] || ! mkdir "$foreign" 2>/dev/null; then
+    echo "cgroup v2 недоступна для записи, проверка пропущена"
+    exit 0
+fi
+status=0
+alive() { [ -e "/proc/$1" ] && [ "$(cut -d' ' -f3 "/proc/$1/stat")" != Z ]; }
+session() { { echo "$1"; sleep 0.5; echo killall; sleep 0.5; } | timeout 10 "$term" > out 2>&1; }
+
+# Промежуточная оболочка завершается, и потомок уходит к init: по дереву /proc его уже не найти
+printf '#!/bin/sh\n(setsid /bin/sleep 300 & echo $! > escaped)\nexec /bin/sleep 300\n' > escape.sh
+chmod +x escape.sh
+session './escape.sh &'
+alive "$(cat escaped)" && { echo "потомок вне группы процессов пережил killall"; status=1; }
+
+# Задание само переходит в чужую cgroup; её сосед не принадлежит терминалу
+/bin/sleep 300 &
+echo $! > neighbour
+echo "$(cat neighbour)" > "$foreign/cgroup.procs"
+printf '#!/bin/sh\necho $$ > %s/cgroup.procs\nexec /bin/sleep 300\n' "$foreign" > move.sh
+chmod +x move.sh
+session './move.sh &'
+alive "$(cat neighbour)" || { echo "killall убил процесс из чужой cgroup"; status=1; }
+[ -z "$(ls -d "$root${self%/}"/term-[0-9]* 2>/dev/null)" ] || { echo "остались cgroup заданий"; status=1; }
+exit $status
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Регрессии cp: копия файла на самого себя и каталога внутрь самого себя
+# Запуск: copy.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+# Старая копия каталога в самого себя не завершалась, поэтому каждый запуск ограничен по времени
+run() { timeout 10 "$term" -c "$1" >/dev/null 2>&1; }
+
+printf 'hello\n' > a
+ln a link
+run "cp a a" && { echo "cp a a: ожидалась ошибка"; status=1; }
+run "cp a link" && { echo "cp a link: ожидалась ошибка"; status=1; }
+[ "$(cat a)" = hello ] || { echo "cp a a: источник испорчен"; status=1; }
+
+mkdir -p d/sub
+printf 'x\n' > d/sub/f
+run "cp -r d d/sub/copy" && { echo "cp -r d d/sub/copy: ожидалась ошибка"; status=1; }
+run "cp -r d d" && { echo "cp -r d d: ожидалась ошибка"; status=1; }
+[ ! -e d/sub/copy ] && [ ! -e d/d ] || { echo "cp -r: создана копия внутри источника"; status=1; }
+
+run "cp -r d e" || { echo "cp -r d e: копия не удалась"; status=1; }
+[ "$(cat e/sub/f)" = x ] || { echo "cp -r d e: содержимое не совпадает"; status=1; }
+exit $status
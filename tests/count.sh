@@ -0,0 +1,43 @@
+#!/bin/sh
+# count: частоты строк по убыванию, равные частоты по байтовому порядку строк, как
+# sort | uniq -c | sort при LC_ALL=C; -k, несколько файлов и сжатый вход
+# Запуск: count.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+tab=$(printf '\t')
+expected() {
+    cat "$@" | LC_ALL=C sort | LC_ALL=C uniq -c | sed 's/^ *\([0-9]*\) /\1\t/' | LC_ALL=C sort -t "$tab" -k1,1nr -k2
+}
+check() {
+    timeout 60 "$term" -c "count $1" > got 2>&1
+    cmp -s expected got || { echo "count $1: расхождение: $(diff expected got | head -5)"; status=1; }
+}
+
+# Частые слова, почти уникальные пути с общим префиксом, пустые строки, пробелы в начале
+awk 'BEGIN {
+    srand(57)
+    for (i = 0; i < 300000; i++) {
+        r = rand()
+        if (r < 0.5) printf "w%d\n", int(5000 / (1 + rand() * 4999))
+        else if (r < 0.8) printf "/usr/share/doc/pkg%d/file%d.txt\n", int(rand() * 500), int(rand() * 100000)
+        else if (r < 0.85) printf "\n"
+        else printf "  %d\n", int(rand() * 100)
+    }
+}' > a
+printf 'w1\nw2\nlast' > b
+expected a > expected
+check "a"
+expected a | head -3 > expected
+check "-k 3 a"
+printf 'w1\nw2\nlast\n' | cat a - > ab
+expected ab > expected
+check "a b"
+if command -v gzip > /dev/null; then
+    gzip -k a
+    expected a > expected
+    check "a.gz"
+fi
+exit $status
@@ -0,0 +1,72 @@
+#!/bin/sh
+# dag: зависимости выполняются раньше цели, -j запускает независимые правила параллельно,
+# актуальные цели пропускаются по временам изменения и по хешам с -c, цикл — синтаксическая ошибка
+# Запуск: dag.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+ms() { echo $(($(date +%s%N) / 1000000)); }
+run() { out=$(timeout 20 "$term" -c "$1" 2>&1); code=$?; }
+
+printf 'all: b c\n    /bin/echo all >> log\nb: a\n    /bin/echo b >> log\nc: a\n    /bin/echo c >> log\na:\n    /bin/echo a >> log\n' > order
+run "dag -j 1 order"
+[ "$code" = 0 ] || { echo "порядок: код $code: $out"; status=1; }
+[ "$(head -1 log)" = a ] && [ "$(tail -1 log)" = all ] && [ "$(wc -l < log)" = 4 ] || { echo "порядок: $(cat log)"; status=1; }
+[ "$(printf '%s\n' "$out" | grep -Ec '^\[dag\] (a|b|c|all)	[0-9.e-]+ s$')" = 4 ] || { echo "отчёт: '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q '^\[dag\] critical path: a -> [bc] -> all	' || { echo "критический путь: '$out'"; status=1; }
+rm log
+run "dag order c"
+[ "$(cat log | tr '\n' ' ')" = "a c " ] || { echo "цель c: $(cat log)"; status=1; }
+run "dag order nothing"
+[ "$code" = 1 ] || { echo "неизвестная цель: код $code"; status=1; }
+
+# Два правила по 0.5 с: при -j 2 вместе меньше секунды, при -j 1 не меньше
+printf 'all: x y\nx:\n    /bin/sleep 0.5\ny:\n    /bin/sleep 0.5\n' > par
+start=$(ms); run "dag -j 2 par"; took=$(($(ms) - start))
+[ "$took" -lt 950 ] || { echo "-j 2: $took мс"; status=1; }
+start=$(ms); run "dag -j 1 par"; took=$(($(ms) - start))
+[ "$took" -ge 1000 ] || { echo "-j 1: $took мс"; status=1; }
+
+# Цель новее входа не пересобирается, после правки входа пересобирается вместе с зависимыми
+printf 'in\n' > in
+printf 'final: out\n    /bin/cp out final\nout: in\n    /bin/cp in out\n' > files
+run "dag files"
+[ "$(cat final)" = in ] || { echo "сборка: $out"; status=1; }
+run "dag files"
+printf '%s\n' "$out" | grep -q '^\[dag\] ' && { echo "актуальные цели пересобраны: '$out'"; status=1; }
+sleep 0.01
+printf 'in2\n' > in
+run "dag files"
+[ "$(cat final)" = in2 ] && [ "$(printf '%s\n' "$out" | grep -c '^\[dag\] \(out\|final\)	')" = 2 ] || { echo "пересборка: '$out'"; status=1; }
+
+# С -c важно содержимое: touch не пересобирает, смена содержимого и команд пересобирает
+rm -f out final
+run "dag -c files"
+[ -s files.state ] && [ "$(cat final)" = in2 ] || { echo "-c: '$out'"; status=1; }
+touch in
+run "dag -c files"
+printf '%s\n' "$out" | grep -q '^\[dag\] ' && { echo "-c после touch: '$out'"; status=1; }
+printf 'in3\n' > in
+run "dag -c files"
+[ "$(cat final)" = in3 ] || { echo "-c после правки: '$out'"; status=1; }
+printf 'final: out\n    /bin/cp out final\nout: in\n    /bin/cp in out\n    /bin/echo more >> out\n' > files
+run "dag -c files"
+[ "$(tail -1 final)" = more ] || { echo "-c после смены команд: '$out'"; status=1; }
+
+# Упавшее правило останавливает зависимые и помечается в отчёте
+printf '#!/bin/sh\nexit 3\n' > three
+chmod +x three
+printf 'all: bad\n    /bin/echo all > reached\nbad:\n    ./three\n' > failing
+run "dag failing"
+[ "$code" = 1 ] && [ ! -e reached ] || { echo "сбой: код $code, '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q '^\[dag\] bad	.* s	failed$' || { echo "сбой: '$out'"; status=1; }
+
+printf 'a: b\n    /bin/echo a\nb: a\n    /bin/echo b\n' > cycle
+run "dag cycle"
+[ "$code" = 2 ] || { echo "цикл: код $code, '$out'"; status=1; }
+printf '    /bin/echo orphan\n' > orphan
+run "dag orphan"
+[ "$code" = 2 ] || { echo "команда без правила: код $code, '$out'"; status=1; }
+exit $status
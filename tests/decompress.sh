@@ -0,0 +1,50 @@
+#!/bin/sh
+# Распаковка gzip и zstd: совпадение с исходником, оборванный файл и кадр с ложным размером
+# Запуск: decompress.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+seq 1 200000 > plain
+expected=$("$term" -c "wc plain" | cut -f1-3)
+same() {
+    got=$(timeout 20 "$term" -c "wc $1" 2>&1 | cut -f1-3)
+    [ "$got" = "$2" ] || { echo "wc $1: '$got' вместо '$2'"; status=1; }
+}
+truncated() {
+    out=$(timeout 20 "$term" -c "wc $1" 2>&1) && { echo "wc $1: оборванный файл принят"; status=1; }
+    printf '%s\n' "$out" | grep -q "Сжатый файл обрывается: $1" || { echo "wc $1: нет ошибки обрыва: $out"; status=1; }
+}
+
+gzip -c plain > plain.gz
+(gzip -c plain; gzip -c plain) > twice.gz
+head -c 300000 plain.gz > cut.gz
+same plain.gz "$expected"
+cat plain plain > both
+doubled=$("$term" -c "wc both" | cut -f1-3)
+same twice.gz "$doubled"
+truncated cut.gz
+
+if ! command -v zstd >/dev/null 2>&1; then
+    echo "zstd не найден, проверки zstd пропущены"
+    exit $status
+fi
+zstd -q -c plain > plain.zst
+if [ "$(timeout 20 "$term" -c "wc plain.zst" 2>&1 | cut -f1-3)" != "$expected" ]; then
+    echo "term собран без zstd, проверки zstd пропущены"
+    exit $status
+fi
+(zstd -q -c plain; zstd -q -c plain) > twice.zst
+head -c 100000 plain.zst > cut.zst
+head -c $(($(wc -c < twice.zst) - 1000)) twice.zst > cutframes.zst
+same twice.zst "$doubled"
+truncated cut.zst
+truncated cutframes.zst
+# Кадр объявляет 2^50 байт; распаковщик не должен выделять их заранее и падать
+printf 'x\n' | zstd -q -c > huge.zst
+printf '\050\265\057\375\340\000\000\000\000\000\000\004\000\001\000\000' >> huge.zst
+timeout 20 "$term" -c "wc huge.zst" > out 2>&1
+code=$?
+[ "$code" = 1 ] || { echo "wc huge.zst: код $code вместо 1: $(cat out)"; status=1; }
+exit $status
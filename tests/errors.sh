@@ -0,0 +1,41 @@
+#!/bin/sh
+# Ошибки запуска: код 127 и errno из дочернего процесса, однократный вывод ошибок скрипта
+# и целостность записи ошибки при одновременных сбоях рабочих потоков
+# Запуск: errors.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+check() {
+    out=$(timeout 10 "$term" -c "$1" 2>&1)
+    code=$?
+    [ "$code" = "$2" ] || { echo "$1: код $code вместо $2"; status=1; }
+    count=$(printf '%s\n' "$out" | grep -c "$3")
+    [ "$count" = "$4" ] || { echo "$1: '$3' выведено $count раз вместо $4: $out"; status=1; }
+}
+
+printf 'echo\n' > noexec
+check 'no_such_command_here' 127 'no_such_command_here (No such file or directory)' 1
+check './noexec' 127 './noexec (Permission denied)' 1
+check 'for i in 1 2; do ./noexec; done' 127 'Permission denied' 2
+check 'if ./noexec; then echo y; fi' 127 'Permission denied' 1
+check 'true && function f for i in 1; do ./noexec; done && f && echo after' 127 'Permission denied' 1
+check 'true && function f for i in 1; do ./noexec; done && f && echo after' 127 'after' 0
+# Ошибка подстановки внутри цикла сама статус не выставляет: его задаёт скрипт
+check 'true && function r r && function g for i in 1; do r; done && g' 1 'Слишком глубокая подстановка' 1
+
+# Копии идут в рабочих потоках и упираются в лимит дескрипторов одновременно; в выводе
+# должна быть одна целая запись: путь одного файла и его errno
+mkdir src
+i=0
+while [ $i -lt 300 ]; do echo $i > src/f$i; i=$((i + 1)); done
+for n in 6 7 8; do
+    out=$(ulimit -n $n; timeout 20 "$term" -c 'cp -r src dst' 2>&1)
+    if [ -n "$out" ] && ! printf '%s\n' "$out" | grep -Eq ': dst/f[0-9]+ \(Too many open files\)'; then
+        echo "ulimit -n $n: испорченная запись ошибки: $out"
+        status=1
+    fi
+    rm -rf dst
+done
+exit $status
@@ -0,0 +1,20 @@
+#!/bin/sh
+# hexdump: смещение и длина десятичные, шестнадцатеричные только с явным 0x
+# Запуск: hexdump.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+printf '0123456789abcdefghijklmnopqrstuvwxyz' > f
+check() {
+    out=$(timeout 10 "$term" -c "hexdump $1 f" 2>&1)
+    [ "$out" = "$2" ] || { echo "hexdump $1: '$out'"; status=1; }
+}
+check "-s 010 -n 4" "0000000a  61 62 63 64                                       |abcd|"
+check "-s 08 -n 2" "00000008  38 39                                             |89|"
+check "-s 0x10 -n 4" "00000010  67 68 69 6a                                       |ghij|"
+for bad in "-s 0x -n 4" "-s 0x1g -n 4" "-s 0b1 -n 4" "-n -1" "-n +1"; do
+    timeout 10 "$term" -c "hexdump $bad f" > /dev/null 2>&1 && { echo "hexdump $bad: принят"; status=1; }
+done
+exit $status
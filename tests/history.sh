@@ -0,0 +1,61 @@
+#!/bin/sh
+# История: повреждённая таблица частоты не подвешивает терминал и заводится заново,
+# history -s и -f находят записи, Ctrl-R ищет подстроку в строке приглашения
+# Запуск: history.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+export TERM_HISTORY="$dir/h"
+
+session() {
+    printf '%s\n' "$@" | timeout 10 "$term" 2>&1 | sed 's/^.*☿ .\[0m//'
+}
+
+# Заголовок TERMFRQ\1, затем slots и used по 8 байт и слоты по 24 байта
+frecency() {
+    printf "TERMFRQ\001\\$1\000\000\000\000\000\000\000\\$2\000\000\000\000\000\000\000" > h.freq
+    i=0
+    while [ $i -lt "$3" ]; do
+        printf '\003\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\001\000\000\000\000\000\000\000' >> h.freq
+        i=$((i + 1))
+    done
+}
+check() {
+    rm -f h h.idx
+    out=$(session "echo hi" "history -f")
+    printf '%s\n' "$out" | grep -q "^1	[0-9.]*	echo hi$" || { echo "$1: '$out'"; status=1; }
+}
+frecency 004 004 4
+check "заполненная таблица"
+frecency 004 001 4
+check "заполненная вопреки used"
+frecency 003 000 3
+check "не степень двойки"
+frecency 200 000 1
+check "слотов больше файла"
+
+rm -f h h.idx h.freq
+out=$(session "echo alpha" "echo beta" "echo alpha" "history -s alp" "history -f 1")
+printf '%s\n' "$out" | grep -q "^3	echo alpha$" || { echo "history -s: '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q "^1	echo alpha$" || { echo "history -s: '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q "^2	[0-9.]*	echo alpha$" || { echo "history -f: '$out'"; status=1; }
+
+# Ctrl-R нужен терминал: script выдаёт псевдотерминал
+if script -qec true /dev/null > /dev/null 2>&1; then
+    { sleep 0.5; printf '\022bet\r'; sleep 0.5; printf '\022alp\022\022\r'; sleep 0.5; printf 'x\022zzz\007\r'; sleep 0.5; printf '\004'; } |
+        timeout 10 script -qec "$term" /dev/null > out 2>&1
+    tail -3 h > last
+    printf 'echo beta\necho alpha\nx\n' | cmp -s - last || { echo "Ctrl-R: $(cat last)"; status=1; }
+fi
+
+# Триграммы запроса есть в записи 1, но не подряд; индекс достраивается записями этого же сеанса
+rm -f h h.idx h.freq
+out=$(session "echo xbca cabx" "echo bcab1" "history -s bcab" "echo bcab2" "history -s bcab")
+[ "$(printf '%s\n' "$out" | grep -c '	echo bcab1$')" = 2 ] || { echo "индекс: '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q '^4	echo bcab2$' || { echo "индекс: '$out'"; status=1; }
+printf '%s\n' "$out" | grep -q '	echo xbca' && { echo "ложное совпадение: '$out'"; status=1; }
+out=$(session "history -s ca")
+printf '%s\n' "$out" | grep -q '^1	echo xbca cabx$' || { echo "короткий запрос: '$out'"; status=1; }
+exit $status
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Чтение файлов через io_uring и через pread (TERM_NO_IO_URING) даёт одинаковый вывод
+# встроенных команд на границах блока в 128 КиБ, на пустых, многоблочных и /proc файлах;
+# недочитанный файл не отдаёт свои блоки следующему чтению того же потока
+# Запуск: io.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+both() {
+    timeout 20 "$term" -c "$1" > uring 2>&1
+    TERM_NO_IO_URING=1 timeout 20 "$term" -c "$1" > pread 2>&1
+    cmp -s uring pread || { echo "$1: io_uring и pread расходятся"; status=1; }
+}
+expect() {
+    cmp -s uring "$2" || { echo "$1: $(head -c 200 uring)"; status=1; }
+}
+
+head -c 6000000 /dev/urandom | base64 -w 75 > text
+: > empty
+printf 'A' > one
+for size in 131071 131072 131073 524288 600001; do head -c $size text > "s$size"; done
+cp text lines
+for f in empty one s131071 s131072 s131073 s524288 s600001 lines; do
+    both "cat $f > out"
+    { cat $f; echo; } > expected
+    cmp -s out expected || { echo "cat $f: $(head -c 200 out)"; status=1; }
+    both "wc $f"
+    printf '%s\t%s\t%s\t%s\n' $(wc -l < $f) $(wc -w < $f) $(wc -c < $f) $f > expected
+    expect "wc $f" expected
+    both "head -n 3 $f"
+    both "tail -n 3 $f"
+    both "grep Ab $f"
+    both "sum -a xxh3 $f"
+done
+for f in s131073 s600001 lines; do
+    both "hexdump -s 131000 -n 600 $f"
+done
+both "grep Ab lines"
+grep -F Ab lines > expected
+expect "grep Ab lines" expected
+both "tail -n 1000 lines"
+tail -n 1000 lines > expected
+expect "tail -n 1000 lines" expected
+for f in /proc/version /proc/filesystems; do
+    both "cat $f > out"
+    { cat $f; echo; } > expected
+    cmp -s out expected || { echo "cat $f: $(head -c 200 out)"; status=1; }
+done
+
+# head останавливается на первом блоке из четырёх в полёте; следующий файл читается целиком
+both "head -n 1 lines > first && cat s600001 > out && wc lines"
+{ cat s600001; echo; } > expected
+cmp -s out expected || { echo "чтение после head: $(head -c 200 out)"; status=1; }
+[ "$(cat first)" = "$(head -n 1 lines)" ] || { echo "head -n 1: $(cat first)"; status=1; }
+exit $status
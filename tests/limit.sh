@@ -0,0 +1,40 @@
+#!/bin/sh
+# Ограничитель запусков: конвейеры, правила dag и отложенные фоновые запуски делят жетоны
+# одного класса; ожидание у приглашения снимается Ctrl-C
+# Запуск: limit.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# Четыре запуска при 4/с без запаса: последний не раньше чем через 0.75 с
+elapsed() {
+    start=$(ms)
+    out=$(timeout 20 "$term" -c "$1" 2>&1)
+    echo $(($(ms) - start))
+}
+check() {
+    took=$(elapsed "$2")
+    [ "$took" -ge 700 ] || { echo "$1: $took мс, ограничитель не сработал"; status=1; }
+}
+check "передний план" "limit echo 4 && /bin/echo a && /bin/echo b && /bin/echo c && /bin/echo d"
+check "конвейеры" "limit echo 4 && /bin/echo a | /bin/cat && /bin/echo b | /bin/cat && /bin/echo c | /bin/cat && /bin/echo d | /bin/cat"
+printf 'all: one two\n    /bin/echo all\none:\n    /bin/echo one\ntwo:\n    /bin/echo two\n    /bin/echo three\n' > Dagfile
+check "dag" "limit echo 4 && dag Dagfile all"
+
+# Отложенный фоновый запуск ещё не выполнялся: его код отличается от нуля
+out=$(timeout 10 "$term" -c 'limit sleep 1 && /bin/sleep 0 & && echo $? && /bin/sleep 0 & && echo $?' 2>&1 | tr '\n' ' ')
+[ "$out" = "0 75 " ] || { echo "фоновые запуски: '$out'"; status=1; }
+
+# Ctrl-C снимает ожидание запуска, а не терминал
+{ echo "limit sleep 0.1"; echo "/bin/sleep 0"; echo "/bin/sleep 0"; echo 'echo code $?'; sleep 3; echo "killall"; } |
+    env --default-signal=INT "$term" > out 2>&1 &
+sleep 1
+pid=$(pgrep -n -f "^$term\$")
+[ -n "$pid" ] && kill -INT "$pid"
+wait
+grep -q "code 130" out || { echo "Ctrl-C: $(cat out)"; status=1; }
+grep -q "M E R C I F U L" out && { echo "Ctrl-C закрыл терминал"; status=1; }
+exit $status
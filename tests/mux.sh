@@ -0,0 +1,18 @@
+#!/bin/sh
+# Мультиплексор вывода: задания переднего плана пишут напрямую и по порядку,
+# фоновые — через цикл событий с префиксом pid
+# Запуск: mux.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+i=0
+while [ $i -lt 20 ]; do
+    out=$(timeout 10 "$term" -c 'mux on && /bin/echo one && echo two && /bin/echo three && /bin/echo four' 2>&1 | tr '\n' ' ')
+    [ "$out" = "one two three four " ] || { echo "передний план: '$out'"; status=1; break; }
+    i=$((i + 1))
+done
+out=$(timeout 10 "$term" -c 'mux on && /bin/echo bg & && /bin/sleep 0.5' 2>&1)
+printf '%s\n' "$out" | grep -Eq '\[[0-9]+\].* bg$' || { echo "фоновое задание: '$out'"; status=1; }
+exit $status
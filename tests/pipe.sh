@@ -0,0 +1,44 @@
+#!/bin/sh
+# Конвейеры: встроенная первая стадия пишет в канал из потока терминала, дальние стадии
+# запускаются внешними программами; PIPESTATUS и код последней стадии, ранний выход читателя
+# Запуск: pipe.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+ms() { echo $(($(date +%s%N) / 1000000)); }
+session() { printf '%s\n' "$@" | timeout 20 "$term" 2>&1 | sed 's/^.*☿ .\[0m//'; }
+check() {
+    out=$(timeout 20 "$term" -c "$1" 2>&1)
+    [ "$out" = "$2" ] || { echo "$1: '$out' вместо '$2'"; status=1; }
+}
+
+awk 'BEGIN { for (i = 0; i < 200000; ++i) printf "line %d %s\n", i, (i % 7 ? "odd" : "seven") }' > big
+printf 'b\na\nc\na\n' > f
+check "head -n 10 f | /usr/bin/wc -l" 4
+check "/bin/echo a | /bin/cat | /bin/cat" a
+check "/bin/echo b | cat" b
+check "grep a f | /usr/bin/sort | /usr/bin/uniq -c | /bin/cat" "      2 a"
+# Вывод больше ёмкости канала: читатель запущен раньше потока встроенной стадии
+check "head -n 200000 big | /usr/bin/md5sum" "$(md5sum < big)"
+check "grep seven big | /usr/bin/wc -l" "$(grep -c seven big)"
+
+# Читатель выходит после первой строки: встроенная стадия получает EPIPE, терминал живёт
+# дальше, и функция в первой стадии выполняется дочерним term
+start=$(ms)
+out=$(session "cat big big big big | /usr/bin/head -n 1" "function f /bin/echo fn" "f | /bin/cat")
+took=$(($(ms) - start))
+[ "$(printf '%s\n' "$out" | grep -v '^$' | tr '\n' ' ')" = "line 0 seven fn " ] || { echo "ранний выход читателя: '$out'"; status=1; }
+[ "$took" -lt 5000 ] || { echo "ранний выход читателя: $took мс"; status=1; }
+
+out=$(session "/bin/false | /bin/true" 'echo $? $PIPESTATUS' "/bin/true | /bin/false" 'echo $? $PIPESTATUS' \
+    "cat missing | /bin/cat" 'echo $? $PIPESTATUS' | grep '^[0-9]')
+[ "$(printf '%s\n' "$out" | tr '\n' ' ')" = "0 1 0 1 0 1 0 1 0 " ] || { echo "PIPESTATUS: '$out'"; status=1; }
+
+for line in "| /bin/cat" "/bin/echo a |" "/bin/echo a | | /bin/cat"; do
+    timeout 10 "$term" -c "$line" > /dev/null 2>&1
+    code=$?
+    [ "$code" = 2 ] || { echo "$line: код $code вместо 2"; status=1; }
+done
+exit $status
@@ -0,0 +1,35 @@
+#!/bin/sh
+# record и replay: запись строк с выводом и статусом, повтор без расхождений, расхождение
+# после смены файла; потомок, ушедший в фон с выводом строки, не держит приглашение
+# Запуск: record.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+ms() { echo $(($(date +%s%N) / 1000000)); }
+session() { printf '%s\n' "$@" | timeout 20 "$term" 2>&1 | sed 's/^.*☿ .\[0m//'; }
+
+printf 'first\nsecond\n' > f
+out=$(session "record log" "echo a && /bin/echo b && echo c" "cat f" "/bin/false" "record" "replay log")
+printf '%s\n' "$out" | grep -q '^REPLAY:	3 commands	.*	0 status diffs	0 output diffs$' || { echo "повтор: '$out'"; status=1; }
+[ "$(printf '%s\n' "$out" | grep -c '^[abc]$')" = 6 ] || { echo "порядок вывода: '$out'"; status=1; }
+printf '%s\n' "$out" | tr '\n' ' ' | grep -q 'a b c .*a b c ' || { echo "порядок вывода: '$out'"; status=1; }
+
+printf 'changed\n' > f
+out=$(session "replay log 1")
+printf '%s\n' "$out" | grep -q '^REPLAY:	2 commands	.*	0 status diffs	1 output diffs$' || { echo "расхождение: '$out'"; status=1; }
+
+# Повтор внутри перехвата: вывод повторённых команд попадает в перехват, а не мимо него
+out=$(session 'x=$(replay log 0 1) && echo [$x]' | tr '\n' ' ')
+printf '%s\n' "$out" | grep -q '^\[a b c REPLAY:' || { echo "перехват: '$out'"; status=1; }
+
+# stderr потомка уводится, иначе конца канала ждал бы сам тест, а не терминал
+printf '#!/bin/sh\n(sleep 5; echo late) 2>/dev/null &\necho early\n' > daemon
+chmod +x daemon
+start=$(ms)
+out=$(session "record log2" "./daemon" "record" "replay log2")
+took=$(($(ms) - start))
+[ "$took" -lt 4000 ] || { echo "фоновый потомок держит запись: $took мс"; status=1; }
+printf '%s\n' "$out" | grep -q '^early$' || { echo "фоновый потомок: '$out'"; status=1; }
+exit $status
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Перенаправления: <, >, >>, 2>, heredoc из строк приглашения и <<< у внешних программ
+# и у встроенных команд, вывод встроенной команды в файл мимо терминала
+# Запуск: redirect.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+session() { printf '%s\n' "$@" | timeout 20 "$term" 2>&1 | sed 's/^.*☿ .\[0m//; s/^\(> \)*//'; }
+run() { out=$(timeout 20 "$term" -c "$1" 2>&1); code=$?; }
+same() { cmp -s "$1" "$2" || { echo "$3: $(head -c 200 "$1")"; status=1; }; }
+
+printf 'b\na\nb\n' > in
+run "/bin/echo one > out && /bin/echo two >> out && /bin/echo three >> out"
+printf 'one\ntwo\nthree\n' > expected
+same out expected "> и >>"
+run "/bin/echo new > out"
+[ "$(cat out)" = new ] || { echo "> не обрезал файл: $(cat out)"; status=1; }
+run "/usr/bin/sort < in > out"
+printf 'a\nb\nb\n' > expected
+same out expected "< и >"
+run "/bin/ls missing 2> err > out"
+[ -s err ] && [ ! -s out ] && [ -z "$out" ] || { echo "2>: '$out', $(cat err)"; status=1; }
+run "/bin/cat <<< word"
+[ "$out" = word ] || { echo "<<<: '$out'"; status=1; }
+
+# Встроенная команда пишет в файл, а не в терминал; со stdin из файла работает внешняя программа
+run "grep b in > out"
+printf 'b\nb\n' > expected
+same out expected "grep >"
+[ -z "$out" ] || { echo "grep > вывел в терминал: '$out'"; status=1; }
+run "head -n 1 in >> out"
+printf 'b\nb\nb\n' > expected
+same out expected "head >>"
+run "wc -l < in"
+[ "$out" = 3 ] || { echo "wc <: '$out'"; status=1; }
+run "cat missing 2> err"
+[ -s err ] && [ -z "$out" ] || { echo "cat 2>: '$out', $(cat err)"; status=1; }
+run "/bin/echo x > nodir/out"
+[ "$code" = 1 ] || { echo "> в отсутствующий каталог: код $code, '$out'"; status=1; }
+for line in "/bin/echo >" "/bin/cat <" "/bin/echo a 2>"; do
+    run "$line"
+    [ "$code" = 2 ] || { echo "$line: код $code вместо 2"; status=1; }
+done
+
+# Тело heredoc читается строками приглашения до разделителя, отступы сохраняются
+out=$(session "/bin/cat <<EOF" "first" "  second" "EOF" "/bin/echo after" "/usr/bin/tr a-z A-Z << END" "x" "END")
+[ "$(printf '%s\n' "$out" | grep -v '^$' | tr '\n' '|')" = "first|  second|after|X|" ] || { echo "heredoc: '$out'"; status=1; }
+# Тело больше ёмкости канала: ребёнок читает memfd, а не канал
+awk 'BEGIN { for (i = 0; i < 20000; ++i) printf "heredoc line %d\n", i }' > body
+out=$({ echo "/usr/bin/wc -l <<EOF"; cat body; echo EOF; } | timeout 20 "$term" 2>&1 | sed 's/^.*☿ .\[0m//; s/^\(> \)*//' | grep -v '^$')
+[ "$out" = 20000 ] || { echo "большой heredoc: '$out'"; status=1; }
+exit $status
@@ -0,0 +1,44 @@
+#!/bin/sh
+# rm: корень, текущий и родительский каталоги не удаляются; глубокое дерево удаляется
+# при малом лимите дескрипторов и без перехода по символическим ссылкам
+# Запуск: remove.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+
+mkdir -p work/sub && touch work/sub/file
+cd work
+for path in . .. ./ .// sub/.. sub/. ../work/. "$dir/work/sub/.."; do
+    timeout 10 "$term" -c "rm -r $path" > /dev/null 2>&1 && { echo "rm -r $path: принято"; status=1; }
+done
+[ -f sub/file ] || { echo "защищённый каталог задет"; status=1; }
+cd ..
+
+# Корень проверяется от имени nobody: если защита сломана, удалить он почти ничего не сможет
+if [ "$(id -u)" = 0 ] && command -v setpriv > /dev/null; then
+    cp "$term" bin && chmod 755 "$dir" bin
+    for path in / // /.. /tmp/..; do
+        (cd / && timeout 10 setpriv --reuid=65534 --regid=65534 --clear-groups "$dir/bin" -c "rm -r $path") > /dev/null 2>&1 &&
+            { echo "rm -r $path: принято"; status=1; }
+    done
+fi
+
+# 1000 уровней не помещаются в 16 дескрипторов: обход отдаёт дескрипторы старших каталогов
+p=deep
+i=0
+while [ $i -lt 1000 ]; do
+    p=$p/d
+    i=$((i + 1))
+    [ $((i % 100)) = 0 ] && mkdir -p $p && touch $p/f$i
+done
+mkdir -p $p
+for j in 1 2 3 4 5 6 7 8; do mkdir -p deep/w$j/x/y && touch deep/w$j/x/y/z; done
+mkdir target && touch target/keep
+ln -s ../../target deep/w1/link
+ln -s "$dir/target" $p/link
+out=$(ulimit -n 16; timeout 60 "$term" -c 'rm -r deep' 2>&1) || { echo "ulimit -n 16: $out"; status=1; }
+[ -e deep ] && { echo "ulimit -n 16: дерево осталось"; status=1; }
+[ -f target/keep ] || { echo "удалено по ссылке"; status=1; }
+exit $status
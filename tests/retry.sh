@@ -0,0 +1,26 @@
+#!/bin/sh
+# retry: попытки запускает и отчёты пишет цикл событий, пока главный поток выполняет
+# свои команды; строки отчёта не рвутся и не смешиваются с выводом приглашения
+# Запуск: retry.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+
+# Третья попытка удаётся
+printf '#!/bin/sh\nn=$(cat count 2>/dev/null || echo 0)\nn=$((n + 1))\necho $n > count\n[ $n -ge 3 ]\n' > flaky
+chmod +x flaky
+i=0
+while [ $i -lt 300 ]; do : > "f$i"; i=$((i + 1)); done
+
+{ echo "retry -n 5 -d 10 ./flaky"; echo "retry -n 40 -d 0 /bin/false"
+  echo 'for f in f[0-9]*; do /bin/echo main $f; done'; sleep 3; echo killall; } | timeout 20 "$term" > out 2>&1
+grep -q "done after 3 attempts" out || { echo "flaky: $(grep retry out)"; status=1; }
+grep -q "failed after 40 attempts" out || { echo "false: $(grep retry out | tail -3)"; status=1; }
+[ "$(grep -c 'main f[0-9]*$' out)" = 300 ] || { echo "вывод приглашения: $(grep -c 'main f[0-9]*$' out) строк из 300"; status=1; }
+# Строка отчёта целиком: ни обрывков, ни склеек с выводом главного потока; приглашение
+# без перевода строки может стоять перед отчётом
+bad=$(sed 's/^.*☿ .\[0m//' out | grep '\] attempt ' | grep -Ev '^\[retry [0-9]+\] attempt [0-9]+/[0-9]+	exit [0-9]+	[0-9.e+-]+ ms$')
+[ -z "$bad" ] || { echo "рваные отчёты: $bad"; status=1; }
+exit $status
@@ -0,0 +1,32 @@
+#!/bin/sh
+# SIGINT в неинтерактивном терминале: -c и дочерние -s завершаются по сигналу,
+# без прощального вывода и kill всех заданий
+# Запуск: sigint.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+# Фоновые команды sh запускаются с игнорируемым SIGINT, env возвращает ему обработку по умолчанию
+start() { env --default-signal=INT "$term" -c "$1" > out 2>&1 & pid=$!; }
+
+interrupt() {
+    start "$1"
+    sleep 0.5
+    kill -INT "$pid"
+    wait "$pid"
+    code=$?
+    [ "$code" = 130 ] || { echo "$1: код $code вместо 130"; status=1; }
+    [ ! -s out ] || { echo "$1: лишний вывод: $(cat out)"; status=1; }
+}
+
+interrupt "/bin/sleep 5"
+# Правило dag выполняется дочерним term -s; SIGINT приходит ему, а не родителю
+printf 'all:\n    /bin/sleep 5\n' > Dagfile
+start "dag Dagfile all"
+sleep 0.5
+child=$(pgrep -P "$pid" term)
+[ -n "$child" ] && kill -INT "$child"
+wait "$pid"
+grep -q "🜏" out && { echo "dag: дочерний term вывел прощание"; status=1; }
+exit $status
@@ -0,0 +1,34 @@
+#!/bin/sh
+# sort: поразрядная сортировка в памяти и слияние сброшенных на диск прогонов дают тот же
+# порядок байтов, что sort из coreutils при LC_ALL=C
+# Запуск: sort.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+check() {
+    LC_ALL=C sort "$2" > expected
+    timeout 60 "$term" -c "sort $1 $2" > got 2>&1
+    cmp -s expected got || { echo "sort $1 $2: порядок расходится"; status=1; }
+}
+
+# Около 2 МиБ, вчетверо 8 МиБ: при -S 1 прогонов больше SORT_MERGE_FAN_IN. Общие префиксы
+# длиннее восьми байт, повторы, пустые строки, байты старше 0x7f
+awk 'BEGIN {
+    srand(7)
+    for (i = 0; i < 120000; i++) {
+        r = rand()
+        if (r < 0.3) printf "/usr/share/doc/pkg%d/file%d.txt\n", int(rand() * 500), int(rand() * 100000)
+        else if (r < 0.5) printf "%s line %d\n", rand() < 0.5 ? "INFO" : "WARN", int(rand() * 1000)
+        else if (r < 0.55) printf "\n"
+        else if (r < 0.6) printf "%c%c%d\n", 128 + int(rand() * 127), 65 + int(rand() * 26), int(rand() * 10)
+        else printf "%d\n", int(rand() * 1000000000)
+    }
+}' > input
+i=0
+while [ $i -lt 200 ]; do echo "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa$i"; i=$((i + 1)); done >> input
+cat input input input input > big
+check "" input
+check "-S 1" big
+exit $status
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Статусы завершения: код term -c, $? и PIPESTATUS в той же строке
+# Запуск: status.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+printf '#!/bin/sh\nexit 3\n' > e3
+printf '#!/bin/sh\nkill -TERM $$\n' > killed
+chmod +x e3 killed
+code() {
+    timeout 10 "$term" -c "$1" >/dev/null 2>&1
+    got=$?
+    [ "$got" = "$2" ] || { echo "$1: код $got вместо $2"; status=1; }
+}
+expect() {
+    out=$(timeout 10 "$term" -c "$1" 2>&1)
+    [ "$out" = "$2" ] || { echo "$1: получено '$out' вместо '$2'"; status=1; }
+}
+
+code 'true' 0
+code 'false' 1
+code './e3' 3
+code './killed' 143
+code 'no_such_command_here' 127
+code './e3 && echo no' 3
+code '/bin/cat /dev/null | ./e3' 3
+code './e3 | /bin/cat' 0
+expect 'false | true && echo $PIPESTATUS' '1 0'
+expect './killed | ./e3 | true && echo $PIPESTATUS' '143 3 0'
+expect './e3 | /bin/cat && echo [$?]' '[0]'
+expect 'x=1 && echo $PIPESTATUS' '0'
+exit $status
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Подстановка команд: $() и обратные кавычки, вложенность, разбиение на слова вне присваивания,
+# встроенные команды в процессе терминала и вывод больше ёмкости канала у внешних
+# Запуск: subst.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+expect() {
+    out=$(timeout 20 "$term" -c "$1" 2>&1)
+    [ "$out" = "$2" ] || { echo "$1: получено '$out' вместо '$2'"; status=1; }
+}
+
+printf 'b\na\nc\na\n' > f
+awk 'BEGIN { for (i = 0; i < 30000; ++i) printf "w%d\n", i }' > big
+expect '/bin/echo `/bin/echo q`' 'q'
+expect '/bin/echo pre$(/bin/echo mid)post' 'premidpost'
+expect '/bin/echo $(/bin/echo $(/bin/echo in) out)' 'in out'
+expect '/usr/bin/printf <%s> $(head -n 3 f)' '<b><a><c>'
+expect '/usr/bin/printf <%s> $(/bin/echo a && /bin/echo b)' '<a><b>'
+expect '/bin/echo $(grep a f | /usr/bin/wc -l)' '2'
+expect 'v=7 && /bin/echo $(/bin/echo $v)' '7'
+# Присваивание сохраняет перевод строки, подстановка переменной слова не делит
+expect 'x=$(head -n 2 f) && /bin/echo [$x]' '[b
+a]'
+# Вывод встроенной команды перехватывается целиком и не попадает в приглашение
+expect 'x=$(grep a f) && /bin/echo done' 'done'
+expect '/usr/bin/printf %s\n $(head -n 30000 big) | /usr/bin/wc -l' '30000'
+expect '/usr/bin/printf %s\n $(/bin/cat big) | /usr/bin/md5sum' "$(md5sum < big)"
+expect '/bin/echo [$(/bin/true)]' '[]'
+
+out=$(printf '%s\n' "function f /bin/echo fn" '/bin/echo [$(f)]' | timeout 20 "$term" 2>&1 | sed 's/^.*☿ .\[0m//' | grep '^\[')
+[ "$out" = "[fn]" ] || { echo "функция в подстановке: '$out'"; status=1; }
+exit $status
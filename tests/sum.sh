@@ -0,0 +1,54 @@
+#!/bin/sh
+# sum: контрольные векторы CRC32C, xxHash3 и BLAKE3 на входе i % 251 по длинам, пересекающим
+# границы блоков, фрагментов и параллельных поддеревьев BLAKE3; поток из FIFO даёт те же суммы
+# Запуск: sum.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+
+# Байты 0..250 по кругу; значения посчитаны эталонными пакетами xxhash и blake3 для Python
+# и табличной CRC32C
+i=0
+while [ $i -lt 251 ]; do printf "\\$(printf %o $i)"; i=$((i + 1)); done > block
+cp block pattern
+while [ "$(wc -c < pattern)" -lt 3145735 ]; do cat pattern pattern > double && mv double pattern; done
+check() {
+    head -c "$1" pattern > "in$1"
+    for pair in "crc32c $2" "xxh3 $3" "blake3 $4"; do
+        set -- "$1" $pair
+        out=$(timeout 20 "$term" -c "sum -a $2 in$1" 2>&1)
+        [ "$out" = "$3  in$1" ] || { echo "sum -a $2 длины $1: '$out' вместо $3"; status=1; }
+    done
+}
+printf '123456789' > check
+[ "$("$term" -c 'sum -a crc32c check')" = "e3069283  check" ] || { echo "crc32c 123456789"; status=1; }
+check 0 00000000 2d06800538d394c2 af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262
+check 1 527d5351 c44bdff4074eecdb 2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213
+check 3 92fd4bfa 5f4299fc161c9cbb e1be4d7a8ab5560aa4199eea339849ba8e293d55ca0a81006726d184519e647f
+check 4 d9331aa3 60dab036a58211f2 f30f5ab28fe047904037f77b6da4fea1e27241c5d132638d8bedce9d40494f32
+check 8 8a2cbc3b 3a1c2d7c85af88f8 2351207d04fc16ade43ccab08600939c7c1fa70a5c0aaca76063d04c3228eaeb
+check 9 7144c5a8 e9612598145bb9dc a0fc27e5d7318b723207637bdeeba4f7dcb22f7f9ec3e8b6f3588ddcd4fdf861
+check 16 d9c908eb 8355e3a6f61770db a6a492965517a830cb75fdb713465aa465f2f098233896fea44c1d98268bf9e3
+check 17 38435e17 9ef341a99de37328 8462aa7be93b09fda7b93cf9f9cddb703f6dd2cc0c8edd5f9eee092edf8abf0c
+check 128 30d9c515 85c6174c7ff4c46b f17e570564b26578c33bb7f44643f539624b05df1a76c81f30acd548c44b45ef
+check 129 f514629f ec7642b431ba3e5a 683aaae9f3c5ba37eaaf072aed0f9e30bac0865137bae68b1fde4ca2aebdcb12
+check 240 9f4f71d6 375a384d957fe865 45e1a0dc23dbe51733d7269a3c0f519c2a63b0718835b2b537677eba734db0d8
+check 241 54fe7516 02e8cd95421c6d02 749b36ae651c22e8567db692a6876e0ca4fd3daeb7aa8fa3ab2f642ccc69a8f6
+check 1024 2af62c0c e5d78bafa45b2aa5 42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7
+check 1025 c8d03add e95c42288f28186e d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444
+check 65536 0daafcde aaae63800707a868 68d647e619a930e7b1082f74f334b0c65a315725569bdc123f0ee11881717bfe
+check 1048577 760b5254 47a84c196fd973df 2f053cd7472cf0cd2f9adaf45c1180255b91b9a865404a63671a0ee5f792ed33
+check 3145735 7a7eb00d 62cb94c36b8a258f 8f3f67e881a256c8a2cc45cce1a0b500a1dd0500623fe5363fe7f77518267c5a
+
+# Канал читается потоком, а не через mmap
+mkfifo fifo
+for algorithm in crc32c xxh3 blake3; do
+    timeout 20 sh -c 'cat in1048577 > fifo' &
+    streamed=$(timeout 20 "$term" -c "sum -a $algorithm fifo" | cut -f1 -d' ')
+    wait
+    mapped=$(timeout 20 "$term" -c "sum -a $algorithm in1048577" | cut -f1 -d' ')
+    [ "$streamed" = "$mapped" ] || { echo "sum -a $algorithm из канала: $streamed вместо $mapped"; status=1; }
+done
+exit $status
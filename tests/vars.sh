@@ -0,0 +1,25 @@
+#!/bin/sh
+# Подстановка переменных: каждая команда раскрывается непосредственно перед запуском
+# Запуск: vars.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+expect() {
+    out=$(timeout 10 "$term" -c "$1" 2>&1)
+    [ "$out" = "$2" ] || { echo "$1: получено '$out' вместо '$2'"; status=1; }
+}
+
+expect 'x=5 && echo [$x]' '[5]'
+expect 'x=1 && x=${x}2 && echo [$x]' '[12]'
+expect 'y=$(echo q w) && echo [$y]' '[q w]'
+expect 'for i in a b; do echo [$i]; done' '[a]
+[b]'
+# Тело функции компилируется один раз, а $i берётся на каждой итерации
+expect 'true && function f for i in a $1; do echo [$i]; done && f c' '[a]
+[c]'
+expect 'true && function g n=$1 && g 7 && echo [$n]' '[7]'
+expect 'false | true && echo [$?]' '[0]'
+expect 'for i in 1; do false; echo [$?]; done' '[1]'
+exit $status
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Управляющие конструкции и пользовательские команды: if/while/for/case, function и alias
+# Запуск: vm.sh ПУТЬ_К_TERM
+term="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+status=0
+expect() {
+    out=$(timeout 10 "$term" -c "$1" 2>&1)
+    [ "$out" = "$2" ] || { echo "$1: получено '$out' вместо '$2'"; status=1; }
+}
+
+expect 'if false; then echo a; elif true; then echo b; else echo c; fi' 'b'
+expect 'if false; then echo a; else echo c; fi' 'c'
+expect 'case abc in x*) echo x;; a*|b*) echo ab;; *) echo other;; esac' 'ab'
+expect 'while false; do echo loop; done' ''
+printf 'x\n' > f1
+printf 'y\n' > f2
+expect 'for f in f*; do echo [$f]; done' '[f1]
+[f2]'
+# Скомпилированное тело функции выполняется при каждом вызове со своими аргументами
+expect 'true && function f for i in 1 2; do echo $i$1; done && f x && f y' '1x
+2x
+1y
+2y'
+expect 'true && function f function f echo second && f && f' 'second'
+timeout 10 "$term" -c 'true && function r r && r' | grep -q 'Слишком глубокая подстановка' || { echo "function r r: нет ошибки глубины"; status=1; }
+# Первое слово тела alias с его же именем — исходная команда, а не повторная подстановка
+expect 'true && alias echo=echo A && echo B && echo C' 'A B
+A C'
+expect 'true && alias uname=uname -s && uname' "$(uname -s)"
+expect 'true && alias echo=echo A && echo B | /bin/cat' 'A B'
+exit $status